@@ -65,6 +65,28 @@ namespace zsync2 {
         // you should set this to multiples of 4 kiB (4096), which is the block size used internally by zsync2
         // a good value might be 256 kiB (64 blocks, 4 kiB per block)
         // set to 0 0 to disable any optimizations
+        // a fixed threshold takes precedence over the adaptive optimization below
         void setRangesOptimizationThreshold(unsigned long newRangesOptimizationThreshold);
+
+        // when enabled, nearby ranges are combined based on the latency and throughput measured during the download,
+        // downloading a gap between two ranges whenever that is estimated to be faster than making another request
+        // for the second one; the estimates are updated as the download goes on
+        // enabled by default; disable to download only the data which is needed
+        void setAdaptiveRangesOptimization(bool enabled);
+
+        // number of connections over which to download the needed ranges from the server concurrently
+        // on high latency links, a few connections keep the link busy while each waits for a response
+        // defaults to 1; 0 is treated as 1
+        void setMaxParallelConnections(unsigned int newMaxParallelConnections);
+
+        // when enabled, requests several ranges at once (HTTP multipart/byteranges) to cut down the number of requests
+        // falls back to one range per request automatically if the server doesn't handle it (some CDNs don't)
+        // disabled by default
+        void setMultipleRangesPerRequest(bool enabled);
+
+        // number of requests to keep in flight as concurrent streams on one connection if the server speaks HTTP/2
+        // (negotiated automatically over HTTPS); each stream still asks for a single range unless multi-range is on
+        // defaults to 16; values up to the number of connections make no difference
+        void setMaxHttp2Streams(unsigned int newMaxHttp2Streams);
     };
 }
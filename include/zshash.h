@@ -39,6 +39,10 @@ namespace zsync2 {
             gcry_md_write(_handle, vector.data(), vector.size());
         }
 
+        void add(const char* data, size_t len) {
+            gcry_md_write(_handle, data, len);
+        }
+
         // this function may be called only once, the result will not change once the digest has been calculated
         std::string getHash() {
             const auto* buffer = gcry_md_read(_handle, _algorithm);
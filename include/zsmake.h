@@ -34,6 +34,11 @@ namespace zsync2 {
         // the server
         void setUrl(const std::string& url);
 
+        // treat the file as gzip compressed, and describe its uncompressed contents instead, along with a map of the
+        // compressed data (Z-Map) which allows clients to download only the parts of the compressed file they need
+        // the URL set with setUrl() then refers to the compressed file
+        void setLookInsideGZip(bool lookInsideGZip);
+
         // will be called for every log message issued by the code
         void setLogMessageCallback(std::function<void(std::string)> callback);
 
@@ -0,0 +1,54 @@
+/*
+ * zsync2
+ * ======
+ *
+ * zsrangeplanner.h: decides which ranges to merge into one request, based on measured latency and throughput.
+ */
+
+#pragma once
+
+namespace zsync2 {
+    /**
+     * Estimates the latency and throughput of the link to the server from the requests made so far, and derives from
+     * them the largest gap between two needed ranges which is faster to download along with them than to skip by
+     * making another request.
+     *
+     * Another request costs a round trip, shared between the requests in flight at the same time, whereas the gap
+     * costs its size divided by the throughput. The throughput is taken to be the best rate recently seen on a
+     * response, and the cost of a request whatever part of its duration that rate doesn't account for, which includes
+     * any delays on the server's side. Measurements are weighted towards recent ones, so the threshold follows
+     * changing conditions during a download.
+     */
+    class ZSyncRangePlanner {
+    private:
+        // exponentially decaying sums over the measurements made so far
+        double requests;
+        double overheadSum;
+
+        // best rate seen recently, slowly decaying so it can follow the link getting slower
+        double rate;
+
+    public:
+        ZSyncRangePlanner();
+
+    public:
+        // record the timings of requests that have completed, summed over them: the time from sending each request
+        // until the first byte of the response came back, the number of bytes in the response bodies and the time it
+        // took to receive them (all times in seconds)
+        void addMeasurement(int completedRequests, double latency, long long bytes, double transferTime);
+
+        // true once there is at least one measurement to go by
+        bool hasEstimate() const;
+
+        // average time a request takes on top of transferring its data, in seconds
+        double latency() const;
+
+        // rate at which data can be downloaded, in bytes per second
+        double throughput() const;
+
+        // largest gap between two ranges which should be downloaded rather than skipped, given the number of requests
+        // which are made concurrently
+        // 0 until there is an estimate, so the first requests are made as they are to measure the link
+        long long mergeThreshold(unsigned int requestsInFlight) const;
+    };
+}
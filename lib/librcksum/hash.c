@@ -37,22 +37,73 @@
 void rcksum_add_target_block(struct rcksum_state *z, zs_blockid b,
                              struct rsum r, void *checksum) {
     if (b < z->blocks) {
-        /* Get hash entry with checksums for this block */
-        struct hash_entry *e = &(z->blockhashes[b]);
-
         /* Enter checksums */
-        memcpy(e->checksum, checksum, z->checksum_bytes);
-        e->r.a = r.a & z->rsum_a_mask;
-        e->r.b = r.b;
+        memcpy(z->block_checksums + (size_t) b * z->checksum_bytes, checksum,
+               z->checksum_bytes);
+        z->block_rsums[b].a = r.a & z->rsum_a_mask;
+        z->block_rsums[b].b = r.b;
 
         /* New checksums invalidate any existing checksum hash tables */
-        if (z->rsum_hash) {
-            free(z->rsum_hash);
-            z->rsum_hash = NULL;
-            free(z->bithash);
-            z->bithash = NULL;
-        }
+        free_hash(z);
+    }
+}
+
+/* rcksum_add_target_blocks(self, from, n, data, rsum_bytes)
+ * As rcksum_add_target_block, for the n blocks from blockid from, from their
+ * records as stored in a .zsync: the last rsum_bytes bytes of the rsum, in
+ * network byte order, and then the checksum, for each block in turn.
+ */
+void rcksum_add_target_blocks(struct rcksum_state *z, zs_blockid from,
+                              zs_blockid n, const unsigned char *data,
+                              int rsum_bytes) {
+    const size_t reclen = rsum_bytes + z->checksum_bytes;
+    struct rsum *r;
+    unsigned char *c;
+    zs_blockid i;
+
+    if (from < 0 || from >= z->blocks)
+        return;
+    if (n > z->blocks - from)
+        n = z->blocks - from;
+
+    r = z->block_rsums + from;
+    c = z->block_checksums + (size_t) from * z->checksum_bytes;
+    for (i = 0; i < n; i++, data += reclen, c += z->checksum_bytes) {
+        uint32_t v = 0;
+        int k;
+
+        for (k = 0; k < rsum_bytes; k++)
+            v = v << 8 | data[k];
+        r[i].a = (v >> 16) & z->rsum_a_mask;
+        r[i].b = v & 0xffff;
+        memcpy(c, data + rsum_bytes, z->checksum_bytes);
     }
+
+    /* New checksums invalidate any existing checksum hash tables */
+    free_hash(z);
+}
+
+/* free_hash(self)
+ * Frees the hash tables, so that build_hash will build them afresh.
+ */
+void free_hash(struct rcksum_state *z) {
+    free(z->hash_keys);
+    z->hash_keys = NULL;
+    free(z->hash_heads);
+    z->hash_heads = NULL;
+    free(z->hash_ids);
+    z->hash_ids = NULL;
+    free(z->hash_pos);
+    z->hash_pos = NULL;
+    free(z->bithash);
+    z->bithash = NULL;
+}
+
+/* Return the key to hash the given block under */
+static unsigned block_rhash_key(const struct rcksum_state *z, zs_blockid id) {
+    const struct rsum *r = z->block_rsums + id;
+
+    return calc_rhash_key(r[0].b, z->seq_matches > 1 ? r[1].b : r[0].a);
 }
 
 /* build_hash(self)
@@ -61,45 +112,85 @@ void rcksum_add_target_block(struct rcksum_state *z, zs_blockid b,
  */
 int build_hash(struct rcksum_state *z) {
     zs_blockid id;
-    int i = 16;
+    unsigned h;
+    int i = 4, n;
 
-    /* Try hash size of 2^i; step down the value of i until we find a good size
-     */
-    while ((2 << (i - 1)) > z->blocks && i > 4)
-        i--;
+    /* Hash size of 2^i, keeping the table no more than half full so that
+     * probe sequences stay short */
+    while (i < 31 && (1u << i) < 2u * z->blocks)
+        i++;
 
     /* Allocate hash based on rsum */
-    z->hashmask = (2 << i) - 1;
-    z->rsum_hash = calloc(z->hashmask + 1, sizeof *(z->rsum_hash));
-    if (!z->rsum_hash)
+    z->hashmask = (1u << i) - 1;
+    z->hashshift = 32 - i;
+    z->hash_keys = malloc((z->hashmask + 1) * sizeof *(z->hash_keys));
+    z->hash_heads = malloc((z->hashmask + 1) * sizeof *(z->hash_heads));
+    z->hash_pos = malloc((z->blocks + 1) * sizeof *(z->hash_pos));
+
+    /* Allocate bit-table based on rsum, with at least BITHASH_BITS_PER_BLOCK
+     * bits per block, and no more than 2^28 bits */
+    {
+        int bits = 10;
+        while (bits < 28 && (1u << bits) < (unsigned)z->blocks * BITHASH_BITS_PER_BLOCK)
+            bits++;
+        z->bithashshift = 32 - bits;
+        z->bithash = calloc(1u << (bits - 3), 1);
+    }
+    if (!z->hash_keys || !z->hash_heads || !z->hash_pos || !z->bithash) {
+        free_hash(z);
         return 0;
+    }
+    for (h = 0; h <= z->hashmask; h++) {
+        z->hash_keys[h] = HASH_KEY_EMPTY;
+        z->hash_heads[h] = HASH_EMPTY;
+    }
 
-    /* Allocate bit-table based on rsum */
-    z->bithashmask = (2 << (i + BITHASHBITS)) - 1;
-    z->bithash = calloc(z->bithashmask + 1, 1);
-    if (!z->bithash) {
-        free(z->rsum_hash);
-        z->rsum_hash = NULL;
-        return 0;
+    /* Now fill in the hash tables. First find the slot for each block's key,
+     * counting the blocks for each slot in hash_heads[] (as -2 - count, to
+     * tell it from HASH_EMPTY) and noting the slot in hash_pos[]. Set the
+     * block's bit in the bithash at the same time, unless we have it already. */
+    for (id = 0; id < z->blocks; id++) {
+        unsigned key = block_rhash_key(z, id);
+
+        h = calc_rhash(z, key);
+        while (z->hash_heads[h] != HASH_EMPTY && z->hash_keys[h] != key)
+            h = (h + 1) & z->hashmask;
+        z->hash_keys[h] = key;
+        z->hash_heads[h] = (z->hash_heads[h] == HASH_EMPTY ? -2 : z->hash_heads[h]) - 1;
+        z->hash_pos[id] = h;
+
+        if (!already_got_block(z, id)) {
+            h = calc_bithash(z, z->block_rsums[id].b, key >> 16);
+            z->bithash[h >> 3] |= 1 << (h & 7);
+        }
     }
 
-    /* Now fill in the hash tables.
-     * Minor point: We do this in reverse order, because we're adding entries
-     * to the hash chains by prepending, so if we iterate over the data in
-     * reverse then the resulting hash chains have the blocks in normal order.
-     * That's improves our pattern of I/O when writing out identical blocks
-     * once we are processing data; we will write them in order. */
+    /* Give each key a run of hash_ids[], followed by a HASH_END, and point
+     * hash_heads[] at the end of it for now */
+    for (h = 0, n = 0; h <= z->hashmask; h++) {
+        if (z->hash_heads[h] != HASH_EMPTY) {
+            n += -2 - z->hash_heads[h];
+            z->hash_heads[h] = n++;
+        }
+    }
+    z->hash_ids = malloc(n * sizeof *(z->hash_ids));
+    if (!z->hash_ids) {
+        free_hash(z);
+        return 0;
+    }
+    for (h = 0; h <= z->hashmask; h++)
+        if (z->hash_heads[h] != HASH_EMPTY)
+            z->hash_ids[z->hash_heads[h]] = HASH_END;
+
+    /* And put the block ids in, filling each run from the end. We do this
+     * in reverse block order, so that the blocks with the same key end up in
+     * order. That improves our pattern of I/O when writing out identical
+     * blocks once we are processing data; we will write them in order.
+     * Blocks we already have (e.g. from a resumed file) go in as dropped. */
     for (id = z->blocks; id > 0;) {
-        /* Decrement the loop variable here, and get the hash entry. */
-        struct hash_entry *e = z->blockhashes + (--id);
-
-        /* Prepend to linked list for this hash entry */
-        unsigned h = calc_rhash(z, e);
-        e->next = z->rsum_hash[h & z->hashmask];
-        z->rsum_hash[h & z->hashmask] = e;
-
-        /* And set relevant bit in the bithash to 1 */
-        z->bithash[(h & z->bithashmask) >> 3] |= 1 << (h & 7);
+        h = z->hash_pos[--id];
+        z->hash_pos[id] = --z->hash_heads[h];
+        z->hash_ids[z->hash_pos[id]] = already_got_block(z, id) ? HASH_DROPPED : id;
     }
     return 1;
 }
@@ -109,21 +200,5 @@ int build_hash(struct rcksum_state *z) {
  * returned in a hash lookup again (e.g. because we now have the data)
  */
 void remove_block_from_hash(struct rcksum_state *z, zs_blockid id) {
-    struct hash_entry *t = &(z->blockhashes[id]);
-
-    struct hash_entry **p = &(z->rsum_hash[calc_rhash(z, t) & z->hashmask]);
-
-    while (*p != NULL) {
-        if (*p == t) {
-            if (t == z->rover) {
-                z->rover = t->next;
-            }
-            *p = (*p)->next;
-            return;
-        }
-        else {
-            p = &((*p)->next);
-        }
-    }
+    HASH_STORE(z->hash_ids[z->hash_pos[id]], HASH_DROPPED);
 }
-
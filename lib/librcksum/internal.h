@@ -17,16 +17,15 @@
 
 /* Internal data structures to the library. Not to be included by code outside librcksum. */
 
+#include <stdint.h>
+
 /* Two types of checksum -
  * rsum: rolling Adler-style checksum
  * checksum: hopefully-collision-resistant MD4 checksum of the block
  */
 
-struct hash_entry {
-    struct hash_entry *next;    /* next entry with the same rsum */
-    struct rsum r;
-    unsigned char checksum[CHECKSUM_SIZE];
-};
+/* Most blocks to checksum at once when following a run of matches */
+#define MD4_AHEAD 8
 
 /* An rcksum_state contains the set of checksums of the blocks of a target
  * file, and is used to apply the rsync algorithm to detect data in common with
@@ -47,65 +46,193 @@ struct rcksum_state {
     unsigned int context;       /* precalculated blocksize * seq_matches */
 
     /* These are used by the library. Note, not thread safe. */
-    const struct hash_entry *rover;
     int skip;                   /* skip forward on next submit_source_data */
 
     /* Internal; hint to rcksum_submit_source_data that it should try matching
-     * the following block of input data against the block ->next_match.
-     * next_known is a cached lookup of the id of the next block after that
-     * that we already have data for. */
-    const struct hash_entry *next_match;
+     * the following block of input data against the block ->next_match (or -1
+     * for none). next_known is a cached lookup of the id of the next block
+     * after that that we already have data for. */
+    zs_blockid next_match;
     zs_blockid next_known;
 
-    /* Hash table for rsync algorithm */
+    /* Checksums of the md4_ahead_n blocks starting at md4_ahead in the data
+     * being scanned, calculated together while following a run of matches;
+     * see calc_block_checksum. */
+    const unsigned char *md4_ahead;
+    size_t md4_ahead_n;
+    unsigned char md4_ahead_sums[MD4_AHEAD][CHECKSUM_SIZE];
+
+    /* Number of threads to use when scanning a seed file; 0 means one per
+     * online CPU. */
+    int threads;
+
+    /* While scanning a seed file, where the data being scanned came from: the
+     * src_len bytes at src_data are at src_offset in src_fd. Blocks found
+     * there are copied from the seed file when written, not from memory. */
+    const unsigned char *src_data;
+    size_t src_len;
+    off_t src_offset;
+    int src_fd;
+
+    /* The rsum and checksum of each block of the target, kept apart so that
+     * scanning the rsums doesn't pull the checksums into cache too. There are
+     * seq_matches spare (zero) rsums at the end, so that we can always look at
+     * the rsum of the block after any given block. Each checksum is
+     * checksum_bytes long. */
+    struct rsum *block_rsums;
+    unsigned char *block_checksums;
+
+    /* Hash table for rsync algorithm. This is open addressed with linear
+     * probing: each slot has a key (see calc_rhash_key) in hash_keys[], or
+     * HASH_KEY_EMPTY, and in hash_heads[] the index in hash_ids[] of the
+     * blocks with that key, or HASH_EMPTY if the slot is unused. The ids of
+     * the blocks with each key are together in hash_ids[], in order, ending
+     * with HASH_END. A block is removed by overwriting its entry (which
+     * hash_pos[] locates) with HASH_DROPPED. The threads scanning a seed file
+     * in parallel share hash_heads[] and hash_ids[] and change them as they
+     * go, so they are accessed with HASH_LOAD and HASH_STORE. */
     unsigned int hashmask;
-    struct hash_entry *blockhashes;
-    struct hash_entry **rsum_hash;
+    unsigned int hashshift;
+    unsigned int *hash_keys;
+    int *hash_heads;
+    zs_blockid *hash_ids;
+    int *hash_pos;
 
     /* And a 1-bit per rsum value table to allow fast negative lookups for hash
-     * values that don't occur in the target file. */
-    unsigned int bithashmask;
+     * values that don't occur in the target file. This has its own hash (see
+     * calc_bithash), with BITHASH_BITS_PER_BLOCK bits per block so that
+     * nearly all data which doesn't match is rejected here. */
+    unsigned int bithashshift;
     unsigned char *bithash;
 
-    /* Current state and stats for data collected by algorithm */
-    int numranges;
-    zs_blockid *ranges;
+    /* Current state and stats for data collected by algorithm. The blocks
+     * we have are recorded in bitmaps; see range.c */
+    uint64_t *known;
+    uint64_t *known_some;
+    uint64_t *known_all;
     int gotblocks;
     struct {
         int hashhit, weakhit, stronghit, checksummed;
     } stats;
 
-    /* Temp file for output */
+    /* Temp file for output, and the buffer (see writeback.c) through which
+     * blocks are written to it. write_error is the errno of the first write
+     * to fail, after which no more are made. */
     char *filename;
     int fd;
+    struct writeback *wb;
+    int write_error;
 };
 
-#define BITHASHBITS 3
+#define BITHASH_BITS_PER_BLOCK 32
 
-/* rcksum_state methods */
+#define HASH_KEY_EMPTY 0xffffffffu
+#define HASH_EMPTY (-1)
+#define HASH_DROPPED (-1)
+#define HASH_END (-2)
 
-/* From a hash entry, return the corresponding blockid */
-static inline zs_blockid get_HE_blockid(const struct rcksum_state *z,
-                                        const struct hash_entry *e) {
-    return e - z->blockhashes;
-}
+/* Read and write an entry of hash_heads[] or hash_ids[]. Relaxed atomics are
+ * enough: another thread seeing the old value just looks at a dropped block
+ * again, or skips it again. */
+#define HASH_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define HASH_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
 
+/* Roll the rsum (a, b) forward one byte, oldc leaving the window, newc entering */
+#define UPDATE_RSUM(a, b, oldc, newc, bshift) do { (a) += ((unsigned char)(newc)) - ((unsigned char)(oldc)); (b) += (a) - ((oldc) << (bshift)); } while (0)
+
+/* rcksum_state methods */
+
+int init_ranges(struct rcksum_state *z);
+int copy_ranges(struct rcksum_state *z, const struct rcksum_state *from);
+int merge_ranges(struct rcksum_state *z, const struct rcksum_state *from);
+void free_ranges(struct rcksum_state *z);
 void add_to_ranges(struct rcksum_state *z, zs_blockid n);
 int already_got_block(struct rcksum_state *z, zs_blockid n);
 zs_blockid next_known_block(struct rcksum_state *rs, zs_blockid x);
 
-struct hash_entry *calc_hash_entry(void *data, size_t len);
+/* Return the checksum stored for the given block */
+static inline const unsigned char *block_checksum(const struct rcksum_state *z,
+                                                  zs_blockid id) {
+    return z->block_checksums + (size_t) id * z->checksum_bytes;
+}
+
+/* Make the key under which a block is hashed, from the b of its rsum (b) and
+ * either the b of the next block's rsum, or its own a if seq_matches is 1 (x).
+ * With seq_matches 1 this is the whole rsum, so equal keys mean a weak match.
+ */
+static inline unsigned calc_rhash_key(unsigned short b, unsigned short x) {
+    return b | (unsigned) x << 16;
+}
 
-/* Hash the checksum values for the given hash entry and return the hash value */
+/* Return the home slot for a key in the rsum hash */
 static inline unsigned calc_rhash(const struct rcksum_state *const z,
-                                  const struct hash_entry *const e) {
-    unsigned h = e[0].r.b;
+                                  unsigned key) {
+    return (key * 0x9e3779b1u) >> z->hashshift;
+}
 
-    h ^= ((z->seq_matches > 1) ? e[1].r.b
-        : e[0].r.a & z->rsum_a_mask) << BITHASHBITS;
+/* Find the blocks with the given key. Returns a pointer to the first of their
+ * ids in hash_ids[], or NULL if there's no such key (or no blocks are left
+ * with it). The keys in a probe sequence are together in memory, so a miss
+ * usually costs just one cache line. */
+static inline const zs_blockid *rhash_lookup(struct rcksum_state *z,
+                                             unsigned key) {
+    unsigned h = calc_rhash(z, key);
+
+    for (;; h = (h + 1) & z->hashmask) {
+        unsigned k = z->hash_keys[h];
+
+        int head = HASH_LOAD(z->hash_heads[h]);
+
+        if (k == key && head != HASH_EMPTY) {
+            const zs_blockid *ids = z->hash_ids + head;
+
+            /* Skip over blocks already dropped from the front, and move the
+             * start up so we needn't do so again. Another thread may be doing
+             * the same, but either way only dropped blocks are skipped. */
+            if (HASH_LOAD(*ids) == HASH_DROPPED) {
+                while (HASH_LOAD(*ids) == HASH_DROPPED)
+                    ids++;
+                HASH_STORE(z->hash_heads[h], (int) (ids - z->hash_ids));
+            }
+            return HASH_LOAD(*ids) != HASH_END ? ids : NULL;
+        }
+        if (k == HASH_KEY_EMPTY && head == HASH_EMPTY)
+            return NULL;
+    }
+}
+
+/* Hash the same values as calc_rhash_key - b is the first rsum's b, x is the
+ * second rsum's b, or the first's a if seq_matches is 1 - to give the bit to
+ * test in the bithash. Multiplicative hashing mixes all 32 bits into the top
+ * bits, which we keep. */
+static inline unsigned calc_bithash(const struct rcksum_state *const z,
+                                    unsigned short b, unsigned short x) {
+    return (calc_rhash_key(b, x) * 0x9e3779b1u) >> z->bithashshift;
+}
 
-    return h;
+/* Is the given bithash bit set? */
+static inline int bithash_test(const struct rcksum_state *const z, unsigned h) {
+    return (z->bithash[h >> 3] & (1 << (h & 7))) != 0;
 }
 
 int build_hash(struct rcksum_state *z);
+void free_hash(struct rcksum_state *z);
+
+/* From scan.c; next_candidate picks the fastest of the others for this CPU */
+int next_candidate(struct rcksum_state *z, const unsigned char *data, int x, int end);
+int next_candidate_scalar(struct rcksum_state *z, const unsigned char *data, int x, int end);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+int next_candidate_sse41(struct rcksum_state *z, const unsigned char *data, int x, int end);
+int next_candidate_avx2(struct rcksum_state *z, const unsigned char *data, int x, int end);
+#endif
 void remove_block_from_hash(struct rcksum_state *z, zs_blockid id);
+
+/* From writeback.c; these return 0 or an errno value */
+struct writeback *writeback_init(int fd, int blockshift, int threaded);
+int writeback_add(struct writeback *wb, const unsigned char *data,
+                  zs_blockid bfrom, zs_blockid bto);
+int writeback_add_copy(struct writeback *wb, int src_fd, off_t src,
+                       zs_blockid bfrom, zs_blockid bto);
+int writeback_sync(struct writeback *wb);
+int writeback_end(struct writeback *wb);
+int write_out(int fd, const unsigned char *data, off_t len, off_t offset);
@@ -54,4 +54,8 @@ char	*MD4Data(const uint8_t *, size_t, char *)
 		ZS_DECL_BOUNDED(__string__,1,2)
 		ZS_DECL_BOUNDED(__minbytes__,3,MD4_DIGEST_STRING_LENGTH);
 
+/* From md4multi.c */
+void	 MD4DataMulti(uint8_t (*)[MD4_DIGEST_LENGTH], const uint8_t *, size_t,
+	    size_t);
+
 #endif /* _MD4_H_ */
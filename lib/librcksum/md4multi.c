@@ -0,0 +1,329 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* MD4 of several equal length messages at once. Each MD4 step depends on the
+ * one before, so a single digest leaves most of a modern CPU idle; instead we
+ * put one message in each 32-bit lane of a SIMD register and run them all
+ * through the algorithm together. Messages of the same length need the same
+ * number of blocks and the same padding, so the lanes never diverge. */
+
+#include "zsglobal.h"
+
+#include <string.h>
+#include <sys/types.h>
+
+#include "md4.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define MD4_MULTI_X86
+# include <immintrin.h>
+#endif
+
+#define PUT_32BIT_LE(cp, value) do {					\
+	(cp)[3] = (value) >> 24;					\
+	(cp)[2] = (value) >> 16;					\
+	(cp)[1] = (value) >> 8;						\
+	(cp)[0] = (value); } while (0)
+
+/* make_tail(buf, data, len)
+ * Writes the final block(s) of the MD4 of the len byte message data[] - the
+ * bytes after the last whole block, then the padding - to buf[], which must
+ * hold 2 * MD4_BLOCK_LENGTH bytes. Returns the number of blocks written. */
+static int make_tail(uint8_t *buf, const uint8_t *data, size_t len) {
+    size_t rem = len % MD4_BLOCK_LENGTH;
+    int blocks = rem + 1 + 8 > MD4_BLOCK_LENGTH ? 2 : 1;
+    uint64_t bits = (uint64_t) len << 3;
+    int i;
+
+    memset(buf, 0, blocks * MD4_BLOCK_LENGTH);
+    memcpy(buf, data + len - rem, rem);
+    buf[rem] = 0x80;
+    for (i = 0; i < 8; i++)
+        buf[blocks * MD4_BLOCK_LENGTH - 8 + i] = bits >> (8 * i);
+    return blocks;
+}
+
+/* MD4 round steps, for whichever vector type the macros VADD, VAND, VOR, VXOR,
+ * VSET1 and VROL (rotate left) are defined for */
+#define VF1(x, y, z) VXOR(z, VAND(x, VXOR(y, z)))
+#define VF2(x, y, z) VOR(VAND(x, y), VAND(z, VOR(x, y)))
+#define VF3(x, y, z) VXOR(VXOR(x, y), z)
+
+#define VSTEP(f, w, x, y, z, data, s) \
+    (w = VROL(VADD(VADD(w, f(x, y, z)), data), s))
+
+#define VROUNDS(a, b, c, d, in) do {                                    \
+    const VTYPE k2 = VSET1(0x5a827999), k3 = VSET1(0x6ed9eba1);        \
+    VSTEP(VF1, a, b, c, d, in[ 0],  3);                                 \
+    VSTEP(VF1, d, a, b, c, in[ 1],  7);                                 \
+    VSTEP(VF1, c, d, a, b, in[ 2], 11);                                 \
+    VSTEP(VF1, b, c, d, a, in[ 3], 19);                                 \
+    VSTEP(VF1, a, b, c, d, in[ 4],  3);                                 \
+    VSTEP(VF1, d, a, b, c, in[ 5],  7);                                 \
+    VSTEP(VF1, c, d, a, b, in[ 6], 11);                                 \
+    VSTEP(VF1, b, c, d, a, in[ 7], 19);                                 \
+    VSTEP(VF1, a, b, c, d, in[ 8],  3);                                 \
+    VSTEP(VF1, d, a, b, c, in[ 9],  7);                                 \
+    VSTEP(VF1, c, d, a, b, in[10], 11);                                 \
+    VSTEP(VF1, b, c, d, a, in[11], 19);                                 \
+    VSTEP(VF1, a, b, c, d, in[12],  3);                                 \
+    VSTEP(VF1, d, a, b, c, in[13],  7);                                 \
+    VSTEP(VF1, c, d, a, b, in[14], 11);                                 \
+    VSTEP(VF1, b, c, d, a, in[15], 19);                                 \
+                                                                        \
+    VSTEP(VF2, a, b, c, d, VADD(in[ 0], k2),  3);                       \
+    VSTEP(VF2, d, a, b, c, VADD(in[ 4], k2),  5);                       \
+    VSTEP(VF2, c, d, a, b, VADD(in[ 8], k2),  9);                       \
+    VSTEP(VF2, b, c, d, a, VADD(in[12], k2), 13);                       \
+    VSTEP(VF2, a, b, c, d, VADD(in[ 1], k2),  3);                       \
+    VSTEP(VF2, d, a, b, c, VADD(in[ 5], k2),  5);                       \
+    VSTEP(VF2, c, d, a, b, VADD(in[ 9], k2),  9);                       \
+    VSTEP(VF2, b, c, d, a, VADD(in[13], k2), 13);                       \
+    VSTEP(VF2, a, b, c, d, VADD(in[ 2], k2),  3);                       \
+    VSTEP(VF2, d, a, b, c, VADD(in[ 6], k2),  5);                       \
+    VSTEP(VF2, c, d, a, b, VADD(in[10], k2),  9);                       \
+    VSTEP(VF2, b, c, d, a, VADD(in[14], k2), 13);                       \
+    VSTEP(VF2, a, b, c, d, VADD(in[ 3], k2),  3);                       \
+    VSTEP(VF2, d, a, b, c, VADD(in[ 7], k2),  5);                       \
+    VSTEP(VF2, c, d, a, b, VADD(in[11], k2),  9);                       \
+    VSTEP(VF2, b, c, d, a, VADD(in[15], k2), 13);                       \
+                                                                        \
+    VSTEP(VF3, a, b, c, d, VADD(in[ 0], k3),  3);                       \
+    VSTEP(VF3, d, a, b, c, VADD(in[ 8], k3),  9);                       \
+    VSTEP(VF3, c, d, a, b, VADD(in[ 4], k3), 11);                       \
+    VSTEP(VF3, b, c, d, a, VADD(in[12], k3), 15);                       \
+    VSTEP(VF3, a, b, c, d, VADD(in[ 2], k3),  3);                       \
+    VSTEP(VF3, d, a, b, c, VADD(in[10], k3),  9);                       \
+    VSTEP(VF3, c, d, a, b, VADD(in[ 6], k3), 11);                       \
+    VSTEP(VF3, b, c, d, a, VADD(in[14], k3), 15);                       \
+    VSTEP(VF3, a, b, c, d, VADD(in[ 1], k3),  3);                       \
+    VSTEP(VF3, d, a, b, c, VADD(in[ 9], k3),  9);                       \
+    VSTEP(VF3, c, d, a, b, VADD(in[ 5], k3), 11);                       \
+    VSTEP(VF3, b, c, d, a, VADD(in[13], k3), 15);                       \
+    VSTEP(VF3, a, b, c, d, VADD(in[ 3], k3),  3);                       \
+    VSTEP(VF3, d, a, b, c, VADD(in[11], k3),  9);                       \
+    VSTEP(VF3, c, d, a, b, VADD(in[ 7], k3), 11);                       \
+    VSTEP(VF3, b, c, d, a, VADD(in[15], k3), 15);                       \
+} while (0)
+
+#ifdef MD4_MULTI_X86
+
+#define VTYPE __m128i
+#define VADD(x, y) _mm_add_epi32(x, y)
+#define VAND(x, y) _mm_and_si128(x, y)
+#define VOR(x, y) _mm_or_si128(x, y)
+#define VXOR(x, y) _mm_xor_si128(x, y)
+#define VSET1(x) _mm_set1_epi32(x)
+#define VROL(x, s) _mm_or_si128(_mm_slli_epi32(x, s), _mm_srli_epi32(x, 32 - (s)))
+
+/* Run the four lanes' states through the MD4 blocks at p[0..3]. The 16 words
+ * of each block are loaded 4 at a time from each lane and transposed, so that
+ * in[i] has word i of every lane. */
+__attribute__((target("sse2")))
+static void md4_blocks_sse2(__m128i state[4], const uint8_t *const p[4],
+                            size_t blocks) {
+    size_t off;
+
+    for (off = 0; off < blocks * MD4_BLOCK_LENGTH; off += MD4_BLOCK_LENGTH) {
+        __m128i in[16];
+        __m128i a = state[0], b = state[1], c = state[2], d = state[3];
+        int i;
+
+        for (i = 0; i < 4; i++) {
+            __m128i r0 = _mm_loadu_si128((const __m128i *)(p[0] + off + 16 * i));
+            __m128i r1 = _mm_loadu_si128((const __m128i *)(p[1] + off + 16 * i));
+            __m128i r2 = _mm_loadu_si128((const __m128i *)(p[2] + off + 16 * i));
+            __m128i r3 = _mm_loadu_si128((const __m128i *)(p[3] + off + 16 * i));
+            __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+            __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+            __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+            __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+            in[4 * i + 0] = _mm_unpacklo_epi64(t0, t1);
+            in[4 * i + 1] = _mm_unpackhi_epi64(t0, t1);
+            in[4 * i + 2] = _mm_unpacklo_epi64(t2, t3);
+            in[4 * i + 3] = _mm_unpackhi_epi64(t2, t3);
+        }
+
+        VROUNDS(a, b, c, d, in);
+
+        state[0] = _mm_add_epi32(state[0], a);
+        state[1] = _mm_add_epi32(state[1], b);
+        state[2] = _mm_add_epi32(state[2], c);
+        state[3] = _mm_add_epi32(state[3], d);
+    }
+}
+
+/* MD4 of the n (up to four) len byte messages at data, data + len, ...
+ * Unused lanes just repeat the first message. */
+__attribute__((target("sse2")))
+static void md4_multi_sse2(uint8_t (*digests)[MD4_DIGEST_LENGTH],
+                           const uint8_t *data, size_t len, size_t n) {
+    uint8_t tail[4][2 * MD4_BLOCK_LENGTH];
+    const uint8_t *p[4];
+    __m128i state[4];
+    uint32_t out[4][4];
+    size_t i;
+    int j, tail_blocks = 0;
+
+    state[0] = _mm_set1_epi32(0x67452301);
+    state[1] = _mm_set1_epi32(0xefcdab89);
+    state[2] = _mm_set1_epi32(0x98badcfe);
+    state[3] = _mm_set1_epi32(0x10325476);
+
+    for (i = 0; i < 4; i++)
+        p[i] = data + (i < n ? i : 0) * len;
+    md4_blocks_sse2(state, p, len / MD4_BLOCK_LENGTH);
+
+    for (i = 0; i < 4; i++) {
+        tail_blocks = make_tail(tail[i], p[i], len);
+        p[i] = tail[i];
+    }
+    md4_blocks_sse2(state, p, tail_blocks);
+
+    for (j = 0; j < 4; j++)
+        _mm_storeu_si128((__m128i *) out[j], state[j]);
+    for (i = 0; i < n; i++)
+        for (j = 0; j < 4; j++)
+            PUT_32BIT_LE(digests[i] + 4 * j, out[j][i]);
+}
+
+#undef VTYPE
+#undef VADD
+#undef VAND
+#undef VOR
+#undef VXOR
+#undef VSET1
+#undef VROL
+
+#define VTYPE __m256i
+#define VADD(x, y) _mm256_add_epi32(x, y)
+#define VAND(x, y) _mm256_and_si256(x, y)
+#define VOR(x, y) _mm256_or_si256(x, y)
+#define VXOR(x, y) _mm256_xor_si256(x, y)
+#define VSET1(x) _mm256_set1_epi32(x)
+#define VROL(x, s) _mm256_or_si256(_mm256_slli_epi32(x, s), _mm256_srli_epi32(x, 32 - (s)))
+
+/* As md4_blocks_sse2, for eight lanes. Each 32 byte row from a lane is split
+ * into its 128-bit halves and the lanes are paired up, so that the usual 4x4
+ * transpose within each half gives 8 words of every lane. */
+__attribute__((target("avx2")))
+static void md4_blocks_avx2(__m256i state[4], const uint8_t *const p[8],
+                            size_t blocks) {
+    size_t off;
+
+    for (off = 0; off < blocks * MD4_BLOCK_LENGTH; off += MD4_BLOCK_LENGTH) {
+        __m256i in[16];
+        __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+        int i, k;
+
+        for (i = 0; i < 2; i++) {
+            __m256i r[8];
+
+            for (k = 0; k < 8; k++)
+                r[k] = _mm256_loadu_si256((const __m256i *)(p[k] + off + 32 * i));
+
+            /* Put lanes k and k + 4 in the two halves of each register, for
+             * the first 4 words and then the last 4 words of the row */
+            for (k = 0; k < 4; k++) {
+                __m256i lo = _mm256_permute2x128_si256(r[k], r[k + 4], 0x20);
+                __m256i hi = _mm256_permute2x128_si256(r[k], r[k + 4], 0x31);
+                r[k] = lo;
+                r[k + 4] = hi;
+            }
+            for (k = 0; k < 2; k++) {
+                __m256i *q = r + 4 * k;
+                __m256i t0 = _mm256_unpacklo_epi32(q[0], q[1]);
+                __m256i t1 = _mm256_unpacklo_epi32(q[2], q[3]);
+                __m256i t2 = _mm256_unpackhi_epi32(q[0], q[1]);
+                __m256i t3 = _mm256_unpackhi_epi32(q[2], q[3]);
+
+                in[8 * i + 4 * k + 0] = _mm256_unpacklo_epi64(t0, t1);
+                in[8 * i + 4 * k + 1] = _mm256_unpackhi_epi64(t0, t1);
+                in[8 * i + 4 * k + 2] = _mm256_unpacklo_epi64(t2, t3);
+                in[8 * i + 4 * k + 3] = _mm256_unpackhi_epi64(t2, t3);
+            }
+        }
+
+        VROUNDS(a, b, c, d, in);
+
+        state[0] = _mm256_add_epi32(state[0], a);
+        state[1] = _mm256_add_epi32(state[1], b);
+        state[2] = _mm256_add_epi32(state[2], c);
+        state[3] = _mm256_add_epi32(state[3], d);
+    }
+}
+
+/* As md4_multi_sse2, for up to eight messages */
+__attribute__((target("avx2")))
+static void md4_multi_avx2(uint8_t (*digests)[MD4_DIGEST_LENGTH],
+                           const uint8_t *data, size_t len, size_t n) {
+    uint8_t tail[8][2 * MD4_BLOCK_LENGTH];
+    const uint8_t *p[8];
+    __m256i state[4];
+    uint32_t out[4][8];
+    size_t i;
+    int j, tail_blocks = 0;
+
+    state[0] = _mm256_set1_epi32(0x67452301);
+    state[1] = _mm256_set1_epi32(0xefcdab89);
+    state[2] = _mm256_set1_epi32(0x98badcfe);
+    state[3] = _mm256_set1_epi32(0x10325476);
+
+    for (i = 0; i < 8; i++)
+        p[i] = data + (i < n ? i : 0) * len;
+    md4_blocks_avx2(state, p, len / MD4_BLOCK_LENGTH);
+
+    for (i = 0; i < 8; i++) {
+        tail_blocks = make_tail(tail[i], p[i], len);
+        p[i] = tail[i];
+    }
+    md4_blocks_avx2(state, p, tail_blocks);
+
+    for (j = 0; j < 4; j++)
+        _mm256_storeu_si256((__m256i *) out[j], state[j]);
+    for (i = 0; i < n; i++)
+        for (j = 0; j < 4; j++)
+            PUT_32BIT_LE(digests[i] + 4 * j, out[j][i]);
+}
+
+#endif
+
+/* MD4DataMulti(digests, data, len, n)
+ * Puts in digests[i] the MD4 of the len bytes at data + i * len, for each i
+ * from 0 to n - 1; i.e. the MD4 of each of n consecutive blocks of data. */
+void MD4DataMulti(uint8_t (*digests)[MD4_DIGEST_LENGTH], const uint8_t *data,
+                  size_t len, size_t n) {
+#ifdef MD4_MULTI_X86
+    /* Do eight at a time with AVX2, or four with SSE2. A part filled pass
+     * still beats doing two or more one at a time. */
+    if (n >= 2 && __builtin_cpu_supports("avx2")) {
+        for (; n >= 5; n -= 8 < n ? 8 : n, data += 8 * len, digests += 8)
+            md4_multi_avx2(digests, data, len, n < 8 ? n : 8);
+    }
+    if (n >= 2 && __builtin_cpu_supports("sse2")) {
+        for (; n >= 2; n -= 4 < n ? 4 : n, data += 4 * len, digests += 4)
+            md4_multi_sse2(digests, data, len, n < 4 ? n : 4);
+    }
+#endif
+    for (; n; n--, data += len, digests++) {
+        MD4_CTX ctx;
+
+        MD4Init(&ctx);
+        MD4Update(&ctx, data, len);
+        MD4Final(*digests, &ctx);
+    }
+}
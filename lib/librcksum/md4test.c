@@ -23,6 +23,26 @@
 // From RFC1320
 const char correct_checksum[MD4_DIGEST_LENGTH] = {0xd7, 0x9e, 0x1c, 0x30, 0x8a, 0xa5, 0xbb, 0xcd, 0xee, 0xa8, 0xed, 0x63, 0xdf, 0x41, 0x2d, 0xa9 };
 
+/* Check MD4DataMulti against MD4Update for n blocks of len bytes */
+static int check_multi(const uint8_t *data, size_t len, size_t n)
+{
+	uint8_t digests[20][MD4_DIGEST_LENGTH];
+	size_t i;
+
+	MD4DataMulti(digests, data, len, n);
+	for (i = 0; i < n; i++) {
+		MD4_CTX ctx;
+		uint8_t digest[MD4_DIGEST_LENGTH];
+
+		MD4Init(&ctx);
+		MD4Update(&ctx, data + i * len, len);
+		MD4Final(digest, &ctx);
+		if (memcmp(digest, digests[i], MD4_DIGEST_LENGTH))
+			return 1;
+	}
+	return 0;
+}
+
 int main(void)
 {
 	MD4_CTX ctx;
@@ -34,7 +54,26 @@ int main(void)
 	{
 		uint8_t digest[MD4_DIGEST_LENGTH];
 		MD4Final(digest,&ctx);
-		exit(memcmp(digest,correct_checksum,MD4_DIGEST_LENGTH));
+		if (memcmp(digest,correct_checksum,MD4_DIGEST_LENGTH))
+			exit(1);
+	}
+
+	/* Every batch size up to 20, so that each SIMD width and the scalar
+	 * code all get used, with lengths needing one or two padding blocks */
+	{
+		static const size_t lens[] = { 0, 26, 55, 56, 64, 120, 2048 };
+		uint8_t *data = malloc(20 * 2048);
+		size_t i, l, n;
+
+		if (!data)
+			exit(2);
+		for (i = 0; i < 20 * 2048; i++)
+			data[i] = rand();
+		for (l = 0; l < sizeof(lens) / sizeof(lens[0]); l++)
+			for (n = 1; n <= 20; n++)
+				if (check_multi(data, lens[l], n))
+					exit(1);
+		free(data);
 	}
 
     return 0;
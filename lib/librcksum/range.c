@@ -16,10 +16,15 @@
  */
 
 /* Manage storage of the set of ranges in the target file that we have so far
- * got data for. */
+ * got data for. This is a bitmap, a bit per block, with two summary bitmaps
+ * over its words: one with a bit set for each word with any blocks known, and
+ * one for each word with all of them known. So adding a block is constant
+ * time whatever the pattern of blocks known, and looking for the next known
+ * or unknown block skips 64 words at a time over runs of either. */
 
 #include "zsglobal.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -31,96 +36,173 @@
 #include "rcksum.h"
 #include "internal.h"
 
-/* r = range_before_block(self, x)
- * This determines which of the existing known ranges x falls in.
- * It returns -1 if it is inside an existing range (it doesn't tell you which
- *  one; if you already have it, that usually is enough to know).
- * Or it returns 0 if x is before the 1st range;
- * 1 if it is between ranges 1 and 2 (array indexes 0 and 1)
- * ...
- * numranges if it is after the last range
- */
-static int range_before_block(const struct rcksum_state* rs, zs_blockid x) {
-    /* Lowest number and highest number block that it could be inside (0 based) */
-    register int min = 0, max = rs->numranges-1;
-
-    /* By bisection */
-    for (; min<=max;) {
-        /* Range number to compare against */
-        register int r = (max+min)/2;
-
-        if (x > rs->ranges[2*r+1]) min = r+1;  /* After range r */
-        else if (x < rs->ranges[2*r]) max = r-1;/* Before range r */
-            else return -1;                     /* In range r */
+#define KNOWN_BITS 64
+
+/* Index of the lowest bit set in the (non-zero) word w */
+static inline int lowest_bit(uint64_t w) {
+#ifdef __GNUC__
+    return __builtin_ctzll(w);
+#else
+    int i = 0;
+    while (!(w & 1)) {
+        w >>= 1;
+        i++;
     }
+    return i;
+#endif
+}
 
-    /* If we reach here, we know min = max + 1 and we were below range max+1
-     * and above range min-1.
-     * So we're between range max and max + 1
-     * So we return max + 1  (return value is 1 based)  ( = min )
-     */
-    return min;
+/* Mask of the bits of a word from bit i up */
+#define BITS_FROM(i) (~(uint64_t) 0 << (i))
+
+/* known_words(self)
+ * Number of words in ->known. There is always a bit for block ->blocks (and
+ * any to the end of its word), which is set, so that scans for known blocks
+ * stop there. */
+static size_t known_words(const struct rcksum_state *rs) {
+    return (size_t) rs->blocks / KNOWN_BITS + 1;
 }
 
-/* add_to_ranges(rs, blockid)
- * Mark the given blockid as known, updating the stored known ranges
- * appropriately */
-void add_to_ranges(struct rcksum_state *rs, zs_blockid x) {
-    int r = range_before_block(rs, x);
+/* init_ranges(self)
+ * Allocates the record of blocks known, with none known yet.
+ * Returns 0, or -1 if out of memory. */
+int init_ranges(struct rcksum_state *rs) {
+    size_t words = known_words(rs);
+    size_t summary = (words + KNOWN_BITS - 1) / KNOWN_BITS;
 
-    if (r == -1) {
-        /* Already have this block */
+    rs->known = calloc(words, sizeof *rs->known);
+    rs->known_some = calloc(summary, sizeof *rs->known_some);
+    rs->known_all = calloc(summary, sizeof *rs->known_all);
+    if (!rs->known || !rs->known_some || !rs->known_all) {
+        free_ranges(rs);
+        return -1;
     }
-    else {
-        rs->gotblocks++;
-
-        /* If between two ranges and exactly filling the hole between them,
-         * merge them */
-        if (r > 0 && r < rs->numranges
-            && rs->ranges[2 * (r - 1) + 1] == x - 1
-            && rs->ranges[2 * r] == x + 1) {
-
-            // This block fills the gap between two areas that we have got completely. Merge the adjacent ranges
-            rs->ranges[2 * (r - 1) + 1] = rs->ranges[2 * r + 1];
-            memmove(&rs->ranges[2 * r], &rs->ranges[2 * r + 2],
-                    (rs->numranges - r - 1) * sizeof(rs->ranges[0]) * 2);
-            rs->numranges--;
-        }
 
-        /* If adjoining a range below, add to it */
-        else if (r > 0 && rs->numranges && rs->ranges[2 * (r - 1) + 1] == x - 1) {
-            rs->ranges[2 * (r - 1) + 1] = x;
-        }
+    /* The bits past the end of the file */
+    rs->known[words - 1] = BITS_FROM(rs->blocks % KNOWN_BITS);
+    rs->known_some[(words - 1) / KNOWN_BITS] |=
+        (uint64_t) 1 << (words - 1) % KNOWN_BITS;
+    if (!(rs->blocks % KNOWN_BITS))
+        rs->known_all[(words - 1) / KNOWN_BITS] |=
+            (uint64_t) 1 << (words - 1) % KNOWN_BITS;
+    rs->gotblocks = 0;
+    return 0;
+}
 
-        /* If adjoining a range above, add to it */
-        else if (r < rs->numranges && rs->ranges[2 * r] == x + 1) {
-            rs->ranges[2 * r] = x;
-        }
+/* copy_ranges(self, from)
+ * Sets up the record of blocks known as a copy of that in from.
+ * Returns 0, or -1 if out of memory. */
+int copy_ranges(struct rcksum_state *rs, const struct rcksum_state *from) {
+    size_t words = known_words(from);
+    size_t summary = (words + KNOWN_BITS - 1) / KNOWN_BITS;
 
-        else { /* New range for this block alone */
-            rs->ranges =
-                realloc(rs->ranges,
-                        (rs->numranges + 1) * 2 * sizeof(rs->ranges[0]));
-            memmove(&rs->ranges[2 * r + 2], &rs->ranges[2 * r],
-                    (rs->numranges - r) * 2 * sizeof(rs->ranges[0]));
-            rs->ranges[2 * r] = rs->ranges[2 * r + 1] = x;
-            rs->numranges++;
-        }
+    rs->known = malloc(words * sizeof *rs->known);
+    rs->known_some = malloc(summary * sizeof *rs->known_some);
+    rs->known_all = malloc(summary * sizeof *rs->known_all);
+    if (!rs->known || !rs->known_some || !rs->known_all) {
+        free_ranges(rs);
+        return -1;
     }
-#if 0
-    {
-        int i;
-        for (i = 0; i < rs->numranges; i++)
-            fprintf(stderr, "%d-%d,", rs->ranges[i * 2], rs->ranges[i * 2 + 1]);
-        fprintf(stderr, " are the current ranges got (added %d, %d)\n\n", x, r);
+    memcpy(rs->known, from->known, words * sizeof *rs->known);
+    memcpy(rs->known_some, from->known_some, summary * sizeof *rs->known_some);
+    memcpy(rs->known_all, from->known_all, summary * sizeof *rs->known_all);
+    rs->gotblocks = from->gotblocks;
+    return 0;
+}
+
+/* merge_ranges(self, from)
+ * Adds the blocks known in from (set up by copy_ranges) to those we know.
+ * Returns the number of blocks that are new to us. */
+int merge_ranges(struct rcksum_state *rs, const struct rcksum_state *from) {
+    size_t words = known_words(rs);
+    size_t w;
+    int got = 0;
+
+    for (w = 0; w < words; w++) {
+        uint64_t new = from->known[w] & ~rs->known[w];
+
+        if (!new)
+            continue;
+        rs->known[w] |= new;
+        for (; new; new &= new - 1)
+            got++;
+        rs->known_some[w / KNOWN_BITS] |= (uint64_t) 1 << w % KNOWN_BITS;
+        if (rs->known[w] == ~(uint64_t) 0)
+            rs->known_all[w / KNOWN_BITS] |= (uint64_t) 1 << w % KNOWN_BITS;
     }
-#endif
+    rs->gotblocks += got;
+    return got;
+}
+
+void free_ranges(struct rcksum_state *rs) {
+    free(rs->known);
+    free(rs->known_some);
+    free(rs->known_all);
+    rs->known = rs->known_some = rs->known_all = NULL;
+}
+
+/* add_to_ranges(rs, blockid)
+ * Mark the given blockid as known, updating the stored known ranges
+ * appropriately */
+void add_to_ranges(struct rcksum_state *rs, zs_blockid x) {
+    size_t w = x / KNOWN_BITS;
+    uint64_t bit = (uint64_t) 1 << x % KNOWN_BITS;
+
+    if (rs->known[w] & bit)
+        return;                 /* Already have this block */
+
+    rs->gotblocks++;
+    rs->known[w] |= bit;
+    rs->known_some[w / KNOWN_BITS] |= (uint64_t) 1 << w % KNOWN_BITS;
+    if (rs->known[w] == ~(uint64_t) 0)
+        rs->known_all[w / KNOWN_BITS] |= (uint64_t) 1 << w % KNOWN_BITS;
 }
 
 /* already_got_block
  * Return true iff blockid x of the target file is already known */
 int already_got_block(struct rcksum_state *rs, zs_blockid x) {
-    return (range_before_block(rs, x) == -1);
+    return (rs->known[x / KNOWN_BITS] >> x % KNOWN_BITS) & 1;
+}
+
+/* next_bit(self, x, want)
+ * Returns the first block from x on which is known (want = 1) or not known
+ * (want = 0); or rs->blocks if there isn't one. */
+static zs_blockid next_bit(const struct rcksum_state *rs, zs_blockid x,
+                           int want) {
+    /* Flip the bits if looking for unknown blocks, so we always want a set
+     * bit; the summary to use is then of words that aren't all known */
+    const uint64_t flip = want ? 0 : ~(uint64_t) 0;
+    const uint64_t *summary = want ? rs->known_some : rs->known_all;
+    size_t words = known_words(rs);
+    size_t w = x / KNOWN_BITS;
+    uint64_t bits;
+
+    if (x >= rs->blocks)
+        return rs->blocks;
+
+    /* The rest of x's word */
+    bits = (rs->known[w] ^ flip) & BITS_FROM(x % KNOWN_BITS);
+    if (!bits) {
+        /* Find the next word with any bits we want from the summary */
+        size_t s = ++w / KNOWN_BITS;
+        size_t nsummary = (words + KNOWN_BITS - 1) / KNOWN_BITS;
+        uint64_t sbits;
+
+        if (w >= words)
+            return rs->blocks;
+        sbits = (summary[s] ^ flip) & BITS_FROM(w % KNOWN_BITS);
+        while (!sbits) {
+            if (++s == nsummary)
+                return rs->blocks;
+            sbits = summary[s] ^ flip;
+        }
+        w = s * KNOWN_BITS + lowest_bit(sbits);
+        if (w >= words)
+            return rs->blocks;
+        bits = rs->known[w] ^ flip;
+    }
+    x = w * KNOWN_BITS + lowest_bit(bits);
+    return x < rs->blocks ? x : rs->blocks;
 }
 
 /* next_blockid = next_known_block(rs, blockid)
@@ -131,21 +213,14 @@ int already_got_block(struct rcksum_state *rs, zs_blockid x) {
  * the end of the file).
  */
 zs_blockid next_known_block(struct rcksum_state *rs, zs_blockid x) {
-    int r = range_before_block(rs, x);
-    if (r == -1)
-        return x;
-    if (r == rs->numranges) {
-        return rs->blocks;
-    }
-    /* Else return first block of next known range. */
-    return rs->ranges[2*r];
+    return next_bit(rs, x, 1);
 }
 
 /* rcksum_needed_block_ranges
  * Return the block ranges needed to complete the target file */
 zs_blockid *rcksum_needed_block_ranges(const struct rcksum_state * rs, int *num,
                                        zs_blockid from, zs_blockid to) {
-    int i, n;
+    int n = 0;
     int alloc_n = 100;
     zs_blockid *r = malloc(2 * alloc_n * sizeof(zs_blockid));
 
@@ -154,60 +229,88 @@ zs_blockid *rcksum_needed_block_ranges(const struct rcksum_state * rs, int *num,
 
     if (to >= rs->blocks)
         to = rs->blocks;
-    r[0] = from;
-    r[1] = to;
-    n = 1;
-    /* Note r[2*n-1] is the last range in our prospective list */
 
-    for (i = 0; i < rs->numranges; i++) {
-        if (rs->ranges[2 * i] > r[2 * n - 1])
-            continue;
-        if (rs->ranges[2 * i + 1] < from)
-            continue;
+    /* Each run of unknown blocks in the window is a range */
+    while (from < to) {
+        zs_blockid start = next_bit(rs, from, 0);
+        zs_blockid end;
 
-        /* Okay, they intersect */
-        if (n == 1 && rs->ranges[2 * i] <= from) {       /* Overlaps the start of our window */
-            r[0] = rs->ranges[2 * i + 1] + 1;
-        }
-        else {
-            /* If the last block that we still (which is the last window end -1, due
-             * to half-openness) then this range just cuts the end of our window */
-            if (rs->ranges[2 * i + 1] >= r[2 * n - 1] - 1) {
-                r[2 * n - 1] = rs->ranges[2 * i];
+        if (start >= to)
+            break;
+        end = next_bit(rs, start, 1);
+        if (end > to)
+            end = to;
+
+        if (n == alloc_n) {
+            zs_blockid *r2;
+            alloc_n *= 2;
+            r2 = realloc(r, 2 * alloc_n * sizeof *r);
+            if (!r2) {
+                free(r);
+                return NULL;
             }
-            else {
-                /* In the middle of our range, split it */
-                r[2 * n] = rs->ranges[2 * i + 1] + 1;
-                r[2 * n + 1] = r[2 * n - 1];
-                r[2 * n - 1] = rs->ranges[2 * i];
-                n++;
-                if (n == alloc_n) {
-                    zs_blockid *r2;
-                    alloc_n += 100;
-                    r2 = realloc(r, 2 * alloc_n * sizeof *r);
-                    if (!r2) {
-                        free(r);
-                        return NULL;
-                    }
-                    r = r2;
-                }
+            r = r2;
+        }
+        r[2 * n] = start;
+        r[2 * n + 1] = end;
+        n++;
+        from = end;
+    }
+
+    *num = n;
+    return r;
+}
+
+/* rcksum_known_block_ranges(self, &num)
+ * Return the block ranges we already have data for, in the same form as
+ * rcksum_needed_block_ranges */
+zs_blockid *rcksum_known_block_ranges(const struct rcksum_state *rs, int *num) {
+    int n = 0;
+    int alloc_n = 100;
+    zs_blockid *r = malloc(2 * alloc_n * sizeof(zs_blockid));
+    zs_blockid from = 0;
+
+    if (!r)
+        return NULL;
+
+    while (from < rs->blocks) {
+        zs_blockid start = next_bit(rs, from, 1);
+        zs_blockid end;
+
+        if (start >= rs->blocks)
+            break;
+        end = next_bit(rs, start, 0);
+
+        if (n == alloc_n) {
+            zs_blockid *r2;
+            alloc_n *= 2;
+            r2 = realloc(r, 2 * alloc_n * sizeof *r);
+            if (!r2) {
+                free(r);
+                return NULL;
             }
+            r = r2;
         }
+        r[2 * n] = start;
+        r[2 * n + 1] = end;
+        n++;
+        from = end;
     }
-    r = realloc(r, 2 * n * sizeof *r);
-    if (n == 1 && r[0] >= r[1])
-        n = 0;
 
     *num = n;
     return r;
 }
 
+/* rcksum_next_unknown_block(self, blockid)
+ * Returns the first block from x on that we don't have data for yet, or
+ * rs->blocks if there isn't one. */
+zs_blockid rcksum_next_unknown_block(const struct rcksum_state *rs,
+                                     zs_blockid x) {
+    return next_bit(rs, x, 0);
+}
+
 /* rcksum_blocks_todo
  * Return the number of blocks still needed to complete the target file */
 int rcksum_blocks_todo(const struct rcksum_state *rs) {
-    int i, n = rs->blocks;
-    for (i = 0; i < rs->numranges; i++) {
-        n -= 1 + rs->ranges[2 * i + 1] - rs->ranges[2 * i];
-    }
-    return n;
+    return rs->blocks - rs->gotblocks;
 }
@@ -0,0 +1,161 @@
+/*
+ *   zsync - client side rsync over http
+ *   Copyright (C) 2005 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Checks the record of blocks known against a plain array of flags, as blocks
+ * are added singly and in runs, and merged from a copy. */
+
+#include "zsglobal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "rcksum.h"
+#include "internal.h"
+
+/* Compare everything we can ask about the blocks known with got[] */
+static int check_known(struct rcksum_state *z, const char *got) {
+    zs_blockid x, next = z->blocks, next_unknown = z->blocks;
+    int todo = 0;
+    int n, i;
+    zs_blockid *r;
+
+    for (x = z->blocks - 1; x >= 0; x--) {
+        if (got[x])
+            next = x;
+        else {
+            next_unknown = x;
+            todo++;
+        }
+        if (already_got_block(z, x) != got[x] || next_known_block(z, x) != next
+            || rcksum_next_unknown_block(z, x) != next_unknown) {
+            fprintf(stderr, "%d blocks: wrong answer for block %d\n", z->blocks, x);
+            return 1;
+        }
+    }
+    if (rcksum_blocks_todo(z) != todo) {
+        fprintf(stderr, "%d blocks: %d todo, not %d\n", z->blocks,
+                rcksum_blocks_todo(z), todo);
+        return 1;
+    }
+
+    /* The needed ranges must be the runs of blocks not got, in a window */
+    {
+        zs_blockid from = rand() % (z->blocks + 1);
+        zs_blockid to = from + rand() % (z->blocks + 2 - from);
+
+        if (rand() % 2)
+            from = 0, to = 0x7fffffff;
+        if (!(r = rcksum_needed_block_ranges(z, &n, from, to)))
+            return 2;
+        if (to > z->blocks)
+            to = z->blocks;
+        for (x = from, i = 0; x < to; x++) {
+            int in = i < n && x >= r[2 * i] && x < r[2 * i + 1];
+
+            if (in == got[x] || (i < n && x < r[2 * i] && !got[x])
+                || (in && x == r[2 * i] && x > from && !got[x - 1])) {
+                fprintf(stderr, "%d blocks: wrong needed ranges at %d\n",
+                        z->blocks, x);
+                free(r);
+                return 1;
+            }
+            if (in && x == r[2 * i + 1] - 1)
+                i++;
+        }
+        if (i != n) {
+            fprintf(stderr, "%d blocks: extra needed ranges\n", z->blocks);
+            free(r);
+            return 1;
+        }
+        free(r);
+    }
+
+    /* And the known ranges must be the runs of blocks got */
+    if (!(r = rcksum_known_block_ranges(z, &n)))
+        return 2;
+    for (x = 0, i = 0; x < z->blocks; x++) {
+        int in = i < n && x >= r[2 * i] && x < r[2 * i + 1];
+
+        if (in != got[x] || (in && x == r[2 * i] && x > 0 && got[x - 1])) {
+            fprintf(stderr, "%d blocks: wrong known ranges at %d\n",
+                    z->blocks, x);
+            free(r);
+            return 1;
+        }
+        if (in && x == r[2 * i + 1] - 1)
+            i++;
+    }
+    free(r);
+    if (i != n) {
+        fprintf(stderr, "%d blocks: extra known ranges\n", z->blocks);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    static const int sizes[] = { 1, 2, 63, 64, 65, 127, 4095, 4096, 4097, 100000 };
+    int i, rc = 0;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        zs_blockid nblocks = sizes[i];
+        struct rcksum_state *z = rcksum_init(nblocks, 1024, 4, 16, 1, NULL);
+        struct rcksum_state copy;
+        char *got = calloc(nblocks, 1);
+        int round;
+
+        if (!z || !got)
+            return 2;
+        srand(nblocks);
+        rc |= check_known(z, got);
+
+        for (round = 0; round < 6 && !rc; round++) {
+            int k, adds = round < 3 ? nblocks / 8 + 1 : 8;
+
+            /* Scattered blocks at first, then long runs that fill in */
+            for (k = 0; k < adds; k++) {
+                zs_blockid x = rand() % nblocks;
+                zs_blockid len = round < 3 ? 1 : rand() % (nblocks / 4 + 1) + 1;
+
+                for (; len-- && x < nblocks; x++) {
+                    add_to_ranges(z, x);
+                    got[x] = 1;
+                }
+            }
+            rc |= check_known(z, got);
+
+            /* Blocks found by a copy, as in a parallel scan, merge back */
+            copy.blocks = z->blocks;
+            if (copy_ranges(&copy, z) != 0)
+                return 2;
+            for (k = 0; k < adds; k++) {
+                zs_blockid x = rand() % nblocks;
+                add_to_ranges(&copy, x);
+                got[x] = 1;
+            }
+            merge_ranges(z, &copy);
+            free_ranges(&copy);
+            rc |= check_known(z, got);
+        }
+
+        rcksum_end(z);
+        free(got);
+    }
+
+    return rc;
+}
@@ -39,14 +39,35 @@ void rcksum_end(struct rcksum_state* z);
 char* rcksum_filename(struct rcksum_state* z);
 int rcksum_filehandle(struct rcksum_state* z);
 
+/* Blocks obtained are buffered before being written out; this writes them all
+ * out now. Returns 0, or -1 if any write to the file has failed - which
+ * also makes the submit functions below return -1. */
+int rcksum_flush(struct rcksum_state* z);
+
+/* As rcksum_flush, and waits for the blocks to reach the disk, so that a record
+ * of them can be trusted after a crash. Returns 0, or -1 on error. */
+int rcksum_sync(struct rcksum_state* z);
+
 void rcksum_add_target_block(struct rcksum_state* z, zs_blockid b, struct rsum r, void* checksum);
+/* The same for n blocks from block from at once, given their records as in a
+ * .zsync file: the last rsum_bytes bytes of the rsum in network byte order,
+ * then the checksum, for each block. */
+void rcksum_add_target_blocks(struct rcksum_state* z, zs_blockid from, zs_blockid n, const unsigned char* data, int rsum_bytes);
 
 int rcksum_submit_blocks(struct rcksum_state* z, const unsigned char* data, zs_blockid bfrom, zs_blockid bto);
 int rcksum_submit_source_data(struct rcksum_state* z, unsigned char* data, size_t len, off_t offset);
 int rcksum_submit_source_file(struct rcksum_state* z, FILE* f, int progress);
+int rcksum_submit_source_fd(struct rcksum_state* z, int fd, int progress);
+
+/* Number of threads rcksum_submit_source_file may use to scan a seekable seed
+ * file; 0 (the default) means one per online CPU, 1 disables parallel scanning. */
+void rcksum_set_threads(struct rcksum_state* z, int threads);
 
 /* This reads back in data which is already known. */
 int rcksum_read_known_data(struct rcksum_state* z, unsigned char* buf, off_t offset, size_t len);
+/* The same, but only as much as can be read without waiting for the disk,
+ * where the system can tell - so possibly fewer than len bytes, or none. */
+int rcksum_read_cached_data(struct rcksum_state* z, unsigned char* buf, off_t offset, size_t len);
 
 /* rcksum_needed_block_ranges tells you what blocks, within the given range,
  * are still unknown. It returns a list of block ranges in r[]
@@ -55,6 +76,23 @@ int rcksum_read_known_data(struct rcksum_state* z, unsigned char* buf, off_t off
 zs_blockid* rcksum_needed_block_ranges(const struct rcksum_state* z, int* num, zs_blockid from, zs_blockid to);
 int rcksum_blocks_todo(const struct rcksum_state*);
 
+/* The first block from x on which isn't known yet - or the number of blocks
+ * in the file if there's none, so everything from x on is known. */
+zs_blockid rcksum_next_unknown_block(const struct rcksum_state* z, zs_blockid x);
+
+/* rcksum_known_block_ranges is the opposite: the blocks we already have data
+ * for, as half-open ranges in r[] - for all the file, so there is no limit. */
+zs_blockid* rcksum_known_block_ranges(const struct rcksum_state* z, int* num);
+
+/* Carry on from an earlier, interrupted run: the file filename (open as fd)
+ * already holds the blocks in the half-open ranges r[] (as returned by
+ * rcksum_known_block_ranges then). Up to check of those blocks are read back
+ * and checked; if all is well, the file replaces the temporary file, the
+ * blocks become known and librcksum takes over filename and fd as it would its
+ * own temporary file. Returns 0 if so, or -1 if the file didn't check out (in
+ * which case nothing is changed and fd is still the caller's). */
+int rcksum_resume_file(struct rcksum_state* z, const char* filename, int fd, const zs_blockid* r, int num, int check);
+
 /* For preparing rcksum control files - in both cases len is the block size. */
 struct rsum __attribute__((pure)) rcksum_calc_rsum_block(const unsigned char* data, size_t len);
 void rcksum_calc_checksum(unsigned char *c, const unsigned char* data, size_t len);
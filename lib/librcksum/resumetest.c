@@ -0,0 +1,174 @@
+/*
+ *   zsync - client side rsync over http
+ *   Copyright (C) 2005 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Checks that a file left by an interrupted run is taken over with the blocks
+ * it was recorded to have, that they read back from it and are no longer
+ * looked for in seed files, and that it is turned down if a block checked is
+ * wrong or the ranges don't fit the target. */
+
+#include "zsglobal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include "rcksum.h"
+#include "internal.h"
+
+#define BLOCKSIZE 1024
+#define NBLOCKS 300
+
+/* Set up an rcksum_state for data[], and a file holding the blocks in ranges[]
+ * of it (and rubbish elsewhere) */
+static struct rcksum_state *setup(const unsigned char *data, char *filename,
+                                  int *fd, const zs_blockid *ranges, int num) {
+    struct rcksum_state *z = rcksum_init(NBLOCKS, BLOCKSIZE, 4, 16, 1, NULL);
+    unsigned char *junk = malloc(NBLOCKS * BLOCKSIZE);
+    zs_blockid id;
+    int i;
+
+    if (!z || !junk || (*fd = mkstemp(filename)) == -1)
+        return NULL;
+
+    for (id = 0; id < NBLOCKS; id++) {
+        unsigned char checksum[CHECKSUM_SIZE];
+
+        rcksum_calc_checksum(checksum, data + id * BLOCKSIZE, BLOCKSIZE);
+        rcksum_add_target_block(z, id, rcksum_calc_rsum_block(data + id * BLOCKSIZE, BLOCKSIZE),
+                                checksum);
+    }
+
+    for (i = 0; i < NBLOCKS * BLOCKSIZE; i++)
+        junk[i] = rand() >> 7;
+    for (i = 0; i < num; i++)
+        memcpy(junk + ranges[2 * i] * BLOCKSIZE, data + ranges[2 * i] * BLOCKSIZE,
+               (ranges[2 * i + 1] - ranges[2 * i]) * BLOCKSIZE);
+    if (pwrite(*fd, junk, NBLOCKS * BLOCKSIZE, 0) != NBLOCKS * BLOCKSIZE)
+        return NULL;
+    free(junk);
+    return z;
+}
+
+/* Check that exactly the blocks not in ranges[] are left in the rsum hash */
+static int check_hash(struct rcksum_state *z, const zs_blockid *ranges, int num) {
+    zs_blockid id;
+    int i, rc = 0;
+
+    for (id = 0; id < NBLOCKS; id++) {
+        int got = 0;
+
+        for (i = 0; i < num; i++)
+            if (id >= ranges[2 * i] && id < ranges[2 * i + 1])
+                got = 1;
+        if ((z->hash_ids[z->hash_pos[id]] == id) == got) {
+            fprintf(stderr, "block %d %s the hash\n", id, got ? "still in" : "missing from");
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+int main(void)
+{
+    static const zs_blockid ranges[] = { 0, 10, 64, 65, 100, 250, 299, 300 };
+    static const zs_blockid unordered[] = { 100, 250, 0, 10 };
+    static const zs_blockid outside[] = { 100, 301 };
+    const int num = sizeof(ranges) / sizeof(ranges[0]) / 2;
+    unsigned char *data = malloc(NBLOCKS * BLOCKSIZE);
+    unsigned char *back = malloc(NBLOCKS * BLOCKSIZE);
+    char filename[] = "resumetest-XXXXXX";
+    struct rcksum_state *z;
+    zs_blockid *r;
+    int fd, n, i, rc = 0;
+
+    if (!data || !back)
+        return 2;
+    srand(NBLOCKS);
+    for (i = 0; i < NBLOCKS * BLOCKSIZE; i++)
+        data[i] = rand() >> 7;
+
+    /* The blocks recorded are taken as known, and read back from the file.
+     * They are taken out of the hash if it has been built already, and left
+     * out when it's built afresh. */
+    if (!(z = setup(data, filename, &fd, ranges, num)) || !build_hash(z))
+        return 2;
+    if (rcksum_resume_file(z, filename, fd, ranges, num, 16) != 0) {
+        fprintf(stderr, "good file not resumed from\n");
+        rc = 1;
+    } else {
+        if (!(r = rcksum_known_block_ranges(z, &n)))
+            return 2;
+        if (n != num || memcmp(r, ranges, sizeof ranges)) {
+            fprintf(stderr, "wrong blocks known after resuming\n");
+            rc = 1;
+        }
+        free(r);
+        if (rcksum_blocks_todo(z) != NBLOCKS - 10 - 1 - 150 - 1)
+            rc = 1;
+        if (check_hash(z, ranges, num))
+            rc = 1;
+        free_hash(z);
+        if (!build_hash(z))
+            return 2;
+        if (check_hash(z, ranges, num))
+            rc = 1;
+        for (i = 0; i < num; i++) {
+            off_t from = (off_t) ranges[2 * i] * BLOCKSIZE;
+            size_t len = (ranges[2 * i + 1] - ranges[2 * i]) * BLOCKSIZE;
+
+            if (rcksum_read_known_data(z, back, from, len) != (int) len
+                    || memcmp(back, data + from, len)) {
+                fprintf(stderr, "wrong data read back at %d\n", ranges[2 * i]);
+                rc = 1;
+            }
+            /* Whatever of it is still in the page cache */
+            n = rcksum_read_cached_data(z, back, from, len);
+            if (n < 0 || n > (int) len || memcmp(back, data + from, n)) {
+                fprintf(stderr, "wrong cached data read back at %d\n", ranges[2 * i]);
+                rc = 1;
+            }
+        }
+    }
+    /* The file is librcksum's now, and removed with it */
+    rcksum_end(z);
+    if (access(filename, F_OK) == 0) {
+        fprintf(stderr, "resumed file not taken over\n");
+        unlink(filename);
+        rc = 1;
+    }
+
+    /* A wrong block among those checked, or nonsense ranges, and the file is
+     * left alone */
+    strcpy(filename, "resumetest-XXXXXX");
+    if (!(z = setup(data, filename, &fd, ranges, num - 1)))
+        return 2;
+    if (rcksum_resume_file(z, filename, fd, ranges, num, 16) == 0
+            || rcksum_resume_file(z, filename, fd, unordered, 2, 16) == 0
+            || rcksum_resume_file(z, filename, fd, outside, 1, 16) == 0
+            || rcksum_blocks_todo(z) != NBLOCKS) {
+        fprintf(stderr, "bad file resumed from\n");
+        rc = 1;
+    }
+    rcksum_end(z);
+    if (close(fd) != 0 || unlink(filename) != 0)
+        rc = 1;
+
+    free(data);
+    free(back);
+    return rc;
+}
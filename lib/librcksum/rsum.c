@@ -25,6 +25,12 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 
 #ifdef WITH_DMALLOC
 # include <dmalloc.h>
@@ -34,8 +40,6 @@
 #include "rcksum.h"
 #include "internal.h"
 
-#define UPDATE_RSUM(a, b, oldc, newc, bshift) do { (a) += ((unsigned char)(newc)) - ((unsigned char)(oldc)); (b) += (a) - ((oldc) << (bshift)); } while (0)
-
 /* rcksum_calc_rsum_block(data, data_len)
  * Calculate the rsum for a single block of data. */
 struct rsum __attribute__ ((pure)) rcksum_calc_rsum_block(const unsigned char *data, size_t len) {
@@ -64,59 +68,77 @@ void rcksum_calc_checksum(unsigned char *c, const unsigned char *data,
     MD4Final(c, &ctx);
 }
 
-#ifndef HAVE_PWRITE
-/* Fallback pwrite(2) implementation if needed (but not strictly complete, as
- * it moves the file pointer - we don't care). */
-ssize_t pwrite(int d, const void *buf, size_t nbytes, off_t offset) {
-    if (lseek(d, offset, SEEK_SET) == -1)
-        return -1;
-    return write(d, buf, nbytes);
+/* calc_block_checksum(self, checksum_buf, data, ahead)
+ * Calculates the MD4 checksum of the block at data[]. If ahead is non-zero,
+ * the caller expects to want the checksums of the following blocks too, and
+ * data[] has ahead bytes to go; then the checksums of up to MD4_AHEAD blocks
+ * are calculated together, which is much faster per block, and kept for
+ * later calls. rcksum_submit_source_data drops them for each new buffer. */
+static void calc_block_checksum(struct rcksum_state *z, unsigned char *c,
+                                const unsigned char *data, size_t ahead) {
+    size_t bs = z->blocksize;
+    size_t n;
+
+    if (z->md4_ahead && data >= z->md4_ahead) {
+        size_t k = (data - z->md4_ahead) / bs;
+
+        if (data == z->md4_ahead + k * bs && k < z->md4_ahead_n) {
+            memcpy(c, z->md4_ahead_sums[k], CHECKSUM_SIZE);
+            return;
+        }
+    }
+
+    n = ahead / bs < MD4_AHEAD ? ahead / bs : MD4_AHEAD;
+    if (n < 2) {
+        rcksum_calc_checksum(c, data, bs);
+        return;
+    }
+    MD4DataMulti(z->md4_ahead_sums, data, bs, n);
+    z->md4_ahead = data;
+    z->md4_ahead_n = n;
+    memcpy(c, z->md4_ahead_sums[0], CHECKSUM_SIZE);
 }
-#endif
 
 /* write_blocks(rcksum_state, buf, startblock, endblock)
  * Writes the block range (inclusive) from the supplied buffer to our
- * under-construction output file */
-static void write_blocks(struct rcksum_state *z, const unsigned char *data,
-                         zs_blockid bfrom, zs_blockid bto) {
+ * under-construction output file - or queues it to be written, so a failure
+ * may only be reported by a later call. Returns 0, or -1 if a write has
+ * failed, in which case we stop writing, and take no more blocks. */
+static int write_blocks(struct rcksum_state *z, const unsigned char *data,
+                        zs_blockid bfrom, zs_blockid bto) {
     off_t len = ((off_t) (bto - bfrom + 1)) << z->blockshift;
-    off_t offset = ((off_t) bfrom) << z->blockshift;
-
-    while (len) {
-        size_t l = len;
-        int rc;
-
-        /* On some platforms, the bytes-to-write could be more than pwrite(2)
-         * will accept. Write in blocks of 2^31 bytes in that case. */
-        if ((off_t) l < len)
-            l = 0x8000000;
 
-        /* Write */
-        rc = pwrite(z->fd, data, l, offset);
-        if (rc == -1) {
-            fprintf(stderr, "IO error: %s\n", strerror(errno));
-            exit(-1);
-        }
+    if (z->write_error)
+        return -1;
 
-        /* Keep track of any data still to do */
-        len -= rc;
-        if (len) {              /* More to write */
-            data += rc;
-            offset += rc;
-        }
+    /* If the data is straight from a seed file, copy it from there */
+    if (z->wb && z->src_data && data >= z->src_data
+        && data + len <= z->src_data + z->src_len)
+        z->write_error = writeback_add_copy(z->wb, z->src_fd,
+                                            z->src_offset + (data - z->src_data),
+                                            bfrom, bto);
+    else if (z->wb)
+        z->write_error = writeback_add(z->wb, data, bfrom, bto);
+    else
+        z->write_error = write_out(z->fd, data, len,
+                                   ((off_t) bfrom) << z->blockshift);
+    if (z->write_error) {
+        fprintf(stderr, "IO error: %s\n", strerror(z->write_error));
+        return -1;
     }
 
     {   /* Having written those blocks, discard them from the rsum hashes (as
          * we don't need to identify data for those blocks again, and this may
          * speed up lookups (in particular if there are lots of identical
          * blocks), and add the written blocks to the record of blocks that we
-         * have received and stored the data for */
+         * have received and stored the data for. */
         int id;
-        for (id = bfrom; id <= bto; id++) {
+        for (id = bfrom; id <= bto; id++)
             remove_block_from_hash(z, id);
+        for (id = bfrom; id <= bto; id++)
             add_to_ranges(z, id);
-        }
     }
+    return 0;
 }
 
 /* rcksum_read_known_data(self, buf, offset, len)
@@ -124,10 +146,47 @@ static void write_blocks(struct rcksum_state *z, const unsigned char *data,
  * buf[] (which must be at least len bytes long) */
 int rcksum_read_known_data(struct rcksum_state *z, unsigned char *buf,
                            off_t offset, size_t len) {
-    int rc = pread(z->fd, buf, len, offset);
+    int rc;
+
+    /* The data may not be written out yet */
+    if (rcksum_flush(z) != 0)
+        return -1;
+    rc = pread(z->fd, buf, len, offset);
     return rc;
 }
 
+/* rcksum_read_cached_data(self, buf, offset, len)
+ * As rcksum_read_known_data, but reads only what the kernel can return
+ * without waiting for the disk, i.e. what is still in the page cache. Returns
+ * the number of bytes read, which may be fewer than len or 0, or -1 on error.
+ * Where the system can't tell, it reads as rcksum_read_known_data does. */
+int rcksum_read_cached_data(struct rcksum_state *z, unsigned char *buf,
+                            off_t offset, size_t len) {
+    if (rcksum_flush(z) != 0)
+        return -1;
+
+#ifdef RWF_NOWAIT
+    {
+        struct iovec iov;
+        ssize_t rc;
+
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        rc = preadv2(z->fd, &iov, 1, offset, RWF_NOWAIT);
+        if (rc >= 0)
+            return rc;
+        if (errno == EAGAIN)
+            return 0;
+        if (errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL)
+            return -1;
+    }
+#endif
+    return pread(z->fd, buf, len, offset);
+}
+
+/* Blocks checked at once by rcksum_submit_blocks */
+#define SUBMIT_BATCH 16
+
 /* rcksum_submit_blocks(self, data, startblock, endblock)
  * The data in data[] (which should be (endblock - startblock + 1) * blocksize * bytes)
  * is tested block-by-block as valid data against the target checksums for
@@ -140,18 +199,21 @@ int rcksum_read_known_data(struct rcksum_state *z, unsigned char *buf,
 int rcksum_submit_blocks(struct rcksum_state *const z, const unsigned char *data,
                          zs_blockid bfrom, zs_blockid bto) {
     zs_blockid x;
-    unsigned char md4sum[CHECKSUM_SIZE];
+    unsigned char md4sum[SUBMIT_BATCH][CHECKSUM_SIZE];
 
     /* Build checksum hash tables if we don't have them yet */
-    if (!z->rsum_hash)
+    if (!z->hash_keys)
         if (!build_hash(z))
             return -1;
 
-    /* Check each block */
+    /* Check each block, calculating the checksums several at a time */
     for (x = bfrom; x <= bto; x++) {
-        rcksum_calc_checksum(&md4sum[0], data + ((x - bfrom) << z->blockshift),
-                             z->blocksize);
-        if (memcmp(&md4sum, &(z->blockhashes[x].checksum[0]), z->checksum_bytes)) {
+        if ((x - bfrom) % SUBMIT_BATCH == 0)
+            MD4DataMulti(md4sum, data + ((x - bfrom) << z->blockshift),
+                         z->blocksize,
+                         bto - x + 1 < SUBMIT_BATCH ? bto - x + 1 : SUBMIT_BATCH);
+        if (memcmp(md4sum[(x - bfrom) % SUBMIT_BATCH], block_checksum(z, x),
+                   z->checksum_bytes)) {
             if (x > bfrom)      /* Write any good blocks we did get */
                 write_blocks(z, data, bfrom, x - 1);
             return -1;
@@ -159,14 +221,15 @@ int rcksum_submit_blocks(struct rcksum_state *const z, const unsigned char *data
     }
 
     /* All blocks are valid; write them and update our state */
-    write_blocks(z, data, bfrom, bto);
-    return 0;
+    return write_blocks(z, data, bfrom, bto);
 }
 
-/* check_checksums_on_hash_chain(self, &hash_entry, data[], onlyone)
- * Given a hash table entry, check the data in this block against every entry
- * in the linked list for this hash entry, checking the checksums for this
- * block against those recorded in the hash entries.
+/* check_checksums_on_hash_chain(self, ids[], data[], avail, onlyone)
+ * Given a list of block ids from the hash table (ending with HASH_END, and
+ * with removed blocks marked HASH_DROPPED), check the data in this block
+ * against every block in the list, checking the checksums for this block
+ * against those recorded for the blocks. If onlyone, ids[] is just the one
+ * block, and its rsum has not been checked yet. data[] has avail bytes.
  *
  * If we get a hit (checksums match a desired block), write the data to that
  * block in the target file and update our state accordingly to indicate that
@@ -175,42 +238,44 @@ int rcksum_submit_blocks(struct rcksum_state *const z, const unsigned char *data
  * Return the number of blocks successfully obtained.
  */
 static int check_checksums_on_hash_chain(struct rcksum_state *const z,
-                                         const struct hash_entry *e,
+                                         const zs_blockid *ids,
                                          const unsigned char *data,
-                                         int onlyone) {
+                                         size_t avail, int onlyone) {
     unsigned char md4sum[2][CHECKSUM_SIZE];
     signed int done_md4 = -1;
     int got_blocks = 0;
     register struct rsum r = z->r[0];
+    zs_blockid id;
+
+    /* If we're following a run of matching blocks, we'll probably want the
+     * checksums of the blocks after this one too */
+    size_t ahead = z->next_match >= 0 ? avail : 0;
 
     /* This is a hint to the caller that they should try matching the next
-     * block against a particular hash entry (because at least z->seq_matches
+     * block against a particular block (because at least z->seq_matches
      * prior blocks to it matched in sequence). Clear it here and set it below
      * if and when we get such a set of matches. */
-    z->next_match = NULL;
-
-    /* This is essentially a for (;e;e=e->next), but we want to remove links from
-     * the list as we find matches, without keeping too many temp variables.
-     */
-    z->rover = e;
-    while (z->rover) {
-        zs_blockid id;
+    z->next_match = -1;
 
-        e = z->rover;
-        z->rover = onlyone ? NULL : e->next;
+    /* Blocks are dropped from the list as we write them (and by other
+     * threads), so look at each entry afresh. */
+    for (; (id = HASH_LOAD(*ids)) != HASH_END; ids++) {
+        if (id == HASH_DROPPED)
+            continue;
 
-        /* Check weak checksum first */
+        /* Check weak checksum first. The hash key already matched the b of
+         * this rsum and, with seq_matches > 1, of the next, or otherwise the
+         * a of this one. */
 
         z->stats.hashhit++;
-        if (e->r.a != (r.a & z->rsum_a_mask) || e->r.b != r.b) {
-            continue;
+        if (onlyone) {
+            if (z->block_rsums[id].a != (r.a & z->rsum_a_mask)
+                || z->block_rsums[id].b != r.b)
+                continue;
         }
-
-        id = get_HE_blockid(z, e);
-
-        if (!onlyone && z->seq_matches > 1
-            && (z->blockhashes[id + 1].r.a != (z->r[1].a & z->rsum_a_mask)
-                || z->blockhashes[id + 1].r.b != z->r[1].b))
+        else if (z->seq_matches > 1
+            && (z->block_rsums[id].a != (r.a & z->rsum_a_mask)
+                || z->block_rsums[id + 1].a != (z->r[1].a & z->rsum_a_mask)))
             continue;
 
         z->stats.weakhit++;
@@ -227,16 +292,16 @@ static int check_checksums_on_hash_chain(struct rcksum_state *const z,
             do {
                 /* We only calculate the MD4 once we need it; but need not do so twice */
                 if (check_md4 > done_md4) {
-                    rcksum_calc_checksum(&md4sum[check_md4][0],
-                                         data + z->blocksize * check_md4,
-                                         z->blocksize);
+                    calc_block_checksum(z, &md4sum[check_md4][0],
+                                        data + z->blocksize * check_md4,
+                                        ahead ? ahead - z->blocksize * check_md4 : 0);
                     done_md4 = check_md4;
                     z->stats.checksummed++;
                 }
 
                 /* Now check the strong checksum for this block */
                 if (memcmp(&md4sum[check_md4],
-                     z->blockhashes[id + check_md4].checksum,
+                     block_checksum(z, id + check_md4),
                      z->checksum_bytes))
                     ok = 0;
 
@@ -259,7 +324,7 @@ static int check_checksums_on_hash_chain(struct rcksum_state *const z,
                     num_write_blocks = check_md4;
 
                     /* Save state for this run of matches */
-                    z->next_match = &(z->blockhashes[id + check_md4]);
+                    z->next_match = id + check_md4;
                     if (!onlyone) z->next_known = next_known;
                 }
                 else {
@@ -270,7 +335,10 @@ static int check_checksums_on_hash_chain(struct rcksum_state *const z,
                 }
 
                 /* Write out the matched blocks that we don't yet know */
-                write_blocks(z, data, id, id + num_write_blocks - 1);
+                if (write_blocks(z, data, id, id + num_write_blocks - 1) != 0) {
+                    z->next_match = -1;
+                    break;
+                }
                 got_blocks += num_write_blocks;
             }
         }
@@ -306,11 +374,18 @@ int rcksum_submit_source_data(struct rcksum_state *const z, unsigned char *data,
     register int bs = z->blocksize;
     int got_blocks = 0;
 
+    /* Any checksums calculated ahead were of the last buffer */
+    z->md4_ahead = NULL;
+
+    /* No use looking for blocks we can't write */
+    if (z->write_error)
+        return 0;
+
     if (offset) {
         x = z->skip;
     }
     else {
-        z->next_match = NULL;
+        z->next_match = -1;
     }
 
     if (x || !offset) {
@@ -349,25 +424,25 @@ int rcksum_submit_source_data(struct rcksum_state *const z, unsigned char *data,
             /* If the previous block was a match, but we're looking for
              * sequential matches, then test this block against the block in
              * the target immediately after our previous hit. */
-            if (z->next_match && z->seq_matches > 1) {
-                if (0 != (thismatch = check_checksums_on_hash_chain(z, z->next_match, data + x, 1))) {
+            if (z->next_match >= 0 && z->seq_matches > 1) {
+                const zs_blockid next_match[2] = { z->next_match, HASH_END };
+                if (0 != (thismatch = check_checksums_on_hash_chain(z, next_match, data + x, len - x, 1))) {
                     blocks_matched = 1;
                 }
             }
             if (!thismatch) {
-                const struct hash_entry *e;
+                const zs_blockid *ids;
 
                 /* Do a hash table lookup - first in the bithash (fast negative
                  * check) and then in the rsum hash */
-                unsigned hash = z->r[0].b;
-                hash ^= ((z->seq_matches > 1) ? z->r[1].b
-                        : z->r[0].a & z->rsum_a_mask) << BITHASHBITS;
-                if ((z->bithash[(hash & z->bithashmask) >> 3] & (1 << (hash & 7))) != 0
-                    && (e = z->rsum_hash[hash & z->hashmask]) != NULL) {
+                unsigned short second = (z->seq_matches > 1) ? z->r[1].b
+                        : z->r[0].a & z->rsum_a_mask;
+                if (bithash_test(z, calc_bithash(z, z->r[0].b, second))
+                    && (ids = rhash_lookup(z, calc_rhash_key(z->r[0].b, second))) != NULL) {
 
                     /* Okay, we have a hash hit. Follow the hash chain and
                      * check our block against all the entries. */
-                    thismatch = check_checksums_on_hash_chain(z, e, data + x, 0);
+                    thismatch = check_checksums_on_hash_chain(z, ids, data + x, len - x, 0);
                     if (thismatch)
                         blocks_matched = z->seq_matches;
                 }
@@ -401,39 +476,460 @@ int rcksum_submit_source_data(struct rcksum_state *const z, unsigned char *data,
             }
         }
 
-        /* Else - advance the window by 1 byte - update the rolling checksum
-         * and our offset in the buffer */
-        {
-            unsigned char Nc = data[x + bs * 2];
-            unsigned char nc = data[x + bs];
-            unsigned char oc = data[x];
-            UPDATE_RSUM(z->r[0].a, z->r[0].b, oc, nc, z->blockshift);
-            if (z->seq_matches > 1)
-                UPDATE_RSUM(z->r[1].a, z->r[1].b, nc, Nc, z->blockshift);
+        /* Else - advance the window, updating the rolling checksum, to the
+         * next offset in the buffer that the bithash says could match */
+        x = next_candidate(z, data, x, len - z->context);
+    }
+}
+
+/* Seed data smaller than this per thread is not worth scanning in parallel */
+#define SCAN_MIN_CHUNK (4 << 20)
+
+/* Most data handed to rcksum_submit_source_data at once from a mapped seed */
+#define SCAN_MAP_SLICE (16 << 20)
+
+/* State shared by the threads of a parallel seed scan. The seed is cut into
+ * chunks which the threads take in turn, so that a thread which finds few
+ * matches (and so is slower) does not hold up the others. */
+struct scan_job {
+    pthread_mutex_t lock;
+    int fd;
+    off_t next;                 /* Start of the next chunk to be taken */
+    off_t end;                  /* End of the seed data */
+    off_t chunk;                /* Size of each chunk */
+    off_t done;                 /* Bytes scanned so far, for progress reports */
+    int progress;
+    int error;
+};
+
+/* Each thread scans with its own copy of the rcksum_state, which has private
+ * rolling checksums and known ranges but shares the hash tables and output
+ * file with the original. Removing a block from the hash just overwrites its
+ * id in place, so the threads can share the hash without locking. */
+struct scan_worker {
+    struct rcksum_state z;
+    struct scan_job *job;
+    pthread_t thread;
+};
+
+/* read_seed(fd, buf, len, offset, end)
+ * Reads len bytes at offset from the seed, zero padding past end (or EOF).
+ * Returns 0 on success, -1 on error. */
+static int read_seed(int fd, unsigned char *buf, size_t len, off_t offset,
+                     off_t end) {
+    while (len && offset < end) {
+        size_t l = (off_t) len < end - offset ? len : (size_t) (end - offset);
+        ssize_t rc = pread(fd, buf, l, offset);
+
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("pread");
+            return -1;
+        }
+        if (rc == 0)
+            break;
+        buf += rc;
+        len -= rc;
+        offset += rc;
+    }
+    memset(buf, 0, len);
+    return 0;
+}
+
+/* scan_progress(job, bytes)
+ * Counts bytes more of the seed as scanned, printing a '*' per MB if wanted */
+static void scan_progress(struct scan_job *job, off_t bytes) {
+    pthread_mutex_lock(&job->lock);
+    {
+        int in_mb = job->done / 1000000;
+        job->done += bytes;
+        if (job->progress)
+            for (; in_mb < job->done / 1000000; in_mb++)
+                fputc('*', stderr);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* map_seed(fd, start, end, &base, &base_len)
+ * Maps [start, end) of the seed read-only, returning a pointer to the byte at
+ * start and the page aligned mapping to pass to munmap, or NULL if it can't be
+ * mapped. */
+static unsigned char *map_seed(int fd, off_t start, off_t end, void **base,
+                               size_t *base_len) {
+    off_t map_start = start & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+    size_t map_len = end - map_start;
+    void *m;
+
+    if ((off_t) map_len != end - map_start)
+        return NULL;            /* Too big for our address space */
+    m = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, map_start);
+    if (m == MAP_FAILED)
+        return NULL;
+#ifdef MADV_SEQUENTIAL
+    madvise(m, map_len, MADV_SEQUENTIAL);
+#endif
+    *base = m;
+    *base_len = map_len;
+    return (unsigned char *) m + (start - map_start);
+}
+
+/* scan_chunk(self, job, buf, bufsize, start, end)
+ * Looks for target blocks at every offset in [start, end) of the seed.
+ * Blocks that start before end but extend past it are still found, as the
+ * following context bytes are read too; past the end of the seed the data is
+ * zero padded, as rcksum_submit_source_file does.
+ * The seed is scanned in place through a memory mapping where possible, with
+ * buf[] used for the zero padded tail or if the mapping fails.
+ * Returns 0 on success, -1 on a read or write error. */
+static int scan_chunk(struct rcksum_state *z, struct scan_job *job,
+                      unsigned char *buf, size_t bufsize, off_t start,
+                      off_t end) {
+    off_t pos = start;          /* Seed offset of data[0] */
+    off_t stop = end + z->context;
+    off_t reported = start;     /* Progress has been counted up to here */
+    size_t have = 0;            /* Bytes at the start of buf[] already read */
+    off_t map_end = stop < job->end ? stop : job->end;
+    void *map_base = NULL;
+    size_t map_len = 0;
+    unsigned char *map = NULL;
+    int rc = 0;
+
+    if (map_end - start >= 2 * z->context)
+        map = map_seed(job->fd, start, map_end, &map_base, &map_len);
+    if (!map)
+        map_end = start;
+
+    for (;;) {
+        unsigned char *data;
+        size_t len;
+
+        /* Use the mapping while it leaves room for any skip left over from
+         * the last slice; the last few blocks go through buf[] instead */
+        if (map_end - pos >= 2 * z->context) {
+            len = map_end - pos < SCAN_MAP_SLICE ? map_end - pos : SCAN_MAP_SLICE;
+            data = map + (pos - start);
         }
-        x++;
+        else {
+            len = stop - pos < (off_t) bufsize ? stop - pos : (off_t) bufsize;
+            if (read_seed(job->fd, buf + have, len - have, pos + have,
+                          job->end) != 0) {
+                rc = -1;
+                break;
+            }
+            data = buf;
+        }
+
+        /* A match at the end of the last buffer may already have skipped us
+         * past every remaining offset in the chunk */
+        if (pos > start && z->skip + z->context > len)
+            break;
+
+        /* Let matches be copied from the seed file, except any padding */
+        z->src_fd = job->fd;
+        z->src_data = data;
+        z->src_offset = pos;
+        z->src_len = job->end - pos < (off_t) len ? (size_t) (job->end - pos) : len;
+        rcksum_submit_source_data(z, data, len, pos - start);
+        z->src_data = NULL;
+        if (z->write_error) {
+            rc = -1;
+            break;
+        }
+        if (pos + (off_t) (len - z->context) > reported) {
+            off_t upto = pos + (off_t) (len - z->context);
+            if (upto > end)
+                upto = end;
+            scan_progress(job, upto - reported);
+            reported = upto;
+        }
+        if (pos + (off_t) len >= stop) {
+            /* If we are in a run of matches that crosses the end of the
+             * chunk, follow it one more block: the thread taking the next
+             * chunk starts afresh, so needs seq_matches blocks in a row to
+             * pick the run up and would miss a lone final block. */
+            if (z->next_match < 0 || end == job->end || stop > end + z->context)
+                break;
+            stop += z->blocksize;
+        }
+
+        /* Carry the context bytes over to the start of the next buffer */
+        if (data == buf) {
+            memmove(buf, buf + len - z->context, z->context);
+            have = z->context;
+        }
+        pos += len - z->context;
     }
+
+    if (map)
+        munmap(map_base, map_len);
+    if (reported < end)
+        scan_progress(job, end - reported);
+    return rc;
+}
+
+/* scan_thread(worker)
+ * Thread body for the parallel scan: takes chunks from the job until none are
+ * left. */
+static void *scan_thread(void *arg) {
+    struct scan_worker *w = arg;
+    struct scan_job *job = w->job;
+    size_t bufsize = w->z.blocksize * 256 + w->z.context;
+    unsigned char *buf = malloc(bufsize);
+
+    if (!buf) {
+        pthread_mutex_lock(&job->lock);
+        job->error = 1;
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
+    }
+
+    for (;;) {
+        off_t start, end;
+
+        pthread_mutex_lock(&job->lock);
+        start = job->error ? job->end : job->next;
+        end = job->end - start > job->chunk ? start + job->chunk : job->end;
+        job->next = end;
+        pthread_mutex_unlock(&job->lock);
+
+        if (start >= end)
+            break;
+
+        if (scan_chunk(&w->z, job, buf, bufsize, start, end) != 0) {
+            pthread_mutex_lock(&job->lock);
+            job->error = 1;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/* submit_source_file_parallel(self, fd, start, end, threads, progress)
+ * Scans [start, end) of the seed file fd with the given number of threads,
+ * then merges the blocks found by each thread into our state.
+ * Returns the number of blocks obtained, or -1 if it could not run at all. */
+static int submit_source_file_parallel(struct rcksum_state *z, int fd,
+                                       off_t start, off_t end, int threads,
+                                       int progress) {
+    struct scan_job job;
+    struct scan_worker *w = calloc(threads, sizeof *w);
+    int started, i;
+    int got_blocks = 0;
+
+    if (!w)
+        return -1;
+
+    job.fd = fd;
+    job.next = start;
+    job.end = end;
+    job.done = 0;
+    job.progress = progress;
+    job.error = 0;
+
+    /* Several chunks per thread to even out the load; whole blocks each */
+    job.chunk = (end - start) / (threads * 4);
+    if (job.chunk < SCAN_MIN_CHUNK / 4)
+        job.chunk = SCAN_MIN_CHUNK / 4;
+    job.chunk = (job.chunk + z->blocksize - 1) & ~((off_t) z->blocksize - 1);
+
+    for (i = 0; i < threads; i++) {
+        w[i].z = *z;
+        w[i].z.skip = 0;
+        w[i].z.next_match = -1;
+        memset(&w[i].z.stats, 0, sizeof(w[i].z.stats));
+        if (copy_ranges(&w[i].z, z) != 0) {
+            while (i--) {
+                free_ranges(&w[i].z);
+                writeback_end(w[i].z.wb);
+            }
+            free(w);
+            return -1;
+        }
+        /* The threads are writing in parallel anyway, so each just buffers
+         * its blocks and writes them out itself */
+        w[i].z.wb = writeback_init(z->fd, z->blockshift, 0);
+        w[i].job = &job;
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+
+    /* Start the other threads and do our share; if a thread can't be started,
+     * the rest just take more chunks each */
+    for (started = 1; started < threads; started++)
+        if (pthread_create(&w[started].thread, NULL, scan_thread, &w[started]) != 0)
+            break;
+    scan_thread(&w[0]);
+    for (i = 1; i < started; i++)
+        pthread_join(w[i].thread, NULL);
+
+    pthread_mutex_destroy(&job.lock);
+
+    /* Merge the blocks found; they are already gone from the hash */
+    for (i = 0; i < threads; i++) {
+        int error = writeback_end(w[i].z.wb);
+
+        if (!error)
+            error = w[i].z.write_error;
+        else if (!w[i].z.write_error)
+            fprintf(stderr, "IO error: %s\n", strerror(error));
+        if (error && !z->write_error)
+            z->write_error = error;
+
+        got_blocks += merge_ranges(z, &w[i].z);
+        z->stats.hashhit += w[i].z.stats.hashhit;
+        z->stats.weakhit += w[i].z.stats.weakhit;
+        z->stats.stronghit += w[i].z.stats.stronghit;
+        z->stats.checksummed += w[i].z.stats.checksummed;
+        free_ranges(&w[i].z);
+    }
+    free(w);
+
+    /* Leave the caller's state as after a sequential scan of a new stream */
+    z->skip = 0;
+    z->next_match = -1;
+    return got_blocks;
+}
+
+/* scan_threads(self, start, end)
+ * Decides how many threads to scan [start, end) of a seed file with: enough
+ * to give each a decent share of the data, up to the number configured.
+ * Returns 1 for a sequential scan. */
+static int scan_threads(const struct rcksum_state *z, off_t start, off_t end) {
+    long threads = z->threads;
+
+    if (!threads)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > (end - start) / SCAN_MIN_CHUNK)
+        threads = (end - start) / SCAN_MIN_CHUNK;
+    return threads < 1 ? 1 : threads;
+}
+
+/* submit_source_range(self, fd, start, end, progress)
+ * Scans [start, end) of the regular file fd as a new seed stream, in place
+ * through a memory mapping and with several threads where worthwhile.
+ * Returns the number of blocks obtained, or -1 if it could not run at all. */
+static int submit_source_range(struct rcksum_state *z, int fd, off_t start,
+                               off_t end, int progress) {
+    struct scan_job job;
+    int threads = scan_threads(z, start, end);
+    size_t bufsize = z->blocksize * 256 + z->context;
+    unsigned char *buf;
+    int got_blocks = z->gotblocks;
+
+    /* Build checksum hash tables ready to analyse the blocks we find */
+    if (!z->hash_keys)
+        if (!build_hash(z))
+            return 0;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    if (threads > 1) {
+        int rc = submit_source_file_parallel(z, fd, start, end, threads,
+                                             progress);
+        if (rc >= 0)
+            return rc;
+    }
+
+    if (!(buf = malloc(bufsize)))
+        return -1;
+
+    /* Sequentially it's just a parallel scan with one chunk and one thread */
+    job.fd = fd;
+    job.next = job.end = end;
+    job.chunk = end - start;
+    job.done = 0;
+    job.progress = progress;
+    job.error = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    scan_chunk(z, &job, buf, bufsize, start, end);
+
+    pthread_mutex_destroy(&job.lock);
+    free(buf);
+
+    /* Blocks may be waiting to be copied from the seed, which the caller
+     * might close or change once we return */
+    rcksum_flush(z);
+
+    z->skip = 0;
+    z->next_match = -1;
+    return z->gotblocks - got_blocks;
+}
+
+/* rcksum_submit_source_fd(self, fd, progress)
+ * As rcksum_submit_source_file, for the whole of the file open on fd. A
+ * regular file is scanned in place through a memory mapping (and by several
+ * threads if large enough), without moving the file offset; anything else is
+ * read as a stream from its current position.
+ */
+int rcksum_submit_source_fd(struct rcksum_state *z, int fd, int progress) {
+    struct stat st;
+    FILE *f;
+    int got_blocks;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        got_blocks = submit_source_range(z, fd, 0, st.st_size, progress);
+        if (got_blocks >= 0)
+            return z->write_error ? -1 : got_blocks;
+    }
+
+    /* Fall back to reading it through stdio */
+    if ((fd = dup(fd)) == -1 || !(f = fdopen(fd, "rb"))) {
+        perror("fdopen");
+        if (fd != -1)
+            close(fd);
+        return 0;
+    }
+    got_blocks = rcksum_submit_source_file(z, f, progress);
+    fclose(f);
+    return got_blocks;
 }
 
 /* rcksum_submit_source_file(self, stream, progress)
  * Read the given stream, applying the rsync rolling checksum algorithm to
  * identify any blocks of data in common with the target file. Blocks found are
  * written to our working target output. Progress reports if progress != 0
+ *
+ * If the stream is a regular file, the rest of it is scanned in place as by
+ * rcksum_submit_source_fd and the stream left at EOF; anything else, e.g. a
+ * pipe or decompressing stream, is read sequentially.
+ *
+ * Returns the number of blocks obtained, or -1 if writing them out failed.
  */
 int rcksum_submit_source_file(struct rcksum_state *z, FILE * f, int progress) {
     /* Track progress */
     int got_blocks = 0;
     off_t in = 0;
     int in_mb = 0;
+    int fd = fileno(f);
+    struct stat st;
+    off_t start;
 
     /* Allocate buffer of 16 blocks */
     register int bufsize = z->blocksize * 16;
-    unsigned char *buf = malloc(bufsize + z->context);
+    unsigned char *buf;
+
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+        && (start = ftello(f)) != -1) {
+        got_blocks = submit_source_range(z, fd, start, st.st_size, progress);
+        if (got_blocks >= 0) {
+            fseeko(f, 0, SEEK_END);
+            return z->write_error ? -1 : got_blocks;
+        }
+        got_blocks = 0;
+    }
+
+    buf = malloc(bufsize + z->context);
     if (!buf)
         return 0;
 
     /* Build checksum hash tables ready to analyse the blocks we find */
-    if (!z->rsum_hash)
+    if (!z->hash_keys)
         if (!build_hash(z)) {
             free(buf);
             return 0;
@@ -470,11 +966,13 @@ int rcksum_submit_source_file(struct rcksum_state *z, FILE * f, int progress) {
 
         /* Process the data in the buffer, and report progress */
         got_blocks += rcksum_submit_source_data(z, buf, len, start_in);
+        if (z->write_error)
+            break;
         if (progress && in_mb != in / 1000000) {
             in_mb = in / 1000000;
             fputc('*', stderr);
         }
     }
     free(buf);
-    return got_blocks;
+    return z->write_error ? -1 : got_blocks;
 }
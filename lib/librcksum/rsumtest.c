@@ -0,0 +1,162 @@
+/*
+ *   zsync - client side rsync over http
+ *   Copyright (C) 2005 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Checks that each of the next_candidate implementations this CPU can run
+ * stops at the same positions as the scalar one, with correct rsums; and that
+ * blocks' checksums loaded in bulk are stored as when added one by one. */
+
+#include "zsglobal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "rcksum.h"
+#include "internal.h"
+
+typedef int (*scan_fn)(struct rcksum_state *, const unsigned char *, int, int);
+
+/* Walk fn over data[], checking its stops against the scalar version */
+static int check_scan(struct rcksum_state *z, scan_fn fn, const char *name,
+                      const unsigned char *data, int end) {
+    struct rsum r0 = rcksum_calc_rsum_block(data, z->blocksize);
+    struct rsum r1 = rcksum_calc_rsum_block(data + z->blocksize, z->blocksize);
+    int x = 0, y = 0, stops = 0;
+
+    while (x < end) {
+        struct rsum s[2];
+
+        z->r[0] = r0;
+        z->r[1] = r1;
+        y = next_candidate_scalar(z, data, x, end);
+        s[0] = z->r[0];
+        s[1] = z->r[1];
+
+        z->r[0] = r0;
+        z->r[1] = r1;
+        x = fn(z, data, x, end);
+
+        if (x != y || memcmp(s, z->r, z->seq_matches * sizeof s[0])) {
+            fprintf(stderr, "%s: stopped at %d, scalar at %d\n", name, x, y);
+            return 1;
+        }
+        {
+            int k;
+            for (k = 0; k < z->seq_matches; k++) {
+                struct rsum c = rcksum_calc_rsum_block(data + x + k * z->blocksize,
+                                                       z->blocksize);
+                if (c.a != z->r[k].a || c.b != z->r[k].b) {
+                    fprintf(stderr, "%s: wrong rsum at %d\n", name, x);
+                    return 1;
+                }
+            }
+        }
+        r0 = z->r[0];
+        r1 = z->r[1];
+        stops++;
+    }
+    return stops == 0;
+}
+
+/* Loading blocks' records in bulk must store the same as adding them singly */
+static int check_add_blocks(int rsum_bytes, int checksum_bytes) {
+    enum { nblocks = 100 };
+    int reclen = rsum_bytes + checksum_bytes;
+    unsigned char *recs = malloc(nblocks * reclen);
+    struct rcksum_state *a = rcksum_init(nblocks, 1024, rsum_bytes, checksum_bytes, 1, NULL);
+    struct rcksum_state *b = rcksum_init(nblocks, 1024, rsum_bytes, checksum_bytes, 1, NULL);
+    int i, rc = 0;
+
+    if (!recs || !a || !b)
+        return 2;
+    for (i = 0; i < nblocks * reclen; i++)
+        recs[i] = rand() >> 7;
+
+    for (i = 0; i < nblocks; i++) {
+        const unsigned char *p = recs + i * reclen;
+        unsigned char be[4] = { 0, 0, 0, 0 };
+        struct rsum r;
+
+        memcpy(be + 4 - rsum_bytes, p, rsum_bytes);
+        r.a = be[0] << 8 | be[1];
+        r.b = be[2] << 8 | be[3];
+        rcksum_add_target_block(a, i, r, (void *) (p + rsum_bytes));
+    }
+    rcksum_add_target_blocks(b, 0, 40, recs, rsum_bytes);
+    rcksum_add_target_blocks(b, 40, nblocks, recs + 40 * reclen, rsum_bytes);
+
+    if (memcmp(a->block_rsums, b->block_rsums, nblocks * sizeof a->block_rsums[0])
+            || memcmp(a->block_checksums, b->block_checksums, nblocks * checksum_bytes)) {
+        fprintf(stderr, "%d/%d bytes: blocks loaded in bulk differ\n", rsum_bytes, checksum_bytes);
+        rc = 1;
+    }
+    rcksum_end(a);
+    rcksum_end(b);
+    free(recs);
+    return rc;
+}
+
+int main(void)
+{
+    static const int blocksizes[] = { 512, 2048, 4096 };
+    int i, seq, rsum_bytes, rc = 0;
+
+    for (i = 0; i < sizeof(blocksizes) / sizeof(blocksizes[0]); i++)
+        for (seq = 1; seq <= 2; seq++)
+            for (rsum_bytes = 2; rsum_bytes <= 4; rsum_bytes++) {
+                int bs = blocksizes[i];
+                int nblocks = 64;
+                int len = bs * nblocks;
+                unsigned char *data = malloc(len + 2 * bs);
+                struct rcksum_state *z =
+                    rcksum_init(nblocks, bs, rsum_bytes, 16, seq, NULL);
+                unsigned char checksum[CHECKSUM_SIZE] = { 0 };
+                zs_blockid id;
+                int j;
+
+                if (!data || !z)
+                    return 2;
+                srand(bs + seq * 10 + rsum_bytes);
+                for (j = 0; j < len + 2 * bs; j++)
+                    data[j] = rand() >> 7;
+
+                /* Half the target blocks are real blocks of the data, at
+                 * odd offsets so the scan has to roll to find them */
+                for (id = 0; id < nblocks; id++) {
+                    struct rsum r = { rand(), rand() };
+                    if (id % 2)
+                        r = rcksum_calc_rsum_block(data + id * bs + id, bs);
+                    rcksum_add_target_block(z, id, r, checksum);
+                }
+                if (!build_hash(z))
+                    return 2;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+                if (__builtin_cpu_supports("sse4.1"))
+                    rc |= check_scan(z, next_candidate_sse41, "sse4.1", data, len);
+                if (__builtin_cpu_supports("avx2"))
+                    rc |= check_scan(z, next_candidate_avx2, "avx2", data, len);
+#endif
+                rc |= check_scan(z, next_candidate, "default", data, len);
+
+                rcksum_end(z);
+                free(data);
+            }
+
+    for (rsum_bytes = 1; rsum_bytes <= 4; rsum_bytes++)
+        rc |= check_add_blocks(rsum_bytes, rsum_bytes * 2 + 3);
+    return rc;
+}
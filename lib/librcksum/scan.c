@@ -0,0 +1,321 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Rolling the rsum over data that doesn't match the target. Almost every
+ * window position in such data fails the bithash lookup, so rather than roll
+ * one byte at a time, we compute the rsums for a batch of consecutive window
+ * positions at once with SIMD instructions and only return to the caller at a
+ * position that passes the bithash test.
+ *
+ * Rolling by one byte is
+ *   a' = a + new - old;  b' = b + a' - (old << blockshift)
+ * so over a batch the a values are a prefix sum of (new - old), and the b
+ * values a prefix sum of (a' - (old << blockshift)), all modulo 2^16. The
+ * bithash bits for the batch are then computed as in calc_bithash, also in
+ * the vector registers. */
+
+#include "zsglobal.h"
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "rcksum.h"
+#include "internal.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define RSUM_SCAN_X86
+# include <immintrin.h>
+#endif
+
+/* The bithash bit for the current window */
+static inline unsigned window_bithash(const struct rcksum_state *z) {
+    return calc_bithash(z, z->r[0].b, (z->seq_matches > 1) ? z->r[1].b
+                        : z->r[0].a & z->rsum_a_mask);
+}
+
+/* x = next_candidate_scalar(self, data, x, end)
+ * Portable version of next_candidate, one byte at a time. */
+int next_candidate_scalar(struct rcksum_state *z, const unsigned char *data,
+                          int x, int end) {
+    const size_t bs = z->blocksize;
+
+    do {
+        unsigned char nc = data[x + bs];
+        unsigned char oc = data[x];
+        UPDATE_RSUM(z->r[0].a, z->r[0].b, oc, nc, z->blockshift);
+        if (z->seq_matches > 1) {
+            unsigned char Nc = data[x + bs * 2];
+            UPDATE_RSUM(z->r[1].a, z->r[1].b, nc, Nc, z->blockshift);
+        }
+        x++;
+    } while (x < end && !bithash_test(z, window_bithash(z)));
+    return x;
+}
+
+#ifdef RSUM_SCAN_X86
+
+/* Load 8 bytes of data and zero extend them to 16-bit lanes */
+__attribute__((target("sse4.1")))
+static inline __m128i load8_epu16(const unsigned char *p) {
+    return _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)p));
+}
+
+/* Inclusive prefix sum of the 16-bit lanes of v */
+__attribute__((target("sse4.1")))
+static inline __m128i prefix_sum8(__m128i v) {
+    v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+    v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+    return _mm_add_epi16(v, _mm_slli_si128(v, 8));
+}
+
+/* Roll the rsums for the 8 window positions after the one whose rsum is in
+ * every lane of a and b; old and new are the bytes leaving and entering the
+ * window at each step. Sets a and b to the rsums at those positions. */
+__attribute__((target("sse4.1")))
+static inline void roll8(__m128i *a, __m128i *b, __m128i old, __m128i new,
+                         __m128i shift) {
+    *a = _mm_add_epi16(*a, prefix_sum8(_mm_sub_epi16(new, old)));
+    *b = _mm_add_epi16(*b, prefix_sum8(_mm_sub_epi16(*a, _mm_sll_epi16(old, shift))));
+}
+
+/* Copy the last 16-bit lane of v to all lanes */
+__attribute__((target("sse4.1")))
+static inline __m128i broadcast_last8(__m128i v) {
+    return _mm_shuffle_epi32(_mm_shufflehi_epi16(v, 0xff), 0xff);
+}
+
+/* calc_bithash for 4 pairs of 16-bit values, interleaved in 32-bit lanes */
+__attribute__((target("sse4.1")))
+static inline __m128i bithash4(__m128i bx, __m128i shift) {
+    return _mm_srl_epi32(_mm_mullo_epi32(bx, _mm_set1_epi32(0x9e3779b1u)), shift);
+}
+
+/* Store lane k of the rsums in a, b to r */
+__attribute__((target("sse4.1")))
+static inline void extract8(struct rsum *r, __m128i a, __m128i b, int k) {
+    unsigned short t[8];
+
+    _mm_storeu_si128((__m128i *)t, a);
+    r->a = t[k];
+    _mm_storeu_si128((__m128i *)t, b);
+    r->b = t[k];
+}
+
+/* x = next_candidate_sse41(self, data, x, end)
+ * next_candidate for 8 window positions at a time; the bithash bits are
+ * computed in the vector registers, then looked up one by one. */
+__attribute__((target("sse4.1")))
+int next_candidate_sse41(struct rcksum_state *z, const unsigned char *data,
+                         int x, int end) {
+    const size_t bs = z->blocksize;
+    const int seq = z->seq_matches > 1;
+    const __m128i shift = _mm_cvtsi32_si128(z->blockshift);
+    const __m128i hshift = _mm_cvtsi32_si128(z->bithashshift);
+    const __m128i amask = _mm_set1_epi16(z->rsum_a_mask);
+    __m128i a0 = _mm_set1_epi16(z->r[0].a), b0 = _mm_set1_epi16(z->r[0].b);
+    __m128i a1 = _mm_set1_epi16(z->r[1].a), b1 = _mm_set1_epi16(z->r[1].b);
+
+    if (x + 8 > end)
+        return next_candidate_scalar(z, data, x, end);
+
+    for (;;) {
+        __m128i second;
+        unsigned h[8];
+        int k;
+
+        roll8(&a0, &b0, load8_epu16(data + x), load8_epu16(data + x + bs),
+              shift);
+        if (seq) {
+            roll8(&a1, &b1, load8_epu16(data + x + bs),
+                  load8_epu16(data + x + 2 * bs), shift);
+            second = b1;
+        }
+        else
+            second = _mm_and_si128(a0, amask);
+
+        _mm_storeu_si128((__m128i *)h,
+                         bithash4(_mm_unpacklo_epi16(b0, second), hshift));
+        _mm_storeu_si128((__m128i *)(h + 4),
+                         bithash4(_mm_unpackhi_epi16(b0, second), hshift));
+
+        /* Stop at the first position that passed; or at the last, if we
+         * can't do another whole batch */
+        for (k = 0; k < 8; k++)
+            if (bithash_test(z, h[k]))
+                break;
+        if (k == 8 && x + 16 > end)
+            k = 7;
+        if (k < 8) {
+            extract8(&z->r[0], a0, b0, k);
+            if (seq)
+                extract8(&z->r[1], a1, b1, k);
+            x += k + 1;
+            return k == 7 && x < end && !bithash_test(z, h[7])
+                ? next_candidate_scalar(z, data, x, end) : x;
+        }
+
+        a0 = broadcast_last8(a0);
+        b0 = broadcast_last8(b0);
+        if (seq) {
+            a1 = broadcast_last8(a1);
+            b1 = broadcast_last8(b1);
+        }
+        x += 8;
+    }
+}
+
+/* Load 16 bytes of data and zero extend them to 16-bit lanes */
+__attribute__((target("avx2")))
+static inline __m256i load16_epu16(const unsigned char *p) {
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p));
+}
+
+/* Inclusive prefix sum of the 16-bit lanes of v */
+__attribute__((target("avx2")))
+static inline __m256i prefix_sum16(__m256i v) {
+    __m256i carry;
+
+    /* Prefix sums within each 128-bit half */
+    v = _mm256_add_epi16(v, _mm256_slli_si256(v, 2));
+    v = _mm256_add_epi16(v, _mm256_slli_si256(v, 4));
+    v = _mm256_add_epi16(v, _mm256_slli_si256(v, 8));
+
+    /* Then add the total of the low half to every lane of the high half */
+    carry = _mm256_shufflehi_epi16(v, 0xff);
+    carry = _mm256_unpackhi_epi64(carry, carry);
+    return _mm256_add_epi16(v, _mm256_permute2x128_si256(carry, carry, 0x08));
+}
+
+/* As roll8, for 16 window positions */
+__attribute__((target("avx2")))
+static inline void roll16(__m256i *a, __m256i *b, __m256i old, __m256i new,
+                          __m128i shift) {
+    *a = _mm256_add_epi16(*a, prefix_sum16(_mm256_sub_epi16(new, old)));
+    *b = _mm256_add_epi16(*b, prefix_sum16(_mm256_sub_epi16(*a, _mm256_sll_epi16(old, shift))));
+}
+
+/* Copy the last 16-bit lane of v to all lanes */
+__attribute__((target("avx2")))
+static inline __m256i broadcast_last16(__m256i v) {
+    v = _mm256_shuffle_epi32(_mm256_shufflehi_epi16(v, 0xff), 0xff);
+    return _mm256_permute2x128_si256(v, v, 0x11);
+}
+
+/* Store lane k of the rsums in a, b to r */
+__attribute__((target("avx2")))
+static inline void extract16(struct rsum *r, __m256i a, __m256i b, int k) {
+    unsigned short t[16];
+
+    _mm256_storeu_si256((__m256i *)t, a);
+    r->a = t[k];
+    _mm256_storeu_si256((__m256i *)t, b);
+    r->b = t[k];
+}
+
+/* Look up 8 pairs of 16-bit values, interleaved in 32-bit lanes, in the
+ * bithash as calc_bithash and bithash_test do; returns a mask with bit k set
+ * if pair k passes. The bithash is a whole number of 32-bit words, and on x86
+ * bit (h & 31) of word (h >> 5) is bit (h & 7) of byte (h >> 3), so we can
+ * gather words rather than bytes. */
+__attribute__((target("avx2")))
+static inline int bithash_lookup8(const struct rcksum_state *z, __m256i bx,
+                                  __m128i hshift) {
+    __m256i h = _mm256_srl_epi32(_mm256_mullo_epi32(bx, _mm256_set1_epi32(0x9e3779b1u)),
+                                 hshift);
+    __m256i words = _mm256_i32gather_epi32((const int *)z->bithash,
+                                           _mm256_srli_epi32(h, 5), 4);
+
+    words = _mm256_srlv_epi32(words, _mm256_and_si256(h, _mm256_set1_epi32(31)));
+    return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(words, 31)));
+}
+
+/* x = next_candidate_avx2(self, data, x, end)
+ * next_candidate for 16 window positions at a time, with the bithash
+ * lookups done by gathers. */
+__attribute__((target("avx2")))
+int next_candidate_avx2(struct rcksum_state *z, const unsigned char *data,
+                        int x, int end) {
+    const size_t bs = z->blocksize;
+    const int seq = z->seq_matches > 1;
+    const __m128i shift = _mm_cvtsi32_si128(z->blockshift);
+    const __m128i hshift = _mm_cvtsi32_si128(z->bithashshift);
+    const __m256i amask = _mm256_set1_epi16(z->rsum_a_mask);
+    __m256i a0 = _mm256_set1_epi16(z->r[0].a), b0 = _mm256_set1_epi16(z->r[0].b);
+    __m256i a1 = _mm256_set1_epi16(z->r[1].a), b1 = _mm256_set1_epi16(z->r[1].b);
+
+    if (x + 16 > end)
+        return next_candidate_scalar(z, data, x, end);
+
+    for (;;) {
+        __m256i second, b, s;
+        int hits, k;
+
+        roll16(&a0, &b0, load16_epu16(data + x), load16_epu16(data + x + bs),
+               shift);
+        if (seq) {
+            roll16(&a1, &b1, load16_epu16(data + x + bs),
+                   load16_epu16(data + x + 2 * bs), shift);
+            second = b1;
+        }
+        else
+            second = _mm256_and_si256(a0, amask);
+
+        /* Reorder the 64-bit quarters so that unpacking (which works within
+         * each 128-bit half) pairs up positions 0-7, then 8-15, in order */
+        b = _mm256_permute4x64_epi64(b0, 0xd8);
+        s = _mm256_permute4x64_epi64(second, 0xd8);
+        hits = bithash_lookup8(z, _mm256_unpacklo_epi16(b, s), hshift)
+            | bithash_lookup8(z, _mm256_unpackhi_epi16(b, s), hshift) << 8;
+
+        /* Stop at the first position that passed; or at the last, if we
+         * can't do another whole batch */
+        if (hits || x + 32 > end) {
+            k = hits ? __builtin_ctz(hits) : 15;
+            extract16(&z->r[0], a0, b0, k);
+            if (seq)
+                extract16(&z->r[1], a1, b1, k);
+            x += k + 1;
+            return !hits && x < end ? next_candidate_scalar(z, data, x, end) : x;
+        }
+
+        a0 = broadcast_last16(a0);
+        b0 = broadcast_last16(b0);
+        if (seq) {
+            a1 = broadcast_last16(a1);
+            b1 = broadcast_last16(b1);
+        }
+        x += 16;
+    }
+}
+
+#endif
+
+/* x = next_candidate(self, data, x, end)
+ * Rolls the rsums in self->r from window position x in data[] forward to the
+ * next position which passes the bithash test (so may match a block of the
+ * target), or to end if none does before then. Always advances at least one
+ * position; x must be less than end, and data[] must extend to end + context.
+ * Returns the new position. */
+int next_candidate(struct rcksum_state *z, const unsigned char *data, int x,
+                   int end) {
+#ifdef RSUM_SCAN_X86
+    if (__builtin_cpu_supports("avx2"))
+        return next_candidate_avx2(z, data, x, end);
+    if (__builtin_cpu_supports("sse4.1"))
+        return next_candidate_sse41(z, data, x, end);
+#endif
+    return next_candidate_scalar(z, data, x, end);
+}
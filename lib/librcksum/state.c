@@ -21,6 +21,7 @@
 
 #include "zsglobal.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -68,14 +69,20 @@ struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize,
     /* Initialise to 0 various state & stats */
     rs->gotblocks = 0;
     memset(&(rs->stats), 0, sizeof(rs->stats));
-    rs->ranges = NULL;
-    rs->numranges = 0;
+    rs->known = rs->known_some = rs->known_all = NULL;
+    rs->threads = 0;
 
     /* Hashes for looking up checksums are generated when needed.
      * So initially store NULL so we know there's nothing there yet.
      */
-    rs->rsum_hash = NULL;
+    rs->hash_keys = NULL;
+    rs->hash_heads = NULL;
+    rs->hash_ids = NULL;
+    rs->hash_pos = NULL;
     rs->bithash = NULL;
+    rs->next_match = -1;
+    rs->md4_ahead = NULL;
+    rs->src_data = NULL;
 
     if (!(rs->blocksize & (rs->blocksize - 1)) && rs->filename != NULL
             && rs->blocks) {
@@ -94,11 +101,20 @@ struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize,
                     }
             }
 
-            rs->blockhashes =
-                malloc(sizeof(rs->blockhashes[0]) *
-                        (rs->blocks + rs->seq_matches));
-            if (rs->blockhashes != NULL)
+            /* Buffer the blocks written, if we can; else write directly */
+            rs->wb = writeback_init(rs->fd, rs->blockshift, 1);
+            rs->write_error = 0;
+
+            rs->block_rsums =
+                calloc(rs->blocks + rs->seq_matches, sizeof(rs->block_rsums[0]));
+            rs->block_checksums =
+                malloc((size_t) rs->blocks * rs->checksum_bytes);
+            if (rs->block_rsums != NULL && rs->block_checksums != NULL
+                && init_ranges(rs) == 0)
                 return rs;
+            free(rs->block_rsums);
+            free(rs->block_checksums);
+            writeback_end(rs->wb);
 
             /* All below is error handling */
         }
@@ -108,6 +124,13 @@ struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize,
     return NULL;
 }
 
+/* rcksum_set_threads(self, threads)
+ * Sets the number of threads used to scan seed files. 1 disables the parallel
+ * scan, 0 (the default) uses one thread per online CPU. */
+void rcksum_set_threads(struct rcksum_state *rs, int threads) {
+    rs->threads = threads < 0 ? 0 : threads;
+}
+
 /* rcksum_filename(self)
  * Returns temporary filename to caller as malloced string.
  * Ownership of the file passes to the caller - the function returns NULL if
@@ -118,19 +141,138 @@ char *rcksum_filename(struct rcksum_state *rs) {
     return p;
 }
 
+/* rcksum_flush(self)
+ * Makes sure that all the blocks obtained so far are written to the temporary
+ * file. Returns 0, or -1 if writing any of them failed. */
+int rcksum_flush(struct rcksum_state *rs) {
+    if (rs->wb && !rs->write_error) {
+        rs->write_error = writeback_sync(rs->wb);
+        if (rs->write_error)
+            fprintf(stderr, "IO error: %s\n", strerror(rs->write_error));
+    }
+    return rs->write_error ? -1 : 0;
+}
+
+/* rcksum_sync(self)
+ * As rcksum_flush, and then waits until the blocks are on the disk. Returns 0,
+ * or -1 on error. */
+int rcksum_sync(struct rcksum_state *rs) {
+    if (rcksum_flush(rs) != 0)
+        return -1;
+    if (fdatasync(rs->fd) != 0) {
+        perror("fdatasync");
+        return -1;
+    }
+    return 0;
+}
+
 /* rcksum_filehandle(self)
- * Returns the filehandle for the temporary file.
+ * Returns the filehandle for the temporary file, with all blocks obtained
+ * written to it (check rcksum_flush first to know that they were).
  * Ownership of the handle passes to the caller - the function returns -1 if
  * called again, and it is up to the caller to close it. */
 int rcksum_filehandle(struct rcksum_state *rs) {
     int h = rs->fd;
+
+    rcksum_flush(rs);
+    writeback_end(rs->wb);
+    rs->wb = NULL;
     rs->fd = -1;
     return h;
 }
 
+/* check_resumed_block(self, fd, x, buf)
+ * Returns true iff block x in the file fd has the right checksum. buf is
+ * space for a block. */
+static int check_resumed_block(const struct rcksum_state *rs, int fd,
+                               zs_blockid x, unsigned char *buf) {
+    unsigned char md4sum[CHECKSUM_SIZE];
+
+    if (pread(fd, buf, rs->blocksize, (off_t) x << rs->blockshift)
+            != (ssize_t) rs->blocksize)
+        return 0;
+    rcksum_calc_checksum(md4sum, buf, rs->blocksize);
+    return !memcmp(md4sum, block_checksum(rs, x), rs->checksum_bytes);
+}
+
+/* rcksum_resume_file(self, filename, fd, ranges[], num, check)
+ * Takes over the file left by an earlier run as our working output, with the
+ * blocks in the num half-open ranges[] known - once up to check of them,
+ * evenly spread over all of them and including the first and last, have been
+ * read back from it and have the right checksums. Returns 0, or -1 if any
+ * didn't (or the ranges are not for this file); then nothing is changed. */
+int rcksum_resume_file(struct rcksum_state *rs, const char *filename, int fd,
+                       const zs_blockid *ranges, int num, int check) {
+    long long total = 0, seen = 0, k;
+    unsigned char *buf;
+    char *name;
+    int i;
+
+    if (rs->fd == -1)
+        return -1;
+
+    /* The ranges must be in order, and within the file */
+    for (i = 0; i < num; i++) {
+        if (ranges[2 * i] < (i ? ranges[2 * i - 1] : 0)
+                || ranges[2 * i + 1] <= ranges[2 * i]
+                || ranges[2 * i + 1] > rs->blocks)
+            return -1;
+        total += ranges[2 * i + 1] - ranges[2 * i];
+    }
+
+    /* Spot check the blocks: the k'th of check is the (k * (total - 1) /
+     * (check - 1))'th block known */
+    if (check > total)
+        check = total;
+    buf = malloc(rs->blocksize);
+    if (!buf)
+        return -1;
+    for (i = 0, k = 0; k < check; k++) {
+        long long n = check > 1 ? k * (total - 1) / (check - 1) : 0;
+
+        while (n >= seen + ranges[2 * i + 1] - ranges[2 * i]) {
+            seen += ranges[2 * i + 1] - ranges[2 * i];
+            i++;
+        }
+        if (!check_resumed_block(rs, fd, ranges[2 * i] + (n - seen), buf)) {
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+
+    if (!(name = strdup(filename)))
+        return -1;
+
+    /* Drop the temporary file, and use the old one instead */
+    writeback_end(rs->wb);
+    close(rs->fd);
+    if (rs->filename) {
+        unlink(rs->filename);
+        free(rs->filename);
+    }
+    rs->filename = name;
+    rs->fd = fd;
+    rs->wb = writeback_init(rs->fd, rs->blockshift, 1);
+    rs->write_error = 0;
+
+    for (i = 0; i < num; i++) {
+        zs_blockid x;
+
+        /* Known now, so not to be looked for in the data we're given */
+        for (x = ranges[2 * i]; x < ranges[2 * i + 1]; x++) {
+            add_to_ranges(rs, x);
+            if (rs->hash_keys)
+                remove_block_from_hash(rs, x);
+        }
+    }
+    return 0;
+}
+
 /* rcksum_end - destructor */
 void rcksum_end(struct rcksum_state *z) {
     /* Free temporary file resources */
+    writeback_end(z->wb);
     if (z->fd != -1)
         close(z->fd);
     if (z->filename) {
@@ -139,10 +281,10 @@ void rcksum_end(struct rcksum_state *z) {
     }
 
     /* Free other allocated memory */
-    free(z->rsum_hash);
-    free(z->blockhashes);
-    free(z->bithash);
-    free(z->ranges);            // Should be NULL already
+    free_hash(z);
+    free(z->block_rsums);
+    free(z->block_checksums);
+    free_ranges(z);
 #ifdef DEBUG
     fprintf(stderr, "hashhit %d, weakhit %d, checksummed %d, stronghit %d\n",
             z->stats.hashhit, z->stats.weakhit, z->stats.checksummed,
@@ -0,0 +1,524 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Buffered writing of blocks to the working output. Matches from a seed file
+ * come a block or two at a time, scattered all over the target; writing each
+ * one as we find it costs a system call per block and holds up the scan
+ * whenever the kernel is slow to take the data. Instead they are copied into
+ * a batch, and a full batch is handed to a writer thread, which writes it out
+ * in block order, as one call per run of adjacent blocks, while the scan goes
+ * on filling the other batch.
+ *
+ * Blocks found in a seed file needn't be copied at all: we note where in the
+ * seed they are, and runs of them that are adjacent in both files are copied
+ * by the kernel with copy_file_range(2). On filesystems that can share extents
+ * between files, that's all a seed which is an older version of the target
+ * costs for the parts that haven't moved. */
+
+#include "zsglobal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef WITH_DMALLOC
+# include <dmalloc.h>
+#endif
+
+#include "rcksum.h"
+#include "internal.h"
+
+/* Bytes of block data in each of the two batches */
+#define WRITEBACK_SIZE (1 << 20)
+
+/* Runs of blocks at least this long are written straight out; there's nothing
+ * to gain from copying them */
+#define WRITEBACK_DIRECT (64 << 10)
+
+/* Most buffers to pass to one pwritev(2) */
+#if defined(IOV_MAX) && IOV_MAX < 64
+# define WRITEBACK_IOV IOV_MAX
+#else
+# define WRITEBACK_IOV 64
+#endif
+
+/* Bytes to copy at a time if we have to copy from a seed file ourselves */
+#define WRITEBACK_BOUNCE (64 << 10)
+
+/* A block waiting to be written, and where its data is - in the batch, or
+ * at offset src in the batch's seed file if data is NULL */
+struct wb_entry {
+    zs_blockid id;
+    unsigned char *data;
+    off_t src;
+};
+
+struct wb_batch {
+    unsigned char *data;
+    struct wb_entry *entries;
+    int n;                      /* Blocks in the batch */
+    int src_fd;                 /* Seed file to copy blocks from, or -1 */
+};
+
+struct writeback {
+    int fd;
+    int blockshift;
+    int capacity;               /* Blocks per batch */
+
+    /* We fill batch[filling]; while busy, the writer thread is writing out
+     * the other one. */
+    struct wb_batch batch[2];
+    int filling;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int have_thread;            /* 1 if started, -1 if it couldn't be */
+    int busy;
+    int stop;
+
+    int error;                  /* errno of the first failed write, or 0 */
+};
+
+#ifndef HAVE_PWRITE
+/* Fallback pwrite(2) implementation if needed (but not strictly complete, as
+ * it moves the file pointer - we don't care). */
+ssize_t pwrite(int d, const void *buf, size_t nbytes, off_t offset) {
+    if (lseek(d, offset, SEEK_SET) == -1)
+        return -1;
+    return write(d, buf, nbytes);
+}
+#endif
+
+/* write_out(fd, data, len, offset)
+ * Writes len bytes from data[] at offset in fd.
+ * Returns 0, or the errno value if the write failed. */
+int write_out(int fd, const unsigned char *data, off_t len, off_t offset) {
+    while (len) {
+        size_t l = len;
+        ssize_t rc;
+
+        /* On some platforms, the bytes-to-write could be more than pwrite(2)
+         * will accept. Write in blocks of 2^31 bytes in that case. */
+        if ((off_t) l < len)
+            l = 0x8000000;
+
+        /* Write */
+        rc = pwrite(fd, data, l, offset);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+
+        /* Keep track of any data still to do */
+        len -= rc;
+        data += rc;
+        offset += rc;
+    }
+    return 0;
+}
+
+#ifdef HAVE_PWRITEV
+/* write_iov(fd, iov, n, offset)
+ * As write_out, for the n buffers in iov[] (which it modifies) in order. */
+static int write_iov(int fd, struct iovec *iov, int n, off_t offset) {
+    while (n) {
+        ssize_t rc = pwritev(fd, iov, n, offset);
+
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+
+        /* Skip what was written, which may end part way into a buffer */
+        offset += rc;
+        while (n && (size_t) rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n) {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+    return 0;
+}
+#endif
+
+/* copy_out(fd, src_fd, src, offset, len)
+ * Copies len bytes at src in src_fd to offset in fd; in the kernel if it can,
+ * which may just mean sharing the extents between the files.
+ * Returns 0, or the errno value if the copy failed. */
+static int copy_out(int fd, int src_fd, off_t src, off_t offset, off_t len) {
+    unsigned char *buf;
+    int rc = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while (len) {
+        loff_t in = src, out = offset;
+        ssize_t n = copy_file_range(src_fd, &in, fd, &out, len, 0);
+
+        if (n > 0) {
+            src += n;
+            offset += n;
+            len -= n;
+        }
+        else if (n == -1 && errno == EINTR)
+            continue;
+        else if (n == -1 && errno != EXDEV && errno != EINVAL
+                 && errno != ENOSYS && errno != EOPNOTSUPP)
+            return errno;
+        else
+            break;              /* Not between these files; do it ourselves */
+    }
+#endif
+    if (!len)
+        return 0;
+
+    if (!(buf = malloc(WRITEBACK_BOUNCE)))
+        return ENOMEM;
+    while (len && !rc) {
+        size_t l = len < WRITEBACK_BOUNCE ? len : WRITEBACK_BOUNCE;
+        ssize_t n = pread(src_fd, buf, l, src);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            rc = n ? errno : EIO;   /* The seed got shorter under us */
+            break;
+        }
+        rc = write_out(fd, buf, n, offset);
+        src += n;
+        offset += n;
+        len -= n;
+    }
+    free(buf);
+    return rc;
+}
+
+static int wb_entry_cmp(const void *a, const void *b) {
+    zs_blockid x = ((const struct wb_entry *) a)->id;
+    zs_blockid y = ((const struct wb_entry *) b)->id;
+    return x < y ? -1 : x > y;
+}
+
+/* flush_batch(self, batch)
+ * Writes out and empties the batch, in block order with a write per run of
+ * adjacent blocks. Returns 0, or the errno value of a failed write. */
+static int flush_batch(struct writeback *wb, struct wb_batch *b) {
+    size_t bs = (size_t) 1 << wb->blockshift;
+    int i = 0, rc = 0;
+
+    qsort(b->entries, b->n, sizeof b->entries[0], wb_entry_cmp);
+
+    while (i < b->n && !rc) {
+        int j;
+
+        /* A run of blocks from the seed file, adjacent there too. Blocks
+         * found twice are skipped, so each is checked against the start of
+         * the run rather than the entry before it. */
+        if (!b->entries[i].data) {
+            for (j = i + 1; j < b->n; j++) {
+                const struct wb_entry *e = &b->entries[j];
+
+                if (e->id == e[-1].id)
+                    continue;
+                if (e->data || e->id != e[-1].id + 1
+                    || e->src != b->entries[i].src
+                                 + ((off_t) (e->id - b->entries[i].id) << wb->blockshift))
+                    break;
+            }
+            rc = copy_out(wb->fd, b->src_fd, b->entries[i].src,
+                          (off_t) b->entries[i].id << wb->blockshift,
+                          (off_t) (b->entries[j - 1].id - b->entries[i].id + 1)
+                          << wb->blockshift);
+            i = j;
+            continue;
+        }
+#ifdef HAVE_PWRITEV
+        struct iovec iov[WRITEBACK_IOV];
+        int n = 0;
+
+        /* Gather the run of adjacent blocks starting here, merging buffers
+         * where their data is adjacent in the batch too */
+        for (j = i; j < b->n; j++) {
+            const struct wb_entry *e = &b->entries[j];
+
+            if (j > i) {
+                if (e->id == e[-1].id)
+                    continue;   /* Found twice; either copy will do */
+                if (!e->data || e->id != e[-1].id + 1)
+                    break;
+            }
+            if (n && (unsigned char *) iov[n - 1].iov_base
+                     + iov[n - 1].iov_len == e->data)
+                iov[n - 1].iov_len += bs;
+            else if (n == sizeof iov / sizeof iov[0])
+                break;
+            else {
+                iov[n].iov_base = e->data;
+                iov[n].iov_len = bs;
+                n++;
+            }
+        }
+        rc = write_iov(wb->fd, iov, n, (off_t) b->entries[i].id << wb->blockshift);
+#else
+        rc = write_out(wb->fd, b->entries[i].data, bs,
+                       (off_t) b->entries[i].id << wb->blockshift);
+        j = i + 1;
+#endif
+        i = j;
+    }
+    b->n = 0;
+    b->src_fd = -1;
+    return rc;
+}
+
+/* writeback_thread(self)
+ * Writes out each batch handed over to it, until told to stop */
+static void *writeback_thread(void *arg) {
+    struct writeback *wb = arg;
+
+    pthread_mutex_lock(&wb->lock);
+    for (;;) {
+        struct wb_batch *b;
+        int rc;
+
+        while (!wb->busy && !wb->stop)
+            pthread_cond_wait(&wb->cond, &wb->lock);
+        if (!wb->busy)
+            break;
+        b = &wb->batch[!wb->filling];
+        pthread_mutex_unlock(&wb->lock);
+
+        rc = flush_batch(wb, b);
+
+        pthread_mutex_lock(&wb->lock);
+        if (rc && !wb->error)
+            wb->error = rc;
+        wb->busy = 0;
+        pthread_cond_broadcast(&wb->cond);
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return NULL;
+}
+
+/* record_error(self, error)
+ * Notes the errno value of a failed write, unless we already have one.
+ * Returns error. */
+static int record_error(struct writeback *wb, int error) {
+    if (error) {
+        pthread_mutex_lock(&wb->lock);
+        if (!wb->error)
+            wb->error = error;
+        pthread_mutex_unlock(&wb->lock);
+    }
+    return error;
+}
+
+/* wait_idle(self)
+ * Waits for the writer thread to finish the batch it has, if any.
+ * Returns the error recorded so far. */
+static int wait_idle(struct writeback *wb) {
+    int error;
+
+    pthread_mutex_lock(&wb->lock);
+    while (wb->busy)
+        pthread_cond_wait(&wb->cond, &wb->lock);
+    error = wb->error;
+    pthread_mutex_unlock(&wb->lock);
+    return error;
+}
+
+/* writeback_init(fd, blockshift, threaded)
+ * Returns a write-back buffer for blocks of 2^blockshift bytes in fd, or NULL
+ * if out of memory. If threaded, full batches are written by a thread of its
+ * own (started when first needed); otherwise by the caller as it adds. */
+struct writeback *writeback_init(int fd, int blockshift, int threaded) {
+    struct writeback *wb = calloc(1, sizeof *wb);
+    int i;
+
+    if (!wb)
+        return NULL;
+    wb->fd = fd;
+    wb->blockshift = blockshift;
+    wb->capacity = WRITEBACK_SIZE >> blockshift;
+    if (wb->capacity < 1)
+        wb->capacity = 1;
+    wb->have_thread = threaded ? 0 : -1;
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->cond, NULL);
+
+    for (i = 0; i < 2; i++) {
+        wb->batch[i].src_fd = -1;
+        wb->batch[i].data = malloc((size_t) wb->capacity << blockshift);
+        wb->batch[i].entries = malloc(wb->capacity * sizeof(struct wb_entry));
+        if (!wb->batch[i].data || !wb->batch[i].entries) {
+            writeback_end(wb);
+            return NULL;
+        }
+    }
+    return wb;
+}
+
+/* hand_off(self)
+ * Passes the batch being filled to the writer thread, once it has finished
+ * the last one, and carries on with the other batch; or, without a writer
+ * thread, writes it out now. Returns the error recorded so far. */
+static int hand_off(struct writeback *wb) {
+    int error;
+
+    if (!wb->have_thread) {
+        wb->have_thread = pthread_create(&wb->thread, NULL, writeback_thread,
+                                         wb) == 0 ? 1 : -1;
+    }
+    if (wb->have_thread < 0) {
+        record_error(wb, flush_batch(wb, &wb->batch[wb->filling]));
+        return wb->error;
+    }
+
+    pthread_mutex_lock(&wb->lock);
+    while (wb->busy)
+        pthread_cond_wait(&wb->cond, &wb->lock);
+    error = wb->error;
+    if (!error) {
+        wb->filling = !wb->filling;
+        wb->busy = 1;
+        pthread_cond_broadcast(&wb->cond);
+    }
+    else {
+        wb->batch[wb->filling].n = 0;
+        wb->batch[wb->filling].src_fd = -1;
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return error;
+}
+
+/* writeback_add(self, data, bfrom, bto)
+ * Queues the blocks bfrom..bto (inclusive), whose data is in data[], to be
+ * written. Runs long enough to be worth a write of their own are written out
+ * at once.
+ * Returns 0, or the errno value of an earlier or current failed write. Once a
+ * write has failed, no more are made. */
+int writeback_add(struct writeback *wb, const unsigned char *data,
+                  zs_blockid bfrom, zs_blockid bto) {
+    int n = bto - bfrom + 1;
+    struct wb_batch *b = &wb->batch[wb->filling];
+    zs_blockid id;
+
+    if (n >= wb->capacity || (size_t) n << wb->blockshift >= WRITEBACK_DIRECT)
+        return record_error(wb, write_out(wb->fd, data,
+                                          (off_t) n << wb->blockshift,
+                                          (off_t) bfrom << wb->blockshift));
+
+    if (n > wb->capacity - b->n) {
+        int error = hand_off(wb);
+        if (error)
+            return error;
+        b = &wb->batch[wb->filling];
+    }
+
+    {
+        unsigned char *p = b->data + ((size_t) b->n << wb->blockshift);
+
+        memcpy(p, data, (size_t) n << wb->blockshift);
+        for (id = bfrom; id <= bto; id++) {
+            b->entries[b->n].id = id;
+            b->entries[b->n].data = p;
+            b->n++;
+            p += (size_t) 1 << wb->blockshift;
+        }
+    }
+    return 0;
+}
+
+/* writeback_add_copy(self, src_fd, src, bfrom, bto)
+ * As writeback_add, for blocks whose data is at offset src in the file
+ * src_fd, from which they are copied when written out. src_fd must stay open
+ * and unchanged until the next writeback_sync. */
+int writeback_add_copy(struct writeback *wb, int src_fd, off_t src,
+                       zs_blockid bfrom, zs_blockid bto) {
+    int n = bto - bfrom + 1;
+    struct wb_batch *b = &wb->batch[wb->filling];
+    zs_blockid id;
+
+    if (n >= wb->capacity || (size_t) n << wb->blockshift >= WRITEBACK_DIRECT)
+        return record_error(wb, copy_out(wb->fd, src_fd, src,
+                                         (off_t) bfrom << wb->blockshift,
+                                         (off_t) n << wb->blockshift));
+
+    /* A batch copies from only one seed file */
+    if (n > wb->capacity - b->n || (b->src_fd != -1 && b->src_fd != src_fd)) {
+        int error = hand_off(wb);
+        if (error)
+            return error;
+        b = &wb->batch[wb->filling];
+    }
+
+    b->src_fd = src_fd;
+    for (id = bfrom; id <= bto; id++) {
+        b->entries[b->n].id = id;
+        b->entries[b->n].data = NULL;
+        b->entries[b->n].src = src + ((off_t) (id - bfrom) << wb->blockshift);
+        b->n++;
+    }
+    return 0;
+}
+
+/* writeback_sync(self)
+ * Writes out everything queued so far, and waits for it to be written.
+ * Returns 0, or the errno value of a failed write. */
+int writeback_sync(struct writeback *wb) {
+    int error = wait_idle(wb);
+
+    if (!error && wb->batch[wb->filling].n)
+        error = record_error(wb, flush_batch(wb, &wb->batch[wb->filling]));
+    return error;
+}
+
+/* writeback_end(self)
+ * Writes out everything queued and frees the write-back buffer.
+ * Returns as writeback_sync. */
+int writeback_end(struct writeback *wb) {
+    int error = 0;
+
+    if (!wb)
+        return 0;
+    error = writeback_sync(wb);
+    if (wb->have_thread > 0) {
+        pthread_mutex_lock(&wb->lock);
+        wb->stop = 1;
+        pthread_cond_broadcast(&wb->cond);
+        pthread_mutex_unlock(&wb->lock);
+        pthread_join(wb->thread, NULL);
+    }
+    pthread_cond_destroy(&wb->cond);
+    pthread_mutex_destroy(&wb->lock);
+    free(wb->batch[0].data);
+    free(wb->batch[0].entries);
+    free(wb->batch[1].data);
+    free(wb->batch[1].entries);
+    free(wb);
+    return error;
+}
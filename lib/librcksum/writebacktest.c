@@ -0,0 +1,188 @@
+/*
+ *   zsync - client side rsync over http
+ *   Copyright (C) 2005 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Checks that blocks written through the write-back buffer, in any order and
+ * in runs of any length, from memory or copied from a seed file, and found
+ * more than once, end up in the right places; and that a failed write is
+ * reported. */
+
+#include "zsglobal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include "rcksum.h"
+#include "internal.h"
+
+static int check_writeback(int blockshift, int threaded) {
+    size_t bs = (size_t) 1 << blockshift;
+    zs_blockid nblocks = (4 << 20) >> blockshift;
+    unsigned char *data = malloc(nblocks * bs);
+    unsigned char *back = malloc(nblocks * bs);
+    char filename[] = "writebacktest-XXXXXX";
+    int fd = mkstemp(filename);
+    struct writeback *wb;
+    zs_blockid groups = (nblocks + 39) / 40;
+    zs_blockid g;
+    size_t i;
+    int rc = 0;
+
+    if (!data || !back || fd == -1 || !(wb = writeback_init(fd, blockshift, threaded)))
+        return 2;
+    unlink(filename);
+
+    srand(blockshift * 2 + threaded);
+    for (i = 0; i < nblocks * bs; i++)
+        data[i] = rand() >> 7;
+
+    /* Every block once, in runs of up to 40 scattered about, plus some twice */
+    for (g = 0; g < groups; g++) {
+        zs_blockid from = (g * 7919) % groups * 40;
+        zs_blockid end = from + 40 < nblocks ? from + 40 : nblocks;
+        zs_blockid x, n;
+
+        for (x = from; x < end; x += n) {
+            n = rand() % 40 + 1;
+            if (n > end - x)
+                n = end - x;
+            rc |= writeback_add(wb, data + x * bs, x, x + n - 1) != 0;
+            if (rand() % 4 == 0)
+                rc |= writeback_add(wb, data + x * bs, x, x) != 0;
+        }
+    }
+    rc |= writeback_sync(wb) != 0;
+
+    if (pread(fd, back, nblocks * bs, 0) != (ssize_t) (nblocks * bs)
+        || memcmp(data, back, nblocks * bs)) {
+        fprintf(stderr, "blocksize %zu%s: wrong data written\n", bs,
+                threaded ? " threaded" : "");
+        rc = 1;
+    }
+    rc |= writeback_end(wb) != 0;
+    close(fd);
+
+    /* Writing to a read-only file descriptor must fail, and stay failed */
+    fd = open("/dev/null", O_RDONLY);
+    if (fd == -1 || !(wb = writeback_init(fd, blockshift, threaded)))
+        return 2;
+    writeback_add(wb, data, 0, 0);
+    writeback_add(wb, data, 2, 2);
+    if (writeback_sync(wb) == 0 || writeback_sync(wb) == 0) {
+        fprintf(stderr, "blocksize %zu%s: write error not reported\n", bs,
+                threaded ? " threaded" : "");
+        rc = 1;
+    }
+    writeback_end(wb);
+    close(fd);
+
+    free(data);
+    free(back);
+    return rc;
+}
+
+/* Blocks queued to be copied from a seed file, mixed in with blocks from
+ * memory, must be copied from the right places */
+static int check_copy(int blockshift, int threaded) {
+    size_t bs = (size_t) 1 << blockshift;
+    zs_blockid nblocks = (1 << 20) >> blockshift;
+    off_t shift = 100;          /* Where the first copy of the data is in the seed */
+    off_t shift2;               /* and the second */
+    unsigned char *data = malloc(nblocks * bs);
+    unsigned char *back = malloc(nblocks * bs);
+    char seedname[] = "writebacktest-XXXXXX";
+    char filename[] = "writebacktest-XXXXXX";
+    int seed = mkstemp(seedname);
+    int fd = mkstemp(filename);
+    struct writeback *wb;
+    zs_blockid x, n;
+    size_t i;
+    int rc = 0;
+
+    if (!data || !back || seed == -1 || fd == -1
+        || !(wb = writeback_init(fd, blockshift, threaded)))
+        return 2;
+    unlink(seedname);
+    unlink(filename);
+
+    /* The first copy in the seed only has the blocks which are copied from
+     * it, and rubbish elsewhere, so a run copied from it which goes on too
+     * far picks up the wrong data */
+    srand(blockshift * 3 + threaded);
+    for (i = 0; i < nblocks * bs; i++)
+        back[i] = rand() >> 7;
+    for (i = 0; i < nblocks * bs; i++)
+        data[i] = rand() >> 7;
+    shift2 = shift + (off_t) (nblocks * bs);
+    if (pwrite(seed, data, shift, 0) != shift
+        || pwrite(seed, back, nblocks * bs, shift) != (ssize_t) (nblocks * bs)
+        || pwrite(seed, data, nblocks * bs, shift2) != (ssize_t) (nblocks * bs))
+        return 2;
+
+    for (x = 0; x < nblocks; x += n) {
+        n = rand() % 8 + 1;
+        if (n > nblocks - x)
+            n = nblocks - x;
+        switch (rand() % 3) {
+        case 0:
+            rc |= writeback_add(wb, data + x * bs, x, x + n - 1) != 0;
+            break;
+        case 1:
+            if (pwrite(seed, data + x * bs, n * bs, shift + (off_t) x * bs)
+                != (ssize_t) (n * bs))
+                return 2;
+            rc |= writeback_add_copy(wb, seed, shift + (off_t) x * bs,
+                                     x, x + n - 1) != 0;
+            break;
+        default:
+            rc |= writeback_add_copy(wb, seed, shift2 + (off_t) x * bs,
+                                     x, x + n - 1) != 0;
+        }
+        /* The same block found again elsewhere, where the next run may
+         * carry on from it */
+        if (rand() % 2)
+            rc |= writeback_add_copy(wb, seed, shift2 + (off_t) (x + n - 1) * bs,
+                                     x + n - 1, x + n - 1) != 0;
+    }
+    rc |= writeback_end(wb) != 0;
+
+    if (pread(fd, back, nblocks * bs, 0) != (ssize_t) (nblocks * bs)
+        || memcmp(data, back, nblocks * bs)) {
+        fprintf(stderr, "blocksize %zu%s: wrong data copied\n", bs,
+                threaded ? " threaded" : "");
+        rc = 1;
+    }
+    close(seed);
+    close(fd);
+    free(data);
+    free(back);
+    return rc;
+}
+
+int main(void)
+{
+    int rc = 0;
+
+    rc |= check_writeback(9, 0);
+    rc |= check_writeback(11, 0);
+    rc |= check_writeback(11, 1);
+    rc |= check_writeback(16, 1);
+    rc |= check_copy(9, 0);
+    rc |= check_copy(12, 1);
+    return rc;
+}
@@ -38,9 +38,12 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <spawn.h>
+#include <sys/wait.h>
 
 #include <arpa/inet.h>
 
@@ -48,6 +51,8 @@
 # include <dmalloc.h>
 #endif
 
+#include <gcrypt.h>
+
 #include "zlib/zlib.h"
 
 #include "librcksum/rcksum.h"
@@ -115,6 +120,12 @@ struct zsync_state {
 
     /* directory to create */
     char *target_dir;
+
+    /* SHA-1 of the start of the target, added to as the blocks from the start
+     * come in, so that only the rest has to be read back and hashed at the end */
+    gcry_md_hd_t sha1;
+    off_t sha1_hashed;          /* Bytes of the target hashed so far */
+    off_t sha1_tried;           /* How far the known data went when we last tried */
 };
 
 off_t zsync_filelen(struct zsync_state *zs) {
@@ -125,6 +136,8 @@ static int zsync_read_blocksums(struct zsync_state *zs, FILE * f,
                                 int rsum_bytes, int checksum_bytes,
                                 int seq_matches);
 static int zsync_recompress(struct zsync_state *zs);
+static void zsync_hash_known_data(struct zsync_state *zs);
+static int zsync_sha1_finish(struct zsync_state *zs, gcry_md_hd_t md, int fh);
 static time_t parse_822(const char* ts);
 
 /* char*[] = append_ptrlist(&num, &char[], "to add")
@@ -330,6 +343,9 @@ struct zsync_state* zsync_begin(FILE * f, int headersOnly, const char* target_di
 // forward declare zsync_cur_filename
 static char *zsync_cur_filename(struct zsync_state *zs);
 
+/* Number of blocks' checksums read from the .zsync at once */
+#define BLOCKSUMS_BATCH 65536
+
 /* zsync_read_blocksums(self, FILE*, rsum_bytes, checksum_bytes, seq_matches)
  * Called during construction only, this creates the rcksum_state that stores
  * the per-block checksums of the target file and holds the local working copy
@@ -347,27 +363,34 @@ static int zsync_read_blocksums(struct zsync_state *zs, FILE * f,
         return -1;
     }
 
-    /* Now read in and store the checksums */
-    zs_blockid id = 0;
-    for (; id < zs->blocks; id++) {
-        struct rsum r = { 0, 0 };
-        unsigned char checksum[CHECKSUM_SIZE];
-
-        /* Read in */
-        if (fread(((char *)&r) + 4 - rsum_bytes, rsum_bytes, 1, f) < 1
-            || fread((void *)&checksum, checksum_bytes, 1, f) < 1) {
+    /* Now read in and store the checksums, many blocks at a time */
+    {
+        const size_t reclen = rsum_bytes + checksum_bytes;
+        unsigned char *buf = malloc(BLOCKSUMS_BATCH * reclen);
+        zs_blockid id = 0;
 
-            /* Error - free the rcksum_state and tell the caller to bail */
-            fprintf(stderr, "short read on control file; %s\n",
-                    strerror(ferror(f)));
+        if (!buf) {
             rcksum_end(zs->rs);
             return -1;
         }
 
-        /* Convert to host endian and store */
-        r.a = ntohs(r.a);
-        r.b = ntohs(r.b);
-        rcksum_add_target_block(zs->rs, id, r, checksum);
+        while (id < zs->blocks) {
+            zs_blockid n = zs->blocks - id < BLOCKSUMS_BATCH
+                ? zs->blocks - id : BLOCKSUMS_BATCH;
+
+            if (fread(buf, reclen, n, f) < (size_t) n) {
+                /* Error - free the rcksum_state and tell the caller to bail */
+                fprintf(stderr, "short read on control file; %s\n",
+                        strerror(ferror(f)));
+                free(buf);
+                rcksum_end(zs->rs);
+                return -1;
+            }
+
+            rcksum_add_target_blocks(zs->rs, id, n, buf, rsum_bytes);
+            id += n;
+        }
+        free(buf);
     }
     return 0;
 }
@@ -528,7 +551,20 @@ off_t *zsync_needed_byte_ranges(struct zsync_state * zs, int *num, int type) {
  * written to our local copy of the target in progress. Progress reports if
  * progress != 0  */
 int zsync_submit_source_file(struct zsync_state *zs, FILE * f, int progress) {
-    return rcksum_submit_source_file(zs->rs, f, progress);
+    int rc = rcksum_submit_source_file(zs->rs, f, progress);
+
+    zsync_hash_known_data(zs);
+    return rc;
+}
+
+/* zsync_submit_source_fd(self, fd, progress)
+ * As zsync_submit_source_file, for the whole of the file open on fd; a regular
+ * file is scanned in place rather than copied through a stdio buffer. */
+int zsync_submit_source_fd(struct zsync_state *zs, int fd, int progress) {
+    int rc = rcksum_submit_source_fd(zs->rs, fd, progress);
+
+    zsync_hash_known_data(zs);
+    return rc;
 }
 
 char *zsync_cur_filename(struct zsync_state *zs) {
@@ -556,6 +592,112 @@ int zsync_rename_file(struct zsync_state *zs, const char *f) {
     return x;
 }
 
+/* Number of blocks of a file being resumed that are checked before we trust
+ * the rest of what the saved state says is in it */
+#define RESUME_CHECK_BLOCKS 16
+
+/* zsync_save_state(self, f)
+ * Writes to f which blocks of the target we have got, once they're all in the
+ * working file and on the disk, so that the download can be resumed from that
+ * file with zsync_resume_file if it is interrupted. Returns 0, or -1 on error. */
+int zsync_save_state(struct zsync_state *zs, FILE * f) {
+    zs_blockid *r;
+    int n, i;
+
+    /* The record must not get to the disk before the blocks it lists do */
+    if (rcksum_sync(zs->rs) != 0)
+        return -1;
+    r = rcksum_known_block_ranges(zs->rs, &n);
+    if (!r)
+        return -1;
+
+    fprintf(f, "zsync-state: 1\nLength: %lld\nBlocksize: %lu\n",
+            (long long)zs->filelen, (unsigned long)zs->blocksize);
+    if (zs->checksum)
+        fprintf(f, "%s: %s\n", zs->checksum_method, zs->checksum);
+    fprintf(f, "Ranges: %d\n\n", n);
+    for (i = 0; i < n; i++)
+        fprintf(f, "%d %d\n", r[2 * i], r[2 * i + 1]);
+    free(r);
+
+    return ferror(f) ? -1 : 0;
+}
+
+/* zsync_resume_file(self, filename, state)
+ * Resumes an interrupted download in filename, the working file it left, with
+ * the blocks which state (as written by zsync_save_state) says it got there -
+ * if the state is for this target and a sample of those blocks check out.
+ * Returns 1 if so, with filename now the working file; 0 if the file can't be
+ * resumed from (then nothing is changed). */
+int zsync_resume_file(struct zsync_state *zs, const char *filename, FILE * state) {
+    char buf[1024];
+    char checksum[1024] = "";
+    long long filelen = -1;
+    unsigned long blocksize = 0;
+    int n = -1, i, fd;
+    zs_blockid *r;
+
+    /* Header lines, as in the .zsync, up to a blank line */
+    while (fgets(buf, sizeof(buf), state) != NULL && buf[0] != '\n') {
+        char *p = strchr(buf, ':');
+
+        if (!p || p[1] != ' ')
+            return 0;
+        *p = 0;
+        p += 2;
+        p[strcspn(p, "\r\n")] = 0;
+
+        if (!strcmp(buf, "zsync-state")) {
+            if (strcmp(p, "1"))
+                return 0;
+        } else if (!strcmp(buf, "Length")) {
+            filelen = atoll(p);
+        } else if (!strcmp(buf, "Blocksize")) {
+            blocksize = strtoul(p, NULL, 10);
+        } else if (!strcmp(buf, "Ranges")) {
+            /* There can't be more ranges than blocks */
+            long ranges = strtol(p, NULL, 10);
+
+            n = ranges >= 0 && ranges <= zs->blocks ? (int) ranges : -1;
+        } else if (zs->checksum && !strcmp(buf, zs->checksum_method)) {
+            snprintf(checksum, sizeof(checksum), "%s", p);
+        }
+    }
+    if (filelen != zs->filelen || blocksize != zs->blocksize || n < 0
+        || (zs->checksum && strcmp(checksum, zs->checksum)))
+        return 0;
+
+    r = malloc(2 * (n ? n : 1) * sizeof *r);
+    if (!r)
+        return 0;
+    for (i = 0; i < n; i++)
+        if (fscanf(state, "%d %d", &r[2 * i], &r[2 * i + 1]) != 2) {
+            free(r);
+            return 0;
+        }
+
+    fd = open(filename, O_RDWR);
+    if (fd == -1) {
+        free(r);
+        return 0;
+    }
+    if (rcksum_resume_file(zs->rs, filename, fd, r, n, RESUME_CHECK_BLOCKS) != 0) {
+        close(fd);
+        free(r);
+        return 0;
+    }
+    free(r);
+
+    /* librcksum has the name of the working file now */
+    if (zs->cur_filename) {
+        unlink(zs->cur_filename);
+        free(zs->cur_filename);
+        zs->cur_filename = NULL;
+    }
+    zsync_hash_known_data(zs);
+    return 1;
+}
+
 /* int hexdigit(char)
  * Maps a character to 0..15 as a hex digit (or 0 if not valid hex digit)
  */
@@ -575,10 +717,15 @@ static int hexdigit(char c) {
  */
 int zsync_complete(struct zsync_state *zs) {
     int rc = 0;
+    int fh;
+
+    /* Make sure everything we've got is actually in the file */
+    if (rcksum_flush(zs->rs) != 0)
+        rc = -1;
 
     /* We've finished with the rsync algorithm. Take over the local copy from
      * librcksum and free our rcksum state. */
-    int fh = rcksum_filehandle(zs->rs);
+    fh = rcksum_filehandle(zs->rs);
     zsync_cur_filename(zs);
     rcksum_end(zs->rs);
     zs->rs = NULL;
@@ -594,9 +741,17 @@ int zsync_complete(struct zsync_state *zs) {
         rc = -1;
     }
 
-    /* Do checksum check */
+    /* Do checksum check, carrying on from what was hashed during the download
+     * if we can */
     if (rc == 0 && zs->checksum && !strcmp(zs->checksum_method, ckmeth_sha1)) {
-        rc = zsync_sha1(zs, fh);
+        if (zs->sha1 && lseek(fh, zs->sha1_hashed, SEEK_SET) == zs->sha1_hashed) {
+            rc = zsync_sha1_finish(zs, zs->sha1, fh);
+            zs->sha1 = NULL;
+        }
+        else {
+            lseek(fh, 0, SEEK_SET);
+            rc = zsync_sha1(zs, fh);
+        }
     }
     close(fh);
 
@@ -609,140 +764,238 @@ int zsync_complete(struct zsync_state *zs) {
     return rc;
 }
 
+/* Bytes of the file hashed at a time by zsync_sha1 */
+#define SHA1_READ_SIZE (1024 * 1024)
+
 /* zsync_sha1(self, filedesc)
  * Given the currently-open-and-at-start-of-file complete local copy of the
  * target, read it and compare the SHA1 checksum with the one from the .zsync.
+ * The hashing is done by libgcrypt, which uses the CPU's SHA extensions or
+ * vector instructions where it can, on large reads of the file.
  * Returns -1 or 1 as per zsync_complete.
  */
 int zsync_sha1(struct zsync_state *zs, int fh) {
-    SHA1_CTX shactx;
+    gcry_md_hd_t md;
 
+    if (gcry_md_open(&md, GCRY_MD_SHA1, 0) != 0) {
+        fprintf(stderr, "failed to set up SHA-1\n");
+        return -1;
+    }
+    return zsync_sha1_finish(zs, md, fh);
+}
+
+/* zsync_sha1_finish(self, md, filedesc)
+ * Adds the rest of the file, from the current position, to the SHA-1 in md and
+ * compares the result with the one from the .zsync. Closes md.
+ * Returns -1 or 1 as per zsync_complete.
+ */
+static int zsync_sha1_finish(struct zsync_state *zs, gcry_md_hd_t md, int fh) {
     {                           /* Do SHA1 of file contents */
-        unsigned char buf[4096];
-        int rc;
+        unsigned char *buf = malloc(SHA1_READ_SIZE);
+        ssize_t rc;
+
+        if (!buf) {
+            gcry_md_close(md);
+            return -1;
+        }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fh, lseek(fh, 0, SEEK_CUR), 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-        SHA1Init(&shactx);
-        while (0 < (rc = read(fh, buf, sizeof buf))) {
-            SHA1Update(&shactx, buf, rc);
+        while (0 < (rc = read(fh, buf, SHA1_READ_SIZE))) {
+            gcry_md_write(md, buf, rc);
         }
+        free(buf);
         if (rc < 0) {
             perror("read");
+            gcry_md_close(md);
             return -1;
         }
     }
 
     {                           /* And compare result of the SHA1 with the one from the .zsync */
-        unsigned char digest[SHA1_DIGEST_LENGTH];
+        const unsigned char *digest = gcry_md_read(md, GCRY_MD_SHA1);
         int i;
 
-        SHA1Final(digest, &shactx);
-
         for (i = 0; i < SHA1_DIGEST_LENGTH; i++) {
             int j;
             sscanf(&(zs->checksum[2 * i]), "%2x", &j);
             if (j != digest[i]) {
+                gcry_md_close(md);
                 return -1;
             }
         }
+        gcry_md_close(md);
         return 1; /* Checksum verified okay */
     }
 }
 
+/* How much more of the target has to be known from the start before we hash it
+ * during the download */
+#define SHA1_HASH_STEP (4 * 1024 * 1024)
+
+/* zsync_hash_known_data(self)
+ * Adds to the running SHA-1 of the target whatever more of it is now known
+ * from the start, so zsync_complete only has to read back and hash the rest.
+ * Waits until there is SHA1_HASH_STEP more (or the whole file), and only takes
+ * what is still in the page cache; anything else is left for the end, so this
+ * never waits on the disk in the middle of a download.
+ */
+static void zsync_hash_known_data(struct zsync_state *zs) {
+    unsigned char *buf;
+    off_t end;
+
+    if (!zs->rs || !zs->checksum || strcmp(zs->checksum_method, ckmeth_sha1))
+        return;
+
+    end = (off_t) rcksum_next_unknown_block(zs->rs, zs->sha1_hashed / zs->blocksize)
+        * zs->blocksize;
+    if (end > zs->filelen)
+        end = zs->filelen;
+    if (end <= zs->sha1_tried
+        || (end - zs->sha1_tried < SHA1_HASH_STEP && end < zs->filelen))
+        return;
+    zs->sha1_tried = end;
+
+    if (!zs->sha1 && gcry_md_open(&zs->sha1, GCRY_MD_SHA1, 0) != 0) {
+        zs->sha1 = NULL;
+        return;
+    }
+    buf = malloc(SHA1_READ_SIZE);
+    if (!buf)
+        return;
+
+    while (zs->sha1_hashed < end) {
+        size_t len = end - zs->sha1_hashed < SHA1_READ_SIZE
+            ? end - zs->sha1_hashed : SHA1_READ_SIZE;
+        int got = rcksum_read_cached_data(zs->rs, buf, zs->sha1_hashed, len);
+
+        if (got <= 0)
+            break;
+        gcry_md_write(zs->sha1, buf, got);
+        zs->sha1_hashed += got;
+    }
+    free(buf);
+}
+
 /* zsync_recompress(self)
  * Called when we have a complete local copy of the uncompressed data, to
  * perform compression requested in the .zsync.
  *
- * Shells out to the standard system gzip(1). Replaces the gzip file header
- * with the one supplied in the .zsync; this means we should get an identical
+ * Runs the standard system gzip(1) on it. Replaces the gzip file header with
+ * the one supplied in the .zsync; this means we should get an identical
  * compressed file output to the original compressed file on the source system
  * (to allow the user to verify a checksum on the compressed file, or just
  * because the user is picky and wants their compressed file to match the
- * original).
+ * original). zlib compresses differently from gzip, so it can't do this.
+ *
+ * gzip is run directly rather than through the shell, reading the file and
+ * writing the output file itself. With -n, the header it writes is exactly
+ * GZIP_HEADER_LEN bytes, so it starts writing where the end of ours goes, and
+ * ours is written over its header afterwards.
  *
  * Returns 0 on success, -1 on error (which is reported on stderr). */
-static int zsync_recompress(struct zsync_state *zs) {
-    /* Recompression. This is a fugly mess, calling gzip on the temporary file with options
-     *  read out of the .zsync, reading its output and replacing the gzip header. Ugh. */
-    FILE *g;
-    FILE *zout;
-    int rc = 0;
+#define GZIP_HEADER_LEN 10
 
-    char cmd[1024];
-    snprintf(cmd, sizeof(cmd), "gzip -n %s < ", zs->gzopts);
-
-    {   /* Add input filename, shell-escaped, to the command line */
-        int i = 0;
-        size_t j = strlen(cmd);
-        char c;
+static int zsync_recompress(struct zsync_state *zs) {
+    unsigned char *head;
+    size_t headlen = strlen(zs->gzhead) / 2;
+    char *argv[8];
+    int argc = 0;
+    char *opts;
+    char *zoname;
+    int in, out;
+    int rc = -1;
+
+    /* Decode the header */
+    if (headlen < GZIP_HEADER_LEN || !(head = malloc(headlen))) {
+        fprintf(stderr, "bad gzip header in .zsync, unable to compress.\n");
+        return -1;
+    }
+    {
+        size_t i;
+        for (i = 0; i < headlen; i++)
+            head[i] = (hexdigit(zs->gzhead[2 * i]) << 4) + hexdigit(zs->gzhead[2 * i + 1]);
+    }
 
-        while ((c = zs->cur_filename[i++]) != 0 && j < sizeof(cmd) - 2) {
-            if (!isalnum(c))
-                cmd[j++] = '\\';
-            cmd[j++] = c;
-        }
-        cmd[j] = 0;
+    /* Command line: gzip -n and the (whitelisted) options, space-separated */
+    opts = strdup(zs->gzopts);
+    zoname = malloc(strlen(zs->cur_filename) + 4);
+    if (!opts || !zoname) {
+        free(head);
+        free(opts);
+        free(zoname);
+        return -1;
     }
+    argv[argc++] = "gzip";
+    argv[argc++] = "-n";
+    {
+        char *p = strtok(opts, " ");
+        for (; p && argc < (int)(sizeof(argv) / sizeof *argv) - 1; p = strtok(NULL, " "))
+            argv[argc++] = p;
+    }
+    argv[argc] = NULL;
 
-    /* Read gzipped version of the data via pipe from gzip; write it to our new
-     * output file, except that we replace the gzip header with our own from
-     * the .zsync file. */
-    g = popen(cmd, "r");
-    if (g) {
-        char zoname[1024];
+    sprintf(zoname, "%s.gz", zs->cur_filename);
 
-        snprintf(zoname, sizeof(zoname), "%s.gz", zs->cur_filename);
-        zout = fopen(zoname, "w");
+    in = open(zs->cur_filename, O_RDONLY);
+    out = open(zoname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 
-        if (zout) {
-            char *p = zs->gzhead;
-            int skip = 1;
+    if (in == -1 || out == -1) {
+        perror("open");
+    }
+    else if (lseek(out, headlen - GZIP_HEADER_LEN, SEEK_SET) == -1) {
+        perror("lseek");
+    }
+    else {
+        posix_spawn_file_actions_t actions;
+        pid_t pid;
+        int status;
+        int err;
 
-            while (p[0] && p[1]) {
-                if (fputc((hexdigit(p[0]) << 4) + hexdigit(p[1]), zout) == EOF) {
-                    perror("putc");
-                    rc = -1;
-                }
-                p += 2;
-            }
-            while (!feof(g)) {
-                char buf[1024];
-                int r;
-                const char *p = buf;
-
-                if ((r = fread(buf, 1, sizeof(buf), g)) < 0) {
-                    perror("fread");
-                    rc = -1;
-                    goto leave_it;
-                }
-                if (skip) {
-                    p = skip_zhead(buf);
-                    skip = 0;
-                }
-                if (fwrite(p, 1, r - (p - buf), zout) != r - (p - buf)) {
-                    perror("fwrite");
-                    rc = -1;
-                    goto leave_it;
-                }
-            }
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
 
-          leave_it:
-            if (fclose(zout) != 0) {
-                perror("close");
-                rc = -1;
-            }
+        err = posix_spawnp(&pid, "gzip", &actions, NULL, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+
+        if (err != 0) {
+            fprintf(stderr, "problem with gzip, unable to compress: %s\n", strerror(err));
+        }
+        else if (waitpid(pid, &status, 0) == -1) {
+            perror("waitpid");
         }
-        if (fclose(g) != 0) {
-            perror("close");
-            rc = -1;
+        else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "gzip failed, unable to compress.\n");
+        }
+        else if (pwrite(out, head, headlen, 0) != (ssize_t) headlen) {
+            perror("pwrite");
+        }
+        else {
+            rc = 0;
         }
+    }
+
+    if (in != -1)
+        close(in);
+    if (out != -1 && close(out) != 0) {
+        perror("close");
+        rc = -1;
+    }
+    free(head);
+    free(opts);
 
+    if (rc == 0) {
         /* Free our old filename and replace with the new one */
         unlink(zs->cur_filename);
         free(zs->cur_filename);
-        zs->cur_filename = strdup(zoname);
+        zs->cur_filename = zoname;
     }
     else {
-        fprintf(stderr, "problem with gzip, unable to compress.\n");
+        unlink(zoname);
+        free(zoname);
     }
     return rc;
 }
@@ -757,6 +1010,8 @@ char *zsync_end(struct zsync_state *zs) {
         rcksum_end(zs->rs);
     if (zs->zmap)
         zmap_free(zs->zmap);
+    if (zs->sha1)
+        gcry_md_close(zs->sha1);
 
     /* Clear download URLs */
     for (i = 0; i < zs->nurl; i++)
@@ -1013,12 +1268,16 @@ static int zsync_receive_data_compressed(struct zsync_receiver *zr,
  */
 int zsync_receive_data(struct zsync_receiver *zr, const unsigned char *buf,
                        off_t offset, size_t len) {
+    int rc;
+
     if (zr->url_type == 1) {
-        return zsync_receive_data_compressed(zr, buf, offset, len);
+        rc = zsync_receive_data_compressed(zr, buf, offset, len);
     }
     else {
-        return zsync_receive_data_uncompressed(zr, buf, offset, len);
+        rc = zsync_receive_data_uncompressed(zr, buf, offset, len);
     }
+    zsync_hash_known_data(zr->zs);
+    return rc;
 }
 
 /* Destructor */
@@ -34,6 +34,22 @@ time_t zsync_mtime(const struct zsync_state*);
  * This is purely a hint; zsync could ignore it. Returns 0 if successful. */
 int zsync_rename_file(struct zsync_state* zs, const char* f);
 
+/* zsync_save_state - writes to the given stream a record of the blocks obtained
+ * so far, making sure they are all written to the temporary file, and on the
+ * disk, first. If the download is interrupted, it can be continued from that
+ * file and this record with zsync_resume_file. Returns 0 if successful. */
+int zsync_save_state(struct zsync_state* zs, FILE* state);
+
+/* zsync_resume_file - continue an interrupted download in the temporary file
+ * it left behind, f, given the record zsync_save_state made of it. Some of the
+ * blocks recorded are checked against the .zsync; if they match (and the
+ * record is for this target), f becomes the temporary file and all the blocks
+ * recorded are taken as obtained, without reading the rest of f. Call this
+ * before submitting any source files.
+ * Returns 1 if successful, 0 if f can't be resumed from (it can still be used
+ * as a source file then). */
+int zsync_resume_file(struct zsync_state* zs, const char* f, FILE* state);
+
 /* zsync_status - returns the current state:
  * 0 - no relevant local data found yet.
  * 1 - some data present
@@ -47,10 +63,17 @@ int zsync_status(const struct zsync_state* zs);
  * and the total (roughly, the file length) in *total */
 void zsync_progress(const struct zsync_state* zs, long long* got, long long* total);
 
-/* zsync_submit_source_file - submit local file data to zsync
+/* zsync_submit_source_file - submit local file data to zsync. Returns the
+ * number of blocks obtained, or -1 if writing them to the local file failed
  */
 int zsync_submit_source_file(struct zsync_state* zs, FILE* f, int progress);
 
+/* zsync_submit_source_fd - as zsync_submit_source_file, for the whole of the
+ * file open on fd, which is read without moving its offset if it is a regular
+ * file
+ */
+int zsync_submit_source_fd(struct zsync_state* zs, int fd, int progress);
+
 /* zsync_get_url - returns a URL from which to get needed data.
  * Returns NULL on failure, or a array of pointers to URLs.
  * Returns the size of the array in *n,
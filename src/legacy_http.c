@@ -32,6 +32,9 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <time.h>
+#ifdef HAVE_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 #include <curl/curl.h>
 
 #include "legacy_http.h"
@@ -73,21 +76,75 @@ struct http_file
         FILE *file;
     } handle;
 
+    /* Data received and not yet read, in a ring buffer of HTTP_BUFFER_SIZE
+     * bytes: buffer_len bytes, starting buffer_start bytes in (and wrapping
+     * around at the end) */
     char *buffer;
-    uint64_t buffer_len;
-    uint64_t buffer_pos;
-    int still_running;
+    size_t buffer_start;
+    size_t buffer_len;
+    int still_running;  /* non-zero until curl reports this transfer done */
+    int paused;         /* and non-zero while we've told curl to hold off */
+
+    struct range_fetch *rf; /* The range fetch this transfer is for */
+    size_t streamed;    /* Bytes passed straight to its sink since we last
+                         * looked */
 };
 
 typedef struct http_file HTTP_FILE;
 
+/* Size of the receive buffer for each transfer, a power of 2. When it's full,
+ * the transfer is paused until there's room again; we resume it once it's
+ * half empty. So a read must never wait for more than half of this, and curl
+ * must never pass us more than half of it at once (which also covers the
+ * largest header line it accepts, 100 KiB). We ask curl for chunks that big:
+ * data passed straight to a sink is verified and written a chunk at a time. */
+#define HTTP_BUFFER_SIZE (256 * 1024)
+#define HTTP_BUFFER_MAX_READ (HTTP_BUFFER_SIZE / 4)
+#define HTTP_RECV_SIZE (HTTP_BUFFER_SIZE / 2)
+
+/* Limits on how many ranges to ask for in one request: the Range header has to
+ * fit in the server's limit on header lines (commonly 8 KiB), and some servers
+ * (Apache, by default) give up on requests with more than 200 ranges and send
+ * the whole file instead. */
+#define RANGES_HEADER_BUDGET 4096
+#define RANGES_PER_REQUEST 100
+
+/* What we've learned about a server, shared by all the range fetches for the
+ * same URL on a multi handle. */
+struct http_server {
+    char *url;
+    int multirange;     /* 1 if the server has answered a request for several
+                         * ranges with several, 0 if it has failed to and we
+                         * ask for one range at a time, -1 if we don't know */
+    int multiplexed;    /* non-zero once the server has answered over HTTP/2,
+                         * so further requests are streams on one connection */
+    struct http_server *next;
+};
+
+/* A curl multi handle, shared by all the range fetches started with
+ * range_fetch_start_shared() from the same original, which may be talking to
+ * different servers (mirrors); waiting for any of them drives them all. */
+struct http_multi {
+    CURLM *handle;
+#ifdef HAVE_EPOLL_CREATE1
+    int epfd;           /* epoll instance watching curl's sockets */
+    long long deadline; /* and when curl next wants to be called, in ms of
+                         * CLOCK_MONOTONIC, or -1 if it doesn't */
+#endif
+    int refs;
+    struct http_server *servers;
+};
+
 struct range_fetch {
     /* URL to retrieve from, host:port, auth header */
     char *url;
     HTTP_FILE *file;
     char *boundary; /* If we're in the middle of reading a mime/multipart
                      * response, this is the boundary string. */
-    CURLM *multi_handle;
+    struct http_multi *multi;
+    struct http_server *server;
+    int request_pending;    /* non-zero if we've sent a request but not yet read
+                             * the response headers */
 
     /* State for block currently being read */
     size_t block_left;  /* non-zero if we're in the middle of reading a block */
@@ -101,6 +158,23 @@ struct range_fetch {
     int nranges;
     int rangessent;     /* We've requested the first rangessent ranges from the remote */
     int rangesdone;     /* and received this many */
+    int request_ranges; /* Number of ranges asked for in the latest request */
+    size_t held;        /* Bytes at the front of the file's buffer that the
+                         * caller of get_range_data may still be using */
+
+    /* If set, range data is passed to this as soon as it arrives, when there
+     * is nothing before it waiting to be read */
+    range_fetch_sink sink;
+    void *sink_context;
+    int in_body;        /* non-zero once we've read the headers for the block
+                         * being read, so what comes next is its data */
+
+    /* Timings of the requests completed since range_fetch_timing was last
+     * called, summed up */
+    int timed_requests;
+    double latency;     /* from sending the request to the first byte back */
+    off_t timed_bytes;  /* received in the bodies */
+    double transfer_time;   /* taken to receive them */
 };
 
 
@@ -148,70 +222,356 @@ void setup_curl_handle(CURL *handle)
  */
 static size_t write_callback(char *buffer, size_t size, size_t nitems, void *userp)
 {
-    char *newbuff;
-    size_t rembuff;
     HTTP_FILE *url = (HTTP_FILE *)userp;
-    size *= nitems;
-    /* remaining space in buffer */
-    rembuff=url->buffer_len - url->buffer_pos;
-
-    if(size > rembuff) {
-        /* not enough space in buffer, alloc more */
-        newbuff = realloc(url->buffer, url->buffer_len + (size - rembuff));
-        if(newbuff == NULL){
-            log_message("callback buffer grow failed");
-            size = rembuff;
-        }else{
-            /* buffer got more memory, record the new length and keep the new buffer */
-            url->buffer_len += size - rembuff;
-            url->buffer = newbuff;
-        }
+    struct range_fetch *rf = url->rf;
+    size_t end, first;
+    size_t total = size * nitems;
+    size = total;
+
+    /* If this is data of the block being read, and there's nothing before it
+     * in the buffer, it can go straight to the sink without being buffered */
+    if (rf->sink && rf->in_body && rf->block_left && !url->buffer_len) {
+        size_t n = size < rf->block_left ? size : rf->block_left;
+
+        if (rf->sink(rf->sink_context, (const unsigned char *)buffer,
+                     rf->offset, n) != 0)
+            return 0;   /* abort the transfer; the sink knows why */
+
+        rf->block_left -= n;
+        rf->offset += n;
+        rf->bytes_down += n;
+        url->streamed += n;
+        if (!rf->block_left)
+            rf->in_body = 0;
+
+        /* Anything after the block (a multipart boundary, say) is buffered
+         * as usual; the buffer is empty, so it fits */
+        buffer += n;
+        size -= n;
+        if (!size)
+            return total;
+    }
+
+    if (size > HTTP_BUFFER_SIZE) {
+        log_message("received %zu bytes at once, more than we can buffer", size);
+        return 0;
+    }
+
+    /* If there's no room, make curl keep the data until we've read some */
+    if (size > HTTP_BUFFER_SIZE - url->buffer_len) {
+        url->paused = 1;
+        return CURL_WRITEFUNC_PAUSE;
     }
 
-    memcpy(&url->buffer[url->buffer_pos], buffer, size);
-    url->buffer_pos += size;
-    return size;
+    /* Copy in after the data already there, wrapping around at the end */
+    end = (url->buffer_start + url->buffer_len) & (HTTP_BUFFER_SIZE - 1);
+    first = HTTP_BUFFER_SIZE - end;
+    if (first > size)
+        first = size;
+    memcpy(&url->buffer[end], buffer, first);
+    memcpy(url->buffer, buffer + first, size - first);
+    url->buffer_len += size;
+    return total;
 }
 
 
 /****************************************************************************
  *
- * Creates the ranges to fetch. We only send 20 ranges at a time,
- * because with large amounts of differences the string can get too long
- * for the remote server to accept.
+ * Creates the ranges to fetch. We send as many ranges at a time as fit in
+ * RANGES_HEADER_BUDGET, up to RANGES_PER_REQUEST, because with large amounts
+ * of differences the string can get too long for the remote server to accept;
+ * or just one, if the server doesn't cope with several ranges per request.
  */
 void http_load_ranges(struct range_fetch* rf)
 {
-    /* send max 20 ranges in each request */
-    int ranges_limit = 20;
+    int ranges_limit = rf->server->multirange ? RANGES_PER_REQUEST : 1;
     int sent_this_chunk = 0;
-    int l;
+    size_t l = 0;
     int i;
     /* destination for the final ranges request header content */
-    char ranges_opt[4097];
+    char ranges_opt[RANGES_HEADER_BUDGET + 1];
     /* each individual range we prepare */
-    char range[32];
-
-    memset(range, 0, sizeof(range));
-    memset(ranges_opt, 0, sizeof(ranges_opt));
+    char range[48];
 
     /* create ranges with maximum of ranges_limit, or as many as there are */
     for (; (sent_this_chunk < ranges_limit) && (rf->rangessent < rf->nranges); sent_this_chunk++) {
         /* makes the table of ranges access more readable */
         i = rf->rangessent;
-        l = strlen(ranges_opt);
-        snprintf(range, sizeof(range), OFF_T_PF "-" OFF_T_PF ",",
-                 rf->ranges_todo[2 * i], rf->ranges_todo[2 * i + 1]);
-        strncat(ranges_opt, range, l + strlen(range));
+        int n = snprintf(range, sizeof(range), OFF_T_PF "-" OFF_T_PF ",",
+                         rf->ranges_todo[2 * i], rf->ranges_todo[2 * i + 1]);
+        if (sent_this_chunk && l + n > RANGES_HEADER_BUDGET)
+            break;
+        memcpy(ranges_opt + l, range, n);
+        l += n;
         rf->rangessent++;
     }
 
     /* gets rid of the trailing comma */
-    ranges_opt[strlen(ranges_opt)-1] = 0;
+    ranges_opt[l - 1] = 0;
+    rf->request_ranges = sent_this_chunk;
     curl_easy_setopt(rf->file->handle.curl, CURLOPT_RANGE, ranges_opt);
 }
 
 
+/****************************************************************************
+ *
+ * The multi handle shared by range fetches. Where we have epoll, curl tells
+ * us which sockets it wants watched (and when it next needs calling anyway),
+ * and we tell curl which sockets are ready; so waiting costs the same however
+ * many connections there are, with no limit on the descriptor numbers.
+ * Otherwise, we fall back to select().
+ */
+#ifdef HAVE_EPOLL_CREATE1
+static int http_multi_socket(CURL *easy, curl_socket_t s, int what,
+                             void *userp, void *socketp)
+{
+    struct http_multi *multi = (struct http_multi *)userp;
+    struct epoll_event ev;
+    (void)easy;
+
+    if (what == CURL_POLL_REMOVE) {
+        if (socketp)
+            epoll_ctl(multi->epfd, EPOLL_CTL_DEL, s, NULL);
+        curl_multi_assign(multi->handle, s, NULL);
+        return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (what & CURL_POLL_IN ? EPOLLIN : 0)
+              | (what & CURL_POLL_OUT ? EPOLLOUT : 0);
+    ev.data.fd = s;
+    if (socketp) {
+        epoll_ctl(multi->epfd, EPOLL_CTL_MOD, s, &ev);
+    } else if (epoll_ctl(multi->epfd, EPOLL_CTL_ADD, s, &ev) == 0) {
+        /* Mark the socket as one we're watching */
+        curl_multi_assign(multi->handle, s, multi);
+    }
+    return 0;
+}
+
+static long long http_multi_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int http_multi_timer(CURLM *handle, long timeout_ms, void *userp)
+{
+    struct http_multi *multi = (struct http_multi *)userp;
+    (void)handle;
+
+    multi->deadline = timeout_ms < 0 ? -1 : http_multi_now() + timeout_ms;
+    return 0;
+}
+#endif
+
+static struct http_multi *http_multi_new(void)
+{
+    struct http_multi *multi = malloc(sizeof(*multi));
+
+    if (!multi)
+        return NULL;
+    multi->handle = curl_multi_init();
+    if (!multi->handle) {
+        free(multi);
+        return NULL;
+    }
+#ifdef HAVE_EPOLL_CREATE1
+    multi->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (multi->epfd == -1) {
+        curl_multi_cleanup(multi->handle);
+        free(multi);
+        return NULL;
+    }
+    multi->deadline = -1;
+    curl_multi_setopt(multi->handle, CURLMOPT_SOCKETFUNCTION, http_multi_socket);
+    curl_multi_setopt(multi->handle, CURLMOPT_SOCKETDATA, multi);
+    curl_multi_setopt(multi->handle, CURLMOPT_TIMERFUNCTION, http_multi_timer);
+    curl_multi_setopt(multi->handle, CURLMOPT_TIMERDATA, multi);
+#endif
+#if CURL_AT_LEAST_VERSION(7, 43, 0)
+    /* Run concurrent requests to the same server as HTTP/2 streams over one
+     * connection, where it speaks HTTP/2 */
+    curl_multi_setopt(multi->handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+    multi->refs = 0;
+    multi->servers = NULL;
+    return multi;
+}
+
+/* http_multi_server(multi, url)
+ * Returns the record of what we know about the server for url, creating it
+ * if there isn't one yet. */
+static struct http_server *http_multi_server(struct http_multi *multi,
+                                             const char *url)
+{
+    struct http_server *server;
+
+    for (server = multi->servers; server; server = server->next)
+        if (!strcmp(server->url, url))
+            return server;
+
+    server = malloc(sizeof(*server));
+    if (!server)
+        return NULL;
+    server->url = strdup(url);
+    if (!server->url) {
+        free(server);
+        return NULL;
+    }
+    server->multirange = -1;
+    server->multiplexed = 0;
+    server->next = multi->servers;
+    multi->servers = server;
+    return server;
+}
+
+static void http_multi_free(struct http_multi *multi)
+{
+    while (multi->servers) {
+        struct http_server *next = multi->servers->next;
+
+        free(multi->servers->url);
+        free(multi->servers);
+        multi->servers = next;
+    }
+    curl_multi_cleanup(multi->handle);
+#ifdef HAVE_EPOLL_CREATE1
+    close(multi->epfd);
+#endif
+    free(multi);
+}
+
+/* http_multi_kick(multi)
+ * Gets curl going on transfers just added, without waiting for anything. */
+static void http_multi_kick(struct http_multi *multi)
+{
+    int running_handles;
+
+#ifdef HAVE_EPOLL_CREATE1
+    curl_multi_socket_action(multi->handle, CURL_SOCKET_TIMEOUT, 0,
+                             &running_handles);
+#else
+    curl_multi_perform(multi->handle, &running_handles);
+#endif
+}
+
+/* http_multi_wait(multi)
+ * Waits for something to happen on any transfer, or until curl wants to be
+ * called anyway (up to a minute), and lets curl deal with it. */
+static void http_multi_wait(struct http_multi *multi)
+{
+    int running_handles;
+#ifdef HAVE_EPOLL_CREATE1
+    struct epoll_event events[64];
+    /* one minute timeout, could make this an option? */
+    long long timeout = 60000;
+    int n, i;
+
+    if (multi->deadline >= 0) {
+        timeout = multi->deadline - http_multi_now();
+        if (timeout < 0)
+            timeout = 0;
+        else if (timeout > 60000)
+            timeout = 60000;
+    }
+    n = epoll_wait(multi->epfd, events, sizeof(events) / sizeof(events[0]),
+                   (int) timeout);
+
+    /* curl's timer is one-shot: once it's due, it's up to curl to set it
+     * again if need be */
+    if (multi->deadline >= 0 && http_multi_now() >= multi->deadline) {
+        multi->deadline = -1;
+        curl_multi_socket_action(multi->handle, CURL_SOCKET_TIMEOUT, 0,
+                                 &running_handles);
+    }
+    for (i = 0; i < n; i++) {
+        int mask = (events[i].events & (EPOLLIN | EPOLLHUP) ? CURL_CSELECT_IN : 0)
+                 | (events[i].events & EPOLLOUT ? CURL_CSELECT_OUT : 0)
+                 | (events[i].events & EPOLLERR ? CURL_CSELECT_ERR : 0);
+
+        curl_multi_socket_action(multi->handle, events[i].data.fd, mask,
+                                 &running_handles);
+    }
+#else
+    fd_set fdread;
+    fd_set fdwrite;
+    fd_set fdexcep;
+    struct timeval timeout;
+    int maxfd = -1;
+    long curl_timeo = -1;
+
+    FD_ZERO(&fdread);
+    FD_ZERO(&fdwrite);
+    FD_ZERO(&fdexcep);
+
+    /* one minute timeout, could make this an option? */
+    timeout.tv_sec = 60;
+    timeout.tv_usec = 0;
+
+    curl_multi_timeout(multi->handle, &curl_timeo);
+    if(curl_timeo >= 0){
+        timeout.tv_sec = curl_timeo / 1000;
+        if(timeout.tv_sec > 1){
+            timeout.tv_sec = 1;
+        }else{
+            timeout.tv_usec = (curl_timeo % 1000) * 1000;
+        }
+    }
+    curl_multi_fdset(multi->handle, &fdread, &fdwrite, &fdexcep, &maxfd);
+    if(select(maxfd+1, &fdread, &fdwrite, &fdexcep, &timeout) != -1){
+        curl_multi_perform(multi->handle, &running_handles);
+    }
+#endif
+}
+
+
+/****************************************************************************
+ *
+ * Marks the HTTP_FILEs whose transfers curl has finished. Other transfers on
+ * the same multi handle may still be running, so we can't go by the count of
+ * running handles.
+ */
+static void http_check_done(CURLM *multi_handle)
+{
+    CURLMsg *msg;
+    int msgs_left;
+
+    while ((msg = curl_multi_info_read(multi_handle, &msgs_left)) != NULL) {
+        HTTP_FILE *file = NULL;
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&file);
+        if (!file)
+            continue;
+        file->still_running = 0;
+
+#if CURL_AT_LEAST_VERSION(7, 61, 0)
+        if (msg->data.result == CURLE_OK && file->rf) {
+            struct range_fetch *rf = file->rf;
+            curl_off_t pretransfer = 0, starttransfer = 0, total = 0, size = 0;
+
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME_T, &total);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_SIZE_DOWNLOAD_T, &size);
+
+            /* Times are in microseconds */
+            rf->timed_requests++;
+            rf->latency += (starttransfer - pretransfer) / 1e6;
+            rf->timed_bytes += size;
+            rf->transfer_time += (total - starttransfer) / 1e6;
+        }
+#endif
+    }
+}
+
+int http_fclose(HTTP_FILE *file, CURLM* multi_handle);
+
+
 /****************************************************************************
  *
  * Loads a HTTP_FILE into the range_fetch struct. Can be called multiple
@@ -220,24 +580,24 @@ void http_load_ranges(struct range_fetch* rf)
 HTTP_FILE *http_fetch_ranges(struct range_fetch* rf)
 {
     HTTP_FILE *file;
-
-    if(!rf->multi_handle){
-        rf->multi_handle = curl_multi_init();
-    }
+    CURLM *multi_handle = rf->multi->handle;
+    char *buffer = NULL;
 
     if(!rf->file) {
         /* if the file has never been set, we've never sent any ranges. */
         rf->rangessent = 0;
     }else{
-        /* free the old file and buffer, ready for the new one */
-        if(rf->file->buffer){
-            free(rf->file->buffer);
-        }
-        free(rf->file);
+        /* close the old transfer, ready for the new one; the connection stays
+         * in the multi handle's cache to be reused, and we keep the buffer */
+        buffer = rf->file->buffer;
+        rf->file->buffer = NULL;
+        http_fclose(rf->file, multi_handle);
     }
 
     file = (HTTP_FILE *) malloc(sizeof(HTTP_FILE));
     memset(file, 0, sizeof(HTTP_FILE));
+    file->buffer = buffer ? buffer : malloc(HTTP_BUFFER_SIZE);
+    file->rf = rf;
     file->handle.curl = curl_easy_init();
 
     /* TODO: move these into common code that sets them based on a command line option */
@@ -249,11 +609,24 @@ HTTP_FILE *http_fetch_ranges(struct range_fetch* rf)
     /* we still process the headers ourselves so we can get range information */
     curl_easy_setopt(file->handle.curl, CURLOPT_HEADER, 1L);
     curl_easy_setopt(file->handle.curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_multi_add_handle(rf->multi_handle, file->handle.curl);
+    curl_easy_setopt(file->handle.curl, CURLOPT_BUFFERSIZE, (long) HTTP_RECV_SIZE);
+#if CURL_AT_LEAST_VERSION(7, 47, 0)
+    /* Negotiate HTTP/2 over TLS; and rather than open another connection
+     * while one to the server is being set up, wait to see if this request
+     * can be a stream on it. Only over TLS: otherwise curl may wait for a
+     * busy HTTP/1.1 connection, which can be paused until we read from it. */
+    curl_easy_setopt(file->handle.curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+    if (!strncasecmp(rf->url, "https:", 6))
+        curl_easy_setopt(file->handle.curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+    curl_easy_setopt(file->handle.curl, CURLOPT_PRIVATE, file);
+    curl_multi_add_handle(multi_handle, file->handle.curl);
+    file->still_running = 1;
     rf->file = file;
 
     http_load_ranges(rf);
-    curl_multi_perform(rf->multi_handle, &rf->file->still_running);
+    http_multi_kick(rf->multi);
+    http_check_done(multi_handle);
 
     return rf->file;
 }
@@ -281,62 +654,27 @@ int http_fclose(HTTP_FILE *file, CURLM* multi_handle)
  */
 int http_feof(HTTP_FILE *file)
 {
-    if((file->buffer_pos == 0) && (!file->still_running)){
+    if((file->buffer_len == 0) && (!file->still_running)){
         return 1;
     }
     return 0;
 }
 
 
-static int fill_buffer(HTTP_FILE *file, size_t want, CURLM* multi_handle)
+static int fill_buffer(HTTP_FILE *file, size_t want, struct http_multi *multi)
 {
-    fd_set fdread;
-    fd_set fdwrite;
-    fd_set fdexcep;
-    struct timeval timeout;
-    int result = -1;
-
     /* only fill buffer if transfers are still running and
-       the buffer isn't bigger than the wanted size */
-    if((!file->still_running) || (file->buffer_pos > want)){
+       the buffer isn't bigger than the wanted size; and stop early if
+       data is being passed straight to the range fetch's sink instead */
+    if((!file->still_running) || (file->buffer_len >= want)){
         return 0;
     }
 
     /* try to fill the buffer */
     do{
-        int maxfd = -1;
-        long curl_timeo = -1;
-
-        FD_ZERO(&fdread);
-        FD_ZERO(&fdwrite);
-        FD_ZERO(&fdexcep);
-
-        /* one minute timeout, could make this an option? */
-        timeout.tv_sec = 60;
-        timeout.tv_usec = 0;
-
-        curl_multi_timeout(multi_handle, &curl_timeo);
-        if(curl_timeo >= 0){
-            timeout.tv_sec = curl_timeo / 1000;
-            if(timeout.tv_sec > 1){
-                timeout.tv_sec = 1;
-            }else{
-                timeout.tv_usec = (curl_timeo % 1000) * 1000;
-            }
-        }
-        curl_multi_fdset(multi_handle, &fdread, &fdwrite, &fdexcep, &maxfd);
-        result = select(maxfd+1, &fdread, &fdwrite, &fdexcep, &timeout);
-        switch(result){
-            case -1:
-                // select error
-                break;
-
-            case 0:
-            default:
-                curl_multi_perform(multi_handle, &file->still_running);
-                break;
-        }
-    } while(file->still_running && (file->buffer_pos < want));
+        http_multi_wait(multi);
+        http_check_done(multi->handle);
+    } while(file->still_running && (file->buffer_len < want) && !file->streamed);
     return 1;
 }
 
@@ -345,20 +683,20 @@ static int fill_buffer(HTTP_FILE *file, size_t want, CURLM* multi_handle)
  *
  * Removes `want` bytes from the front of the buffer.
  */
-static int use_buffer(HTTP_FILE *file, uint64_t want)
+static int use_buffer(HTTP_FILE *file, size_t want)
 {
-    if(file->buffer_pos <= want){
-        /* trash the buffer */
-        if(file->buffer){
-            free(file->buffer);
-        }
-        file->buffer = NULL;
-        file->buffer_pos = 0;
+    if(file->buffer_len <= want){
+        file->buffer_start = 0;
         file->buffer_len = 0;
     }else{
-        /* move the contents past want down so it's still available */
-        memmove(file->buffer, &file->buffer[want], (file->buffer_pos - want));
-        file->buffer_pos -= want;
+        file->buffer_start = (file->buffer_start + want) & (HTTP_BUFFER_SIZE - 1);
+        file->buffer_len -= want;
+    }
+
+    /* Let a paused transfer carry on once there's plenty of room again */
+    if(file->paused && file->buffer_len <= HTTP_BUFFER_SIZE / 2){
+        file->paused = 0;
+        curl_easy_pause(file->handle.curl, CURLPAUSE_CONT);
     }
     return 0;
 }
@@ -366,31 +704,66 @@ static int use_buffer(HTTP_FILE *file, uint64_t want)
 
 /****************************************************************************
  *
- * Reads bytes from a HTTP_FILE.
+ * Waits for up to `want` bytes to be in the buffer, and returns how many of
+ * them are in one piece at the front of it, at *ptr. They stay there until
+ * the caller uses them with use_buffer.
  */
-size_t http_fread(void *ptr, size_t size, size_t nmemb, HTTP_FILE *file, struct range_fetch *rf)
+static size_t http_fpeek(const char **ptr, size_t want, HTTP_FILE *file, struct range_fetch *rf)
 {
-    size_t want;
-    want = nmemb * size;
-    fill_buffer(file, want, rf->multi_handle);
+    size_t contiguous;
 
-    if(!file->buffer_pos){
-        /* nothing read, nothing in buffer */
-        return 0;
+    if(want > HTTP_BUFFER_MAX_READ){
+        want = HTTP_BUFFER_MAX_READ;
     }
+    /* If range data can go straight to a sink, just empty the buffer, so that
+     * the data after it can; don't wait for more to collect here */
+    fill_buffer(file, rf->sink && rf->in_body ? 1 : want, rf->multi);
 
-    // only consider available data
-    if(file->buffer_pos < want){
-        want = file->buffer_pos;
+    // only consider available data, up to the end of the buffer
+    if(file->buffer_len < want){
+        want = file->buffer_len;
+    }
+    contiguous = HTTP_BUFFER_SIZE - file->buffer_start;
+    if(contiguous < want){
+        want = contiguous;
     }
 
-    memcpy(ptr, file->buffer, want);
-    use_buffer(file, want);
-
-    want = want / size; // number of items
+    *ptr = &file->buffer[file->buffer_start];
     return want;
 }
 
+
+/****************************************************************************
+ *
+ * Reads bytes from a HTTP_FILE.
+ */
+size_t http_fread(void *ptr, size_t size, size_t nmemb, HTTP_FILE *file, struct range_fetch *rf)
+{
+    size_t want = nmemb * size;
+    size_t got = 0;
+
+    /* The data may wrap around the end of the buffer, so take it in pieces */
+    while(got < want){
+        const char *data;
+        size_t n = http_fpeek(&data, want - got, file, rf);
+
+        if(!n){
+            /* nothing read, nothing in buffer */
+            break;
+        }
+        memcpy((char *)ptr + got, data, n);
+        use_buffer(file, n);
+        got += n;
+
+        /* Don't wait for more than we'd have waited for in one go */
+        if(!file->buffer_len){
+            break;
+        }
+    }
+
+    return got / size; // number of items
+}
+
 /* range_fetch methods */
 
 static int range_fetch_set_url(struct range_fetch* rf, const char* orig_url) {
@@ -405,43 +778,50 @@ char *rfgets(char *ptr, size_t size, struct range_fetch *rf)
     size_t want = size - 1;/* always need to leave room for zero termination */
     size_t loop;
     HTTP_FILE *file = rf->file;
-    fill_buffer(file, want, rf->multi_handle);
+    fill_buffer(file, want, rf->multi);
 
     /* check if theres data in the buffer - if not fill either errored or
      * EOF */
 
-    if(!file->buffer_pos){
+    if(!file->buffer_len){
         return NULL;
     }
 
     /* ensure only available data is considered */
-    if(file->buffer_pos < want)
-        want = file->buffer_pos;
+    if(file->buffer_len < want)
+        want = file->buffer_len;
 
     /*buffer contains data */
-    /* look for newline or eof */
+    /* xfer data to caller up to newline or eof */
     for(loop=0;loop < want;loop++) {
-        if(file->buffer[loop] == '\n') {
-            want=loop+1;/* include newline */
+        char c = file->buffer[(file->buffer_start + loop) & (HTTP_BUFFER_SIZE - 1)];
+
+        ptr[loop] = c;
+        if(c == '\n') {
+            loop++;/* include newline */
             break;
         }
     }
+    ptr[loop]=0;/* allways null terminate */
 
-    /* xfer data to caller */
-    memcpy(ptr, file->buffer, want);
-    ptr[want]=0;/* allways null terminate */
-
-    use_buffer(file,want);
+    use_buffer(file,loop);
 
     return ptr;
 }
 
 
 
-/* range_fetch_start(origin_url)
- * Returns a new range fetch object, for the given URL.
+/* range_fetch_start_shared(origin_url, share)
+ * Returns a new range fetch object, for the given URL, which makes its
+ * requests through the same curl multi handle (and so the same connection
+ * cache) as share, if that is not NULL. Requests for several range fetches
+ * sharing a multi handle are carried out concurrently, each on its own
+ * connection: while one is read from, the others carry on downloading. The
+ * URL may differ from share's, e.g. for another mirror; what is learned about
+ * a server is shared by the range fetches with the same URL.
  */
-struct range_fetch *range_fetch_start(const char *orig_url) {
+struct range_fetch *range_fetch_start_shared(const char *orig_url,
+                                             struct range_fetch *share) {
     struct range_fetch *rf = malloc(sizeof(struct range_fetch));
     if (!rf)
         return NULL;
@@ -454,6 +834,26 @@ struct range_fetch *range_fetch_start(const char *orig_url) {
         return NULL;
     }
 
+    if (share) {
+        rf->multi = share->multi;
+    } else {
+        rf->multi = http_multi_new();
+        if (!rf->multi) {
+            free(rf->url);
+            free(rf);
+            return NULL;
+        }
+    }
+    rf->server = http_multi_server(rf->multi, rf->url);
+    if (!rf->server) {
+        if (!share)
+            http_multi_free(rf->multi);
+        free(rf->url);
+        free(rf);
+        return NULL;
+    }
+    rf->multi->refs++;
+
     /* Initialise other state fields */
     rf->block_left = 0;
     rf->bytes_down = 0;
@@ -461,11 +861,27 @@ struct range_fetch *range_fetch_start(const char *orig_url) {
     rf->file = NULL;                        /* http file not open */
     rf->ranges_todo = NULL;             /* And no ranges given yet */
     rf->nranges = rf->rangesdone = 0;
-    rf->multi_handle = NULL;
+    rf->request_pending = 0;
+    rf->request_ranges = 0;
+    rf->held = 0;
+    rf->sink = NULL;
+    rf->sink_context = NULL;
+    rf->in_body = 0;
+    rf->timed_requests = 0;
+    rf->latency = 0;
+    rf->timed_bytes = 0;
+    rf->transfer_time = 0;
 
     return rf;
 }
 
+/* range_fetch_start(origin_url)
+ * Returns a new range fetch object, for the given URL.
+ */
+struct range_fetch *range_fetch_start(const char *orig_url) {
+    return range_fetch_start_shared(orig_url, NULL);
+}
+
 
 
 
@@ -497,6 +913,45 @@ void range_fetch_addranges(struct range_fetch *rf, off_t * ranges, int nranges)
 }
 
 
+/* range_fetch_release(self)
+ * Lets go of the data last passed to the caller of get_range_data. */
+static void range_fetch_release(struct range_fetch *rf) {
+    if (rf->held) {
+        use_buffer(rf->file, rf->held);
+        rf->held = 0;
+    }
+}
+
+/* range_fetch_set_sink(self, sink, context)
+ * Has the data of the ranges we fetch passed to sink(context, data, offset,
+ * len) as it arrives, where possible, rather than buffered until it is read
+ * with get_range_block or get_range_data. Whatever the sink doesn't get still
+ * has to be read that way, and always comes after what the sink got for the
+ * same block; so the caller must keep reading until EOF as usual, waiting
+ * with range_fetch_wait whenever that returns RANGE_FETCH_AGAIN. If the sink
+ * returns non-zero, the transfer is aborted. */
+void range_fetch_set_sink(struct range_fetch *rf, range_fetch_sink sink,
+                          void *context) {
+    rf->sink = sink;
+    rf->sink_context = context;
+}
+
+/* range_fetch_begin(self)
+ * Sends the request for the next ranges queued with range_fetch_addranges,
+ * if we're not still reading a response or waiting for one, without waiting
+ * for any reply; get_range_block then picks up the response. Lets the caller
+ * have requests for several range fetches in flight at once. */
+void range_fetch_begin(struct range_fetch *rf) {
+    if (rf->block_left || rf->boundary || rf->request_pending
+        || rf->rangesdone == rf->nranges)
+        return;
+
+    rf->held = 0;
+    http_fetch_ranges(rf);
+    rf->request_pending = 1;
+}
+
+
 /* buflwr(str) - in-place convert this string to lower case */
 static void buflwr(char *s) {
     char c;
@@ -510,7 +965,9 @@ static void buflwr(char *s) {
 /* range_fetch_read_http_headers - read a set of HTTP headers, updating state
  * appropriately.
  * Returns: EOF returns 0, good returns 206 (reading a range block) or 30x
- *  (redirect), error returns <0 */
+ *  (redirect), error returns <0, and 1 if the request should be sent again
+ *  (the server turned down several ranges at once; the ranges are now asked
+ *  for one at a time) */
 int range_fetch_read_http_headers(struct range_fetch *rf) {
     char buf[512];
     int status;
@@ -531,6 +988,28 @@ int range_fetch_read_http_headers(struct range_fetch *rf) {
             return -1;
         }
         status = atoi(p + 1);
+
+#if CURL_AT_LEAST_VERSION(7, 50, 0)
+        {
+            long version = 0;
+
+            curl_easy_getinfo(rf->file->handle.curl, CURLINFO_HTTP_VERSION, &version);
+            if (version == CURL_HTTP_VERSION_2_0)
+                rf->server->multiplexed = 1;
+        }
+#endif
+        if (status != 206 && status != 301 && status != 302
+            && rf->request_ranges > 1 && rf->server->multirange != 1
+            && (status == 200 || status >= 400) && status != 404) {
+            /* Not a server that does several ranges per request, or not this
+             * many; go back to asking for them one by one */
+            log_message("server refused %d ranges in one request (status %d), "
+                        "requesting one range at a time", rf->request_ranges,
+                        status);
+            rf->server->multirange = 0;
+            rf->rangessent = rf->rangesdone;
+            return 1;
+        }
         if (status != 206 && status != 301 && status != 302) {
             if (status >= 300 && status < 400) {
                 log_message(
@@ -597,6 +1076,13 @@ int range_fetch_read_http_headers(struct range_fetch *rf) {
             /* Can only have got one range. */
             rf->rangesdone++;
             rf->rangessent = rf->rangesdone;
+
+            /* and if we asked for more, the rest must be asked for again */
+            if (rf->request_ranges > 1 && rf->server->multirange != 1) {
+                log_message("server returned one of %d ranges requested, "
+                            "requesting one range at a time", rf->request_ranges);
+                rf->server->multirange = 0;
+            }
         }
 
         /* If we're about to get a MIME multipart block set */
@@ -609,6 +1095,9 @@ int range_fetch_read_http_headers(struct range_fetch *rf) {
                 break;
             q += 9;
 
+            if (rf->request_ranges > 1)
+                rf->server->multirange = 1;
+
             /* Gah, we could really use a regexp here. Could be quoted... */
             if (*q == '"') {
                 rf->boundary = strdup(q + 1);
@@ -648,19 +1137,31 @@ int range_fetch_read_http_headers(struct range_fetch *rf) {
  * parameter.
  *
  * Like read(2), it returns the total bytes read, 0 for EOF, -1 for error.
+ * With a sink set, there is no point in waiting for the data of a block to
+ * come in: it goes to the sink. So if there is nothing to read, it returns
+ * RANGE_FETCH_AGAIN instead, and the caller can wait with range_fetch_wait
+ * (much like EAGAIN from a non-blocking read(2)).
  *
  * The blocks that it returns are the ones previously registered by calls to
  * range_fetch_addranges (although it doesn't guarantee that only those block
  * are returned - that's just what it asks the remote for, but if the remote
  * returns more then it'll pass more to the caller - which doesn't matter).
+ *
+ * This does the work for both get_range_block and get_range_data: data is
+ * copied to buf if that is given, or else *ptr is pointed at it.
  */
-int get_range_block(struct range_fetch *rf, off_t * offset, unsigned char *data,
-                    size_t dlen) {
+static int range_fetch_get(struct range_fetch *rf, off_t * offset,
+                           unsigned char *data, const unsigned char **ptr,
+                           size_t dlen) {
     size_t bytes_to_caller = 0;
     size_t bytes_to_request = 0;
 
+    range_fetch_release(rf);
+
+    next_block:
     /* If we're not in the middle of reading a block of actual data */
     if (!rf->block_left) {
+        rf->in_body = 0;
 
         check_boundary:
         /* And if not reading a MIME multipart boundary */
@@ -672,11 +1173,17 @@ int get_range_block(struct range_fetch *rf, off_t * offset, unsigned char *data,
             /* Then we're reading the start of a new set of HTTP headers
              * (possibly after connecting and sending a request first. */
             int header_result;
-            http_fetch_ranges(rf);
+            if (!rf->request_pending)
+                http_fetch_ranges(rf);
+            rf->request_pending = 0;
 
             /* read the response headers */
             header_result = range_fetch_read_http_headers(rf);
 
+            /* Try again if the server wants fewer ranges per request */
+            if (header_result == 1)
+                goto check_boundary;
+
             /* EOF on first connect is fatal */
             if (header_result == 0) {
                 log_message("EOF from %s", rf->url);
@@ -714,6 +1221,9 @@ int get_range_block(struct range_fetch *rf, off_t * offset, unsigned char *data,
             if (buf[2 + strlen(rf->boundary)] == '-') {
                 free(rf->boundary);
                 rf->boundary = NULL;
+                /* The response is complete, even if the server merged some of
+                 * the ranges we asked for into one part */
+                rf->rangesdone = rf->rangessent;
                 goto check_boundary;
             }
 
@@ -753,6 +1263,14 @@ int get_range_block(struct range_fetch *rf, off_t * offset, unsigned char *data,
     /* Now the easy bit - we are reading a block of actual data */
     if (!rf->block_left)
         return 0;   /* pass EOF back to caller */
+    rf->in_body = 1;
+    rf->file->streamed = 0;
+
+    /* With a sink, what arrives for the block goes to it; don't wait for that
+     * here, as the caller may have other range fetches to serve meanwhile */
+    if (rf->sink && !rf->file->buffer_len && rf->file->still_running)
+        return RANGE_FETCH_AGAIN;
+
     *offset = rf->offset;   /* caller wants to know what this data is */
 
     /* don't request more than we want or have */
@@ -762,7 +1280,15 @@ int get_range_block(struct range_fetch *rf, off_t * offset, unsigned char *data,
         bytes_to_request = dlen;
     }
 
-    bytes_to_caller = http_fread(data, 1, bytes_to_request, rf->file, rf);
+    if (data) {
+        bytes_to_caller = http_fread(data, 1, bytes_to_request, rf->file, rf);
+    } else {
+        /* The caller gets the data where it is; we'll take it out of the
+         * buffer when we're next called */
+        bytes_to_caller = http_fpeek((const char **)ptr, bytes_to_request,
+                                     rf->file, rf);
+        rf->held = bytes_to_caller;
+    }
 
     /* update internal stats of how many blocks are left,
        file offset, and bytes downloaded. */
@@ -770,9 +1296,84 @@ int get_range_block(struct range_fetch *rf, off_t * offset, unsigned char *data,
     rf->offset += bytes_to_caller;
     rf->bytes_down += bytes_to_caller;
 
+    /* If nothing came to us because it went to the sink instead, carry on
+     * with whatever is next */
+    if (!bytes_to_caller && rf->file->streamed)
+        goto next_block;
+
     return bytes_to_caller;
 }
 
+/* get_range_block(self, &offset, buf[], buflen)
+ * See range_fetch_get above. */
+int get_range_block(struct range_fetch *rf, off_t * offset, unsigned char *data,
+                    size_t dlen) {
+    return range_fetch_get(rf, offset, data, NULL, dlen);
+}
+
+/* get_range_data(self, &offset, &ptr, maxlen)
+ * As get_range_block, but rather than copying the data to a buffer of the
+ * caller's, points *ptr at it where we've received it. It stays there, and
+ * valid, until the next call for this range fetch. */
+int get_range_data(struct range_fetch *rf, off_t * offset,
+                   const unsigned char **ptr, size_t maxlen) {
+    return range_fetch_get(rf, offset, NULL, ptr, maxlen);
+}
+
+/* range_fetch_ready(self)
+ * Returns non-zero if the response to the request in progress has come in
+ * completely, or there is data received for it waiting to be read; that is,
+ * reading from this range fetch now doesn't mean waiting for the server,
+ * which may be busy with other range fetches' requests. */
+int range_fetch_ready(const struct range_fetch *rf) {
+    return !rf->file || !rf->file->still_running || rf->file->buffer_len > 0;
+}
+
+/* range_fetch_wait(self)
+ * Waits until there is progress on any of the transfers of the range fetches
+ * sharing this one's multi handle, passing data to their sinks as it comes
+ * in. */
+void range_fetch_wait(struct range_fetch *rf) {
+    http_multi_wait(rf->multi);
+    http_check_done(rf->multi->handle);
+}
+
+/* range_fetch_multirange(self)
+ * Returns 1 if the server has answered a request for several ranges at once
+ * properly, 0 if it has failed to (and so we request one range at a time), or
+ * -1 if we don't know yet. */
+int range_fetch_multirange(const struct range_fetch *rf) {
+    return rf->server->multirange;
+}
+
+/* range_fetch_multiplexed(self)
+ * Returns non-zero if the server has answered over HTTP/2, so that more range
+ * fetches for the same URL sharing this one's multi handle will be more
+ * streams on the same connection, rather than more connections. */
+int range_fetch_multiplexed(const struct range_fetch *rf) {
+    return rf->server->multiplexed;
+}
+
+/* range_fetch_timing(self, &latency, &bytes, &transfer_time)
+ * Returns the number of requests that have completed since the last call,
+ * and, summed over them, the time from sending each request until the first
+ * byte of the response came back, the number of bytes in the response bodies
+ * and the time it took to receive them (in seconds). */
+int range_fetch_timing(struct range_fetch *rf, double *latency, off_t *bytes,
+                       double *transfer_time) {
+    int n = rf->timed_requests;
+
+    *latency = rf->latency;
+    *bytes = rf->timed_bytes;
+    *transfer_time = rf->transfer_time;
+
+    rf->timed_requests = 0;
+    rf->latency = 0;
+    rf->timed_bytes = 0;
+    rf->transfer_time = 0;
+    return n;
+}
+
 /* range_fetch_bytes_down
  * Simple getter method, returns the total bytes retrieved */
 off_t range_fetch_bytes_down(const struct range_fetch * rf) {
@@ -783,7 +1384,9 @@ off_t range_fetch_bytes_down(const struct range_fetch * rf) {
 void range_fetch_end(struct range_fetch *rf) {
     /* this will clean up the file, buffer, and close the connection */
     if (rf->file != NULL)
-        http_fclose(rf->file, rf->multi_handle);
+        http_fclose(rf->file, rf->multi->handle);
+    if (--rf->multi->refs == 0)
+        http_multi_free(rf->multi);
 
     free(rf->ranges_todo);
     free(rf->boundary);
@@ -18,9 +18,23 @@
 
 struct range_fetch;
 
+/* returned by get_range_block and get_range_data when a sink is set and there's nothing to read yet */
+#define RANGE_FETCH_AGAIN (-2)
+
+typedef int (*range_fetch_sink)(void* context, const unsigned char* data, off_t offset, size_t len);
+
 struct range_fetch* range_fetch_start(const char* orig_url);
+struct range_fetch* range_fetch_start_shared(const char* orig_url, struct range_fetch* share);
 void range_fetch_addranges(struct range_fetch* rf, off_t* ranges, int nranges);
+void range_fetch_begin(struct range_fetch* rf);
+void range_fetch_set_sink(struct range_fetch* rf, range_fetch_sink sink, void* context);
 int get_range_block(struct range_fetch* rf, off_t* offset, unsigned char* data, size_t dlen);
+int get_range_data(struct range_fetch* rf, off_t* offset, const unsigned char** data, size_t maxlen);
+int range_fetch_ready(const struct range_fetch* rf);
+void range_fetch_wait(struct range_fetch* rf);
+int range_fetch_multirange(const struct range_fetch* rf);
+int range_fetch_multiplexed(const struct range_fetch* rf);
+int range_fetch_timing(struct range_fetch* rf, double* latency, off_t* bytes, double* transfer_time);
 off_t range_fetch_bytes_down(const struct range_fetch* rf);
 void range_fetch_end(struct range_fetch* rf);
 const char* ca_bundle_path();
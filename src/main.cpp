@@ -52,6 +52,26 @@ int main(const int argc, const char** argv) {
         {'u', "url"}
     );
 
+    args::ValueFlag<unsigned int> parallelConnections(parser, "number",
+        "Number of connections to download ranges over concurrently (default: 1).",
+        {'n', "connections"}
+    );
+
+    args::ValueFlag<unsigned int> http2Streams(parser, "number",
+        "Number of concurrent requests to make over one connection if the server supports HTTP/2 (default: 16).",
+        {"http2-streams"}
+    );
+
+    args::Flag noAdaptiveRanges(parser, "",
+        "Download only the ranges needed, instead of merging nearby ones where that is estimated to be faster.",
+        {"no-merge-ranges"}
+    );
+
+    args::Flag multiRange(parser, "",
+        "Request several ranges at once if the server supports it.",
+        {"multi-range"}
+    );
+
     args::Flag forceUpdate(parser, "", "Skip update check and force update", {"force-update"});
 
     args::Flag quietMode(parser, "", "Quiet mode", {'s', 'q', "silent-mode"});
@@ -128,6 +148,18 @@ int main(const int argc, const char** argv) {
     if (saveZSyncFilePath)
         client.storeZSyncFileInPath(saveZSyncFilePath.Get());
 
+    if (parallelConnections)
+        client.setMaxParallelConnections(parallelConnections.Get());
+
+    if (http2Streams)
+        client.setMaxHttp2Streams(http2Streams.Get());
+
+    if (noAdaptiveRanges)
+        client.setAdaptiveRangesOptimization(false);
+
+    if (multiRange)
+        client.setMultipleRangesPerRequest(true);
+
     if (checkForChanges || !forceUpdate) {
         cout << "Checking for changes..." << endl;
 
@@ -37,6 +37,12 @@ int main(int argc, char** argv) {
         "",
         {'c', "custom-header"}
     );
+    args::Flag lookInsideGZip(parser, "",
+        "Treat the file as gzip compressed. The .zsync file then describes the uncompressed contents, and includes a "
+        "map of the compressed data so that zsync2 can download just the parts of the compressed file it needs. The "
+        "URL given with -u must point to the compressed file.",
+        {"look-inside-gzip"}
+    );
     args::Flag showVersion(parser, "", "Print version and exit", {'V', "version"});
 
     args::Positional<string> fileName(parser, "filename",
@@ -85,6 +91,9 @@ int main(int argc, char** argv) {
     if (blockSize)
         maker.setBlockSize(blockSize.Get());
 
+    if (lookInsideGZip)
+        maker.setLookInsideGZip(true);
+
     if (customHeaderFields) {
         for (std::string& field : customHeaderFields.Get()) {
             // verify syntax "key=value..."
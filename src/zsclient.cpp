@@ -3,11 +3,15 @@
 
 // system includes
 #include <algorithm>
+#include <chrono>
 #include <deque>
 #include <fcntl.h>
+#include <functional>
 #include <iostream>
 #include <set>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <thread>
 #include <utility>
 #include <utime.h>
 
@@ -23,6 +27,7 @@ extern "C" {
 // local includes
 #include "zsclient.h"
 #include "zshash.h"
+#include "zsrangeplanner.h"
 #include "zsutil.h"
 
 extern "C" {
@@ -46,6 +51,10 @@ namespace zsync2 {
         std::string pathToStoreZSyncFileInLocally;
         bool zSyncFileStoredLocallyAlready;
 
+        // record of the blocks in the .part file, to resume from it without scanning it if the download is interrupted
+        std::string pathToStateFile;
+        std::chrono::steady_clock::time_point lastStateSave;
+
         struct zsync_state* zsHandle;
 
         std::string referer;
@@ -62,6 +71,14 @@ namespace zsync2 {
 
         unsigned long rangesOptimizationThreshold;
 
+        bool adaptiveRangesOptimization;
+
+        unsigned int maxParallelConnections;
+
+        unsigned int maxHttp2Streams;
+
+        bool multipleRangesPerRequest;
+
         // status message variables
 #ifndef ZSYNC_STANDALONE
         std::deque<std::string> statusMessages;
@@ -74,7 +91,10 @@ namespace zsync2 {
             const bool overwrite
         ) : pathOrUrlToZSyncFile(std::move(pathOrUrlToZSyncFile)), zsHandle(nullptr), state(INITIALIZED),
                                  localUsed(0), httpDown(0), remoteFileSizeCache(-1),
-                                 zSyncFileStoredLocallyAlready(false), rangesOptimizationThreshold(0) {
+                                 zSyncFileStoredLocallyAlready(false), rangesOptimizationThreshold(0),
+                                 adaptiveRangesOptimization(true),
+                                 maxParallelConnections(1), maxHttp2Streams(16),
+                                 multipleRangesPerRequest(false) {
             // if the local file should be overwritten, we'll instruct
             if (overwrite) {
                 this->pathToLocalFile = pathToLocalFile;
@@ -140,127 +160,350 @@ namespace zsync2 {
             return true;
         }
 
-        struct zsync_state* readZSyncFile(bool headersOnly = false) {
-            struct zsync_state *zs;
-            std::FILE* f;
+        // splits the value of a Digest header (RFC 3230, extended by RFC 5843) into the algorithms, in lower case, and
+        // the hex digests of the data it was sent with
+        // false if a part of it isn't a key/value pair
+        static bool parseInstanceDigests(const std::string& digestHeader,
+                                  std::vector<std::pair<std::string, std::string>>& digests) {
+            // split by comma to support multiple digests as per RFC 3230
+            for (auto part : split(digestHeader, ',')) {
+                trim(part);
 
-            // buffer storing the data
-            std::vector<char> buffer;
+                // now split key and value; the base64 encoded value may end in = itself
+                const auto equals = part.find('=');
 
-            if (isfile(pathOrUrlToZSyncFile)) {
-                f = std::fopen(pathOrUrlToZSyncFile.c_str(), "r");
-            } else {
-                if (!isUrlAbsolute(pathOrUrlToZSyncFile)) {
-                    issueStatusMessage("No such file or directory and not a URL: " + pathOrUrlToZSyncFile);
-                    return nullptr;
+                if (equals == std::string::npos || equals == 0)
+                    return false;
+
+                auto rawDigest = base64Decode(part.substr(equals + 1));
+                digests.emplace_back(toLower(part.substr(0, equals)),
+                                     bytesToHex((unsigned char*) rawDigest.data(), (int) rawDigest.size()));
+            }
+
+            return true;
+        }
+
+        // checks each of the digests from a Digest header against the data they were sent with; all of those which are
+        // supported must match
+        // calculateDigest returns the hex digest of that data using the given algorithm
+        bool checkInstanceDigest(const std::vector<std::pair<std::string, std::string>>& digests,
+                                 const std::function<std::string(gcry_md_algos)>& calculateDigest,
+                                 bool& digestFound) {
+            digestFound = false;
+
+            for (const auto& keyval : digests) {
+                const auto& algorithm = keyval.first;
+                const auto& digest = keyval.second;
+
+                gcry_md_algos digestAlgorithm;
+                std::string name;
+
+                if (algorithm == "md5") {
+                    digestAlgorithm = GCRY_MD_MD5;
+                    name = "MD5";
+                } else if (algorithm == "sha") {
+                    digestAlgorithm = GCRY_MD_SHA1;
+                    name = "SHA1";
+                } else if (algorithm == "sha-256") {
+                    digestAlgorithm = GCRY_MD_SHA256;
+                    name = "SHA256";
+                } else if (algorithm == "sha-512") {
+                    issueStatusMessage("Found SHA512 digest: " + digest);
+                    issueStatusMessage("SHA512 instance digests are not supported at the moment");
+                    continue;
+                } else {
+                    issueStatusMessage("Invalid instance digest type: " + algorithm);
+                    return false;
                 }
 
-                auto checkResponseForError = [this](cpr::Response response, unsigned int statusCode) {
-                    if (response.status_code != statusCode) {
-                        issueStatusMessage("Bad status code " + std::to_string(response.status_code) +
-                                           " while trying to download .zsync file!");
-                        return false;
+                digestFound = true;
+                issueStatusMessage("Found " + name + " digest: " + digest);
+
+                if (digest == calculateDigest(digestAlgorithm)) {
+                    issueStatusMessage("Verified instance digest of redirected .zsync response");
+                } else {
+                    issueStatusMessage("Failed to verify digest of redirected .zsync response, aborting update");
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // download the .zsync file and parse it as the data comes in, rather than once all of it is there, so that
+        // loading the block checksums of a large file overlaps with downloading them, and the file is never held in
+        // memory as a whole
+        // the data is passed from a thread running the transfer to zsync_begin() through a socket pair, which, unlike
+        // a pipe, lets the transfer fail rather than raise SIGPIPE if the parser stops reading early
+        struct zsync_state* streamZSyncFile(bool headersOnly) {
+            struct Transfer {
+                CURL* curl;
+                int fd;
+
+                // responses whose headers have come in so far; the first is the one before any redirects, which
+                // carries the instance digest of the data at the end of the redirects
+                int responses = 0;
+                std::string digestHeader;
+                bool digestHeaderValid = true;
+                long statusCode = 0;
+
+                std::unique_ptr<std::ofstream> copy;
+
+                // the instance digests from that header, and the digests of the data received, calculated as it
+                // comes in with just the algorithms those use
+                std::vector<std::pair<std::string, std::string>> digests;
+                std::unique_ptr<ZSyncHash<GCRY_MD_MD5>> md5;
+                std::unique_ptr<ZSyncHash<GCRY_MD_SHA1>> sha1;
+                std::unique_ptr<ZSyncHash<GCRY_MD_SHA256>> sha256;
+            } transfer;
+
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+                issueStatusMessage("socketpair() call failed!");
+                return nullptr;
+            }
+
+            transfer.fd = fds[1];
+            transfer.curl = curl_easy_init();
+            if (transfer.curl == nullptr) {
+                close(fds[0]);
+                close(fds[1]);
+                return nullptr;
+            }
+
+            // store copy of .zsync file locally, if specified, while downloading it
+            // it's written next to the destination first, and only moved there once it has been verified
+            const auto pathToPartialCopy = pathToStoreZSyncFileInLocally + ".part";
+            if (!pathToStoreZSyncFileInLocally.empty() && !zSyncFileStoredLocallyAlready) {
+                transfer.copy.reset(new std::ofstream(pathToPartialCopy));
+                auto error = errno;
+
+                if (!*transfer.copy) {
+                    issueStatusMessage(
+                        "Warning: could not store copy of .zsync file in path: " +
+                        std::string(strerror(error))
+                    );
+                    transfer.copy.reset();
+                }
+            }
+
+            curl_write_callback onHeader = [](char* data, size_t size, size_t nitems, void* userdata) -> size_t {
+                auto* t = static_cast<Transfer*>(userdata);
+                std::string line(data, size * nitems);
+
+                if (line.compare(0, 5, "HTTP/") == 0) {
+                    t->responses++;
+                } else if (t->responses == 1 && t->digestHeader.empty()
+                           && toLower(line.substr(0, 7)) == "digest:") {
+                    t->digestHeader = line.substr(7);
+                    trim(t->digestHeader);
+                    rtrim(t->digestHeader, '\n');
+                    rtrim(t->digestHeader, '\r');
+
+                    // parsed right away, to know which digests to calculate while the data comes in
+                    t->digestHeaderValid = parseInstanceDigests(t->digestHeader, t->digests);
+                }
+
+                return size * nitems;
+            };
+
+            curl_write_callback onData = [](char* data, size_t size, size_t nitems, void* userdata) -> size_t {
+                auto* t = static_cast<Transfer*>(userdata);
+                const auto len = size * nitems;
+
+                // anything but the .zsync file itself is of no use to the parser
+                if (t->statusCode == 0) {
+                    curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &t->statusCode);
+
+                    if (t->statusCode != 200)
+                        return 0;
+
+                    for (const auto& digest : t->digests) {
+                        if (digest.first == "md5" && t->md5 == nullptr)
+                            t->md5.reset(new ZSyncHash<GCRY_MD_MD5>());
+                        else if (digest.first == "sha" && t->sha1 == nullptr)
+                            t->sha1.reset(new ZSyncHash<GCRY_MD_SHA1>());
+                        else if (digest.first == "sha-256" && t->sha256 == nullptr)
+                            t->sha256.reset(new ZSyncHash<GCRY_MD_SHA256>());
                     }
-                    return true;
-                };
+                }
 
-                // implements RFC 3230 (extended by RFC 5843)
-                auto verifyInstanceDigest = [this](const cpr::Response verificationResponse, const cpr::Response response, bool& digestFound) {
-                    digestFound = false;
+                if (t->md5 != nullptr)
+                    t->md5->add(data, len);
+                if (t->sha1 != nullptr)
+                    t->sha1->add(data, len);
+                if (t->sha256 != nullptr)
+                    t->sha256->add(data, len);
 
-                    if (response.status_code != 200) {
-                        if (verificationResponse.status_code == 206) {
-                            issueStatusMessage("Skipping instance digest verification of partial response");
-                            return true;
-                        }
+                if (t->copy != nullptr)
+                    t->copy->write(data, len);
 
-                        return false;
+                for (size_t sent = 0; sent < len;) {
+                    auto rv = send(t->fd, data + sent, len - sent, MSG_NOSIGNAL);
+
+                    if (rv < 0) {
+                        if (errno == EINTR)
+                            continue;
+                        return 0;
                     }
 
-                    for (const auto& header : verificationResponse.header) {
-                        if (toLower(header.first) == "digest") {
+                    sent += rv;
+                }
 
+                return len;
+            };
 
-                            // split by comma to support multiple digests as per RFC 3230
-                            for (auto part : split(header.second, ',')) {
-                                trim(part);
+            curl_easy_setopt(transfer.curl, CURLOPT_URL, pathOrUrlToZSyncFile.c_str());
+            curl_easy_setopt(transfer.curl, CURLOPT_FOLLOWLOCATION, 1L);
+            curl_easy_setopt(transfer.curl, CURLOPT_MAXREDIRS, 50L);
+            curl_easy_setopt(transfer.curl, CURLOPT_HEADERFUNCTION, onHeader);
+            curl_easy_setopt(transfer.curl, CURLOPT_HEADERDATA, &transfer);
+            curl_easy_setopt(transfer.curl, CURLOPT_WRITEFUNCTION, onData);
+            curl_easy_setopt(transfer.curl, CURLOPT_WRITEDATA, &transfer);
+
+            // request so-called Instance Digest (RFC 3230, RFC 5843)
+            struct curl_slist* headers = curl_slist_append(nullptr,
+                "Want-Digest: sha-512;q=1, sha-256;q=0.9, sha;q=0.2, md5;q=0.1");
+            curl_easy_setopt(transfer.curl, CURLOPT_HTTPHEADER, headers);
+
+            // cURL hardcodes the current distro's CA bundle path at build time
+            // in order to use libzsync2 on other distributions (e.g., when used in an AppImage), the right path
+            // to the system CA bundle must be passed to cURL
+            {
+                const auto* caBundlePath = ca_bundle_path();
 
-                                // now split key and value
-                                const auto keyval = split(header.second, '=');
+                if (caBundlePath != nullptr) {
+                    issueStatusMessage("Using CA bundle found on system: " + std::string(caBundlePath));
+                    curl_easy_setopt(transfer.curl, CURLOPT_CAINFO, caBundlePath);
+                }
+            }
 
-                                if (keyval.size() != 2) {
-                                    issueStatusMessage("Failed to parse key/value pair: " + part);
-                                    return false;
-                                }
+            CURLcode result = CURLE_OK;
+            std::thread downloader([&transfer, &result]() {
+                result = curl_easy_perform(transfer.curl);
 
-                                const auto& algorithm = keyval[0];
-                                const auto& value = keyval[1];
+                // let the parser know that's all the data there is
+                close(transfer.fd);
+            });
 
-                                auto rawDigest = base64Decode(value);
-                                auto digest = bytesToHex((unsigned char*) rawDigest.data(), (int) rawDigest.size());
+            struct zsync_state* zs = nullptr;
+            auto* f = fdopen(fds[0], "r");
+            char first;
 
-                                if (toLower(algorithm) == "md5") {
-                                    digestFound = true;
+            if (f == nullptr) {
+                close(fds[0]);
+            } else if (recv(fds[0], &first, 1, MSG_PEEK) <= 0) {
+                // nothing came which could be parsed, the reason is reported below
+                fclose(f);
+            } else {
+                zs = zsync_begin(f, (headersOnly ? 1 : 0), (cwd.empty() ? nullptr : cwd.c_str()));
 
-                                    ZSyncHash<GCRY_MD_MD5> md5(response.text);
-                                    auto calculatedDigest = md5.getHash();
+                // the rest of the data is needed to check the instance digest and to store the copy, if any
+                if (zs != nullptr) {
+                    std::vector<char> rest(4096);
+                    while (fread(rest.data(), 1, rest.size(), f) > 0);
+                }
 
-                                    issueStatusMessage("Found MD5 digest: " + digest);
+                fclose(f);
+            }
 
-                                    if (digest == calculatedDigest) {
-                                        issueStatusMessage("Verified instance digest of redirected .zsync response");
-                                    } else {
-                                        issueStatusMessage("Failed to verify digest of redirected .zsync response, aborting update");
-                                        return false;
-                                    }
+            downloader.join();
 
-                                } else if (toLower(algorithm) == "sha") {
-                                    digestFound = true;
+            curl_easy_getinfo(transfer.curl, CURLINFO_RESPONSE_CODE, &transfer.statusCode);
+            curl_easy_cleanup(transfer.curl);
+            curl_slist_free_all(headers);
 
-                                    ZSyncHash<GCRY_MD_SHA1> sha1(response.text);
-                                    auto calculatedDigest = sha1.getHash();
+            auto ok = true;
 
-                                    issueStatusMessage("Found SHA1 digest: " + digest);
+            // a write error means the parser stopped reading, which it reports itself
+            if (result != CURLE_OK && result != CURLE_WRITE_ERROR) {
+                issueStatusMessage("Failed to download .zsync file: " + std::string(curl_easy_strerror(result)));
+                ok = false;
+            } else if (transfer.statusCode != 200) {
+                issueStatusMessage("Bad status code " + std::to_string(transfer.statusCode) +
+                                   " while trying to download .zsync file!");
+                ok = false;
+            } else if (zs == nullptr) {
+                issueStatusMessage("Failed to parse .zsync file!");
+                ok = false;
+            } else if (!transfer.digestHeaderValid) {
+                issueStatusMessage("Failed to parse instance digest: " + transfer.digestHeader);
+                ok = false;
+            } else if (!transfer.digestHeader.empty()) {
+                bool digestFound;
+                ok = checkInstanceDigest(transfer.digests, [&transfer](gcry_md_algos algorithm) {
+                    switch (algorithm) {
+                        case GCRY_MD_MD5:
+                            return transfer.md5->getHash();
+                        case GCRY_MD_SHA1:
+                            return transfer.sha1->getHash();
+                        default:
+                            return transfer.sha256->getHash();
+                    }
+                }, digestFound);
+            }
 
-                                    if (digest == calculatedDigest) {
-                                        issueStatusMessage("Verified instance digest of redirected .zsync response");
-                                    } else {
-                                        issueStatusMessage("Failed to verify digest of redirected .zsync response, aborting update");
-                                        return false;
-                                    }
-                                } else if (toLower(algorithm) == "sha-256") {
-                                    digestFound = true;
+            if (transfer.copy != nullptr)
+                transfer.copy->close();
 
-                                    ZSyncHash<GCRY_MD_SHA256> sha256(response.text);
-                                    auto calculatedDigest = sha256.getHash();
+            if (!ok) {
+                if (zs != nullptr) {
+                    auto* tempFile = zsync_end(zs);
+                    unlink(tempFile);
+                    free(tempFile);
+                }
+                if (transfer.copy != nullptr)
+                    unlink(pathToPartialCopy.c_str());
+                return nullptr;
+            }
 
-                                    issueStatusMessage("Found SHA256 digest: " + digest);
+            if (transfer.copy != nullptr) {
+                if (!*transfer.copy || rename(pathToPartialCopy.c_str(), pathToStoreZSyncFileInLocally.c_str()) != 0) {
+                    issueStatusMessage("Warning: could not store copy of .zsync file in path: " +
+                                       std::string(strerror(errno)));
+                    unlink(pathToPartialCopy.c_str());
+                } else {
+                    std::ostringstream oss;
+                    oss << "Storing copy of .zsync file in " << pathToStoreZSyncFileInLocally << ", as requested";
+                    issueStatusMessage(oss.str());
 
-                                    if (digest == calculatedDigest) {
-                                        issueStatusMessage("Verified instance digest of redirected .zsync response");
-                                    } else {
-                                        issueStatusMessage("Failed to verify digest of redirected .zsync response, aborting update");
-                                        return false;
-                                    }
-                                } else if (toLower(algorithm) == "sha-512") {
-                                    digestFound = false;
+                    zSyncFileStoredLocallyAlready = true;
+                }
+            }
 
-                                    issueStatusMessage("Found SHA512 digest: " + digest);
-                                    issueStatusMessage("SHA512 instance digests are not supported at the moment");
-                                } else {
-                                    digestFound = false;
-                                    issueStatusMessage("Invalid instance digest type: " + algorithm);
-                                    return false;
-                                }
-                            }
+            // might have been redirected to another URL
+            // therefore, store final URL of response as referer in case relative URLs will have to be resolved
+            referer = pathOrUrlToZSyncFile;
 
-                            // accept only one Digest header
-                            break;
-                        }
-                    }
+            return zs;
+        }
+
+        struct zsync_state* readZSyncFile(bool headersOnly = false) {
+            struct zsync_state *zs;
+            std::FILE* f;
+
+            // buffer storing the data
+            std::vector<char> buffer;
+
+            if (isfile(pathOrUrlToZSyncFile)) {
+                f = std::fopen(pathOrUrlToZSyncFile.c_str(), "r");
+            } else {
+                if (!isUrlAbsolute(pathOrUrlToZSyncFile)) {
+                    issueStatusMessage("No such file or directory and not a URL: " + pathOrUrlToZSyncFile);
+                    return nullptr;
+                }
 
-                    response.header;
+                // unless only the headers are needed and can be fetched on their own, parse the .zsync file while it
+                // is being downloaded
+                if (!(headersOnly && zSyncFileStoredLocallyAlready))
+                    return streamZSyncFile(headersOnly);
 
+                auto checkResponseForError = [this](cpr::Response response, unsigned int statusCode) {
+                    if (response.status_code != statusCode) {
+                        issueStatusMessage("Bad status code " + std::to_string(response.status_code) +
+                                           " while trying to download .zsync file!");
+                        return false;
+                    }
                     return true;
                 };
 
@@ -288,8 +531,8 @@ namespace zsync2 {
                     }
                 }
 
-                // if interested in headers only, download 1 kiB chunks until end of zsync header is found
-                if (headersOnly && zSyncFileStoredLocallyAlready) {
+                // download 1 kiB chunks until end of zsync header is found
+                {
                     static const auto chunkSize = 1024;
                     unsigned long currentChunk = 0;
 
@@ -322,27 +565,6 @@ namespace zsync2 {
 
                         currentChunk += chunkSize;
                     }
-                } else {
-                    session.SetRedirect(cpr::Redirect{0L});
-                    auto verificationResponse = session.Get();
-
-                    // 50 is the default value according to the docs
-                    session.SetRedirect(cpr::Redirect{50L});
-                    auto response = session.Get();
-
-                    bool digestVerified;
-                    if (!verifyInstanceDigest(verificationResponse, response, digestVerified)) {
-                        issueStatusMessage(verificationResponse.error.message);
-                        return nullptr;
-                    }
-
-                    // expecting a 200 response
-                    if (!checkResponseForError(response, 200)) {
-                      issueStatusMessage("Response:" + response.error.message);
-                      return nullptr;
-                    }
-
-                    std::copy(response.text.begin(), response.text.end(), std::back_inserter(buffer));
                 }
 
                 // might have been redirected to another URL
@@ -510,38 +732,101 @@ namespace zsync2 {
         }
 
         bool readSeedFile(const std::string &pathToSeedFile) {
-            std::FILE* f;
-
             // check whether to decompress this file
             if (zsync_hint_decompress(zsHandle) && pathToSeedFile.length() > 3 && endsWith(pathToSeedFile, ".gz")) {
-                f = openGzFile(pathToSeedFile);
+                std::FILE* f = openGzFile(pathToSeedFile);
 
                 if (!f) {
                     issueStatusMessage("Failed to open gzip compressed file " + pathToSeedFile);
                     return false;
                 }
-            } else {
-                f = fopen(pathToSeedFile.c_str(), "r");
 
-                if (!f) {
-                    issueStatusMessage("Failed to open file " + pathToSeedFile);
+                auto rv = zsync_submit_source_file(zsHandle, f, false);
+
+                if (fclose(f) != 0) {
+                    issueStatusMessage("fclose() on file handle failed!");
                     return false;
                 }
+
+                if (rv < 0) {
+                    issueStatusMessage("Failed to write data from seed file " + pathToSeedFile);
+                    return false;
+                }
+
+                return true;
             }
 
-            zsync_submit_source_file(zsHandle, f, false);
+            // plain files are scanned in place by librcksum, no need to copy them through a FILE*
+            auto fd = open(pathToSeedFile.c_str(), O_RDONLY);
 
-            if (fclose(f) != 0) {
-                issueStatusMessage("fclose() on file handle failed!");
+            if (fd < 0) {
+                issueStatusMessage("Failed to open file " + pathToSeedFile);
+                return false;
+            }
+
+            auto rv = zsync_submit_source_fd(zsHandle, fd, false);
+
+            if (close(fd) != 0) {
+                issueStatusMessage("close() on file descriptor failed!");
+                return false;
+            }
+
+            if (rv < 0) {
+                issueStatusMessage("Failed to write data from seed file " + pathToSeedFile);
+                return false;
+            }
+
+            return true;
+        }
+
+        // write out which blocks are in the .part file so far, replacing the previous record in one go so there's
+        // always a complete one
+        bool saveState() {
+            lastStateSave = std::chrono::steady_clock::now();
+
+            if (pathToStateFile.empty())
+                return true;
+
+            auto newStateFile = pathToStateFile + ".new";
+            auto* f = fopen(newStateFile.c_str(), "w");
+
+            if (f == nullptr) {
+                issueStatusMessage("Failed to save download state to " + newStateFile);
+                return false;
+            }
+
+            auto rv = zsync_save_state(zsHandle, f);
+
+            if (fclose(f) != 0 || rv != 0 || rename(newStateFile.c_str(), pathToStateFile.c_str()) != 0) {
+                issueStatusMessage("Failed to save download state to " + pathToStateFile);
+                unlink(newStateFile.c_str());
                 return false;
             }
 
             return true;
         }
 
+        // carry on with the download left in the .part file by an earlier run, using the record it kept of the blocks
+        // it got, rather than scanning the file for them
+        bool resumeFromState(const std::string& tempFilePath) {
+            auto* f = fopen(pathToStateFile.c_str(), "r");
+
+            if (f == nullptr)
+                return false;
+
+            auto rv = zsync_resume_file(zsHandle, tempFilePath.c_str(), f);
+            fclose(f);
+
+            return rv == 1;
+        }
+
         bool verifyDownloadedFile(std::string tempFilePath) {
             state = VERIFYING;
 
+            // the file is truncated to the target's length now, so the record of its blocks is no use any more
+            if (!pathToStateFile.empty())
+                unlink(pathToStateFile.c_str());
+
             auto r = zsync_complete(zsHandle);
 
             switch (r) {
@@ -608,61 +893,181 @@ namespace zsync2 {
             return true;
         }
 
-        int fetchRemainingBlocksHttp(const std::string &url, int urlType) {
+        // download the remaining ranges from all the mirrors in urls at once (from the first one, for compressed data)
+        // mirrors which fail are removed from urls, and what they were downloading is requested from the others
+        int fetchRemainingBlocksHttp(std::vector<std::string>& urls, int urlType) {
+            // most data to take from the range fetch's receive buffer at once
             // use static const int instead of a define
-            static const auto BUFFERSIZE = 8192;
+            static const auto MAX_READ = 65536;
 
             int ret = 0;
 
-            struct range_fetch* rf;
-            struct zsync_receiver* zr;
+            struct Mirror {
+                std::string url;            // as listed in the .zsync file
+                std::string redirectedUrl;  // the one we're downloading from
+                bool failed;
+                off_t bytesDown;            // by the range fetches which have been ended already
+            };
+            std::vector<Mirror> mirrors;
 
-            // URL might be relative -- we need an absolute URL to do a fetch
-            std::string absoluteUrl;
+            for (const auto& url : urls) {
+                // URL might be relative -- we need an absolute URL to do a fetch
+                std::string absoluteUrl;
 
-            if (!userSpecifiedUrl.empty()) {
-                absoluteUrl = userSpecifiedUrl;
-            } else {
                 if (!makeUrlAbsolute(referer, url, absoluteUrl)) {
                     issueStatusMessage("URL '" + url + "' from .zsync file is relative, which cannot be resolved without "
                                        "knowing the URL to the .zsync file (you're most likely trying to use a .zsync "
                                        "file you downloaded from the internet). Without knowing the original URL, it is "
                                        "impossible to resolve the URL from the .zsync file. Please specify a URL with the "
                                        "-u flag, or edit and fix the lines in the .zsync file directly.");
-                    return -1;
+                    continue;
                 }
-            }
 
-            // follow redirections of the URL before passing it to libzsync to avoid unnecessary redirects for
-            // multiple range requests
-            std::string redirectedUrl;
-            if (!resolveRedirections(absoluteUrl, redirectedUrl)) {
-                issueStatusMessage("Failed to resolve redirection.");
-                return -1;
+                // follow redirections of the URL before passing it to libzsync to avoid unnecessary redirects for
+                // multiple range requests
+                std::string redirectedUrl;
+                if (!resolveRedirections(absoluteUrl, redirectedUrl)) {
+                    issueStatusMessage("Failed to resolve redirection of " + absoluteUrl + ".");
+                    continue;
+                }
+
+                mirrors.push_back({url, redirectedUrl, false, 0});
             }
 
-            /* Start a range fetch and a zsync receiver */
-            rf = range_fetch_start(redirectedUrl.c_str());
-            if (rf == nullptr)
-                return -1;
+            // forget about the mirrors we can't use
+            urls.clear();
+            for (const auto& mirror : mirrors)
+                urls.push_back(mirror.url);
 
-            zr = zsync_begin_receive(zsHandle, urlType);
-            if (zr == nullptr) {
-                range_fetch_end(rf);
+            if (mirrors.empty())
                 return -1;
-            }
 
-            issueStatusMessage("Downloading from " + redirectedUrl);
+            // compressed data must be passed to a single receiver in order, as each range within a zlib block
+            // depends on the decompressor having seen the start of the block, so download it over one connection
+            // from the first mirror only; the others stay in urls, in the order of the .zsync file, so if that one
+            // fails, fetchRemainingBlocks calls us again and the next one takes over where it left off
+            const bool compressed = urlType == 1;
+            if (compressed)
+                mirrors.resize(1);
+
+            const auto connectionsPerMirror = compressed ? 1u : maxParallelConnections;
+            const auto streamsPerMirror = compressed ? 1u : maxHttp2Streams;
+
+            // one range fetch, each with its own zsync receiver, per connection, and a few connections per mirror
+            // all the range fetches share one curl multi handle, so while we wait for one of them, the others carry on
+            // downloading; a receiver keeps track of incomplete blocks of the range its connection is reading, so
+            // they must not be mixed up between connections
+            struct Connection {
+                struct range_fetch* rf;     // nullptr once its mirror has failed
+                struct zsync_receiver* zr;
+                size_t mirror;
+                bool busy;
+                bool stolen;    // the ranges it's downloading have been requested on another connection, too
+                std::ptrdiff_t twin;    // and this is the index of that connection, while it's downloading them
+                std::vector<std::pair<off_t, off_t>> assigned;  // ranges it's downloading
+                off_t zoffset;  // end of the data last passed to the receiver
+                bool failed;    // the receiver rejected data passed to it
+            };
+            std::vector<Connection> connections;
+            // over HTTP/2, further "connections" are added as streams later on, see below
+            // reserve room for all of them up front, as the range fetches hold pointers to their Connection
+            connections.reserve(mirrors.size() * std::max(connectionsPerMirror, streamsPerMirror));
+
+            // any range fetch still in use, to share its multi handle and to wait for progress on all of them
+            auto anyRangeFetch = [&connections]() -> struct range_fetch* {
+                for (const auto& connection : connections) {
+                    if (connection.rf != nullptr)
+                        return connection.rf;
+                }
+                return nullptr;
+            };
+
+            auto endConnection = [this, &mirrors](Connection& connection) {
+                if (connection.rf == nullptr)
+                    return;
+                httpDown += range_fetch_bytes_down(connection.rf);
+                mirrors[connection.mirror].bytesDown += range_fetch_bytes_down(connection.rf);
+                zsync_end_receive(connection.zr);
+                range_fetch_end(connection.rf);
+                connection.rf = nullptr;
+                connection.busy = false;
+            };
+
+            auto endConnections = [&connections, &endConnection]() {
+                for (auto& connection : connections)
+                    endConnection(connection);
+                connections.clear();
+            };
+
+            /* Start a range fetch and a zsync receiver per connection */
+            // (re)open a connection to its mirror, sharing the multi handle of share
+            auto openConnection = [this, &mirrors, urlType](Connection& connection, struct range_fetch* share) {
+                const auto mirror = connection.mirror;
+                connection = Connection{};
+                connection.mirror = mirror;
+                connection.twin = -1;
+
+                connection.rf = range_fetch_start_shared(mirrors[mirror].redirectedUrl.c_str(), share);
+                if (connection.rf == nullptr)
+                    return false;
 
-            /* Create a read buffer */
-            std::vector<unsigned char> buffer;
-            try {
-                buffer.reserve(BUFFERSIZE);
-            } catch (std::bad_alloc& e) {
-                // finish available data, then re-throw
+                connection.zr = zsync_begin_receive(zsHandle, urlType);
+                if (connection.zr == nullptr) {
+                    range_fetch_end(connection.rf);
+                    connection.rf = nullptr;
+                    return false;
+                }
+
+                // have the range fetch pass data to the receiver as soon as it comes in, which verifies it and
+                // writes it to the target file, instead of buffering it until we read it below
+                // the connections vector has been reserved beforehand, so the pointer stays valid
+                range_fetch_set_sink(connection.rf, [](void* context, const unsigned char* data,
+                                                       off_t offset, size_t len) -> int {
+                    auto* connection = static_cast<Connection*>(context);
+                    connection->zoffset = offset + len;
+                    if (zsync_receive_data(connection->zr, data, offset, len) != 0) {
+                        connection->failed = true;
+                        return 1;
+                    }
+                    return 0;
+                }, &connection);
+                return true;
+            };
+
+            auto addConnection = [&connections, &anyRangeFetch, &openConnection](size_t mirror) {
+                auto* share = anyRangeFetch();
+
+                connections.emplace_back();
+                connections.back().mirror = mirror;
+                if (!openConnection(connections.back(), share)) {
+                    connections.pop_back();
+                    return false;
+                }
+                return true;
+            };
+
+            // abandon what a connection is downloading, and have it start afresh
+            auto restartConnection = [this, &mirrors, &openConnection](Connection& connection) {
+                auto* rf = connection.rf;
+                auto* zr = connection.zr;
+
+                httpDown += range_fetch_bytes_down(rf);
+                mirrors[connection.mirror].bytesDown += range_fetch_bytes_down(rf);
+                const auto success = openConnection(connection, rf);
                 zsync_end_receive(zr);
                 range_fetch_end(rf);
-                throw;
+                return success;
+            };
+
+            for (size_t mirror = 0; mirror < mirrors.size(); mirror++) {
+                for (unsigned int i = 0; i < connectionsPerMirror; i++) {
+                    if (!addConnection(mirror)) {
+                        endConnections();
+                        return -1;
+                    }
+                }
+
+                issueStatusMessage("Downloading from " + mirrors[mirror].redirectedUrl);
             }
 
             /* Get a set of byte ranges that we need to complete the target */
@@ -673,10 +1078,14 @@ namespace zsync2 {
                 int nrange;
                 std::shared_ptr<off_t> zbyterange(zsync_needed_byte_ranges(zsHandle, &nrange, urlType), free);
 
-                if (zbyterange == nullptr)
+                if (zbyterange == nullptr) {
+                    endConnections();
                     return 1;
-                if (nrange == 0)
+                }
+                if (nrange == 0) {
+                    endConnections();
                     return 0;
+                }
 
                 for (int i = 0; i < 2 * nrange; i++) {
                     ranges.emplace_back(std::make_pair(zbyterange.get()[i], zbyterange.get()[i + 1]));
@@ -704,69 +1113,350 @@ namespace zsync2 {
                 exit(0);
             }
 
-            // begin downloading ranges, one by one
+            // begin downloading ranges, one by one per connection, or in batches if enabled
             {
-                for (const auto& pair : ranges) {
-                    auto beginbyte = pair.first;
-                    auto endbyte = pair.second;
+                // maximum number of ranges to hand to a connection at once; the range fetch splits them up into
+                // as many requests as needed to stay within the limits servers put on the size of a request
+                static const std::ptrdiff_t MAX_RANGES_PER_BATCH = 100;
+
+                auto nextRange = ranges.begin();
+
+                // ranges which a failed mirror was downloading, to be requested from another one first
+                std::deque<std::pair<off_t, off_t>> retryRanges;
+
+                auto rangesLeft = [&nextRange, &ranges, &retryRanges]() {
+                    return std::distance(nextRange, ranges.end()) + static_cast<std::ptrdiff_t>(retryRanges.size());
+                };
+
+                // unless a fixed threshold has been set, nearby ranges are merged as they're handed out, based on
+                // the latency and throughput measured on the requests made so far
+                ZSyncRangePlanner planner;
+                const bool adaptive = adaptiveRangesOptimization && rangesOptimizationThreshold == 0;
+                size_t requestedRanges = 0;
+
+                auto takeRange = [&nextRange, &ranges, &retryRanges, &connections, &planner, adaptive]() {
+                    if (!retryRanges.empty()) {
+                        auto range = retryRanges.front();
+                        retryRanges.pop_front();
+                        return range;
+                    }
+
+                    auto range = *nextRange++;
+
+                    if (adaptive) {
+                        const auto threshold = planner.mergeThreshold(connections.size());
+
+                        // don't let a request grow beyond its share of what's left, or the other connections would
+                        // sit idle
+                        const auto limit = (ranges.back().second - range.first) / static_cast<off_t>(connections.size());
+
+                        while (nextRange != ranges.end() && nextRange->first - range.second <= threshold
+                               && nextRange->second - range.first <= limit) {
+                            range.second = nextRange->second;
+                            ++nextRange;
+                        }
+                    }
+
+                    return range;
+                };
+
+                // how fast each mirror has been so far, in bytes per second
+                const auto startTime = std::chrono::steady_clock::now();
+                auto mirrorThroughputs = [&connections, &mirrors, &startTime]() {
+                    std::vector<double> throughputs;
+                    for (const auto& mirror : mirrors)
+                        throughputs.push_back(mirror.bytesDown);
+                    for (const auto& connection : connections) {
+                        if (connection.rf != nullptr)
+                            throughputs[connection.mirror] += range_fetch_bytes_down(connection.rf);
+                    }
+
+                    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+                    for (auto& throughput : throughputs)
+                        throughput /= std::max(elapsed.count(), 0.001);
+                    return throughputs;
+                };
+
+                // once all ranges have been handed out, a connection to a mirror which has been faster than another
+                // one requests what a connection to the slower one is still downloading, too, so the download doesn't
+                // have to wait for the slowest mirror to finish; whichever is faster wins, the blocks are just written
+                // twice
+                auto findRangesToSteal = [&connections, &mirrorThroughputs](const Connection& thief) -> Connection* {
+                    const auto throughputs = mirrorThroughputs();
+
+                    Connection* victim = nullptr;
+                    double victimThroughput = throughputs[thief.mirror];
+
+                    for (auto& connection : connections) {
+                        if (connection.rf == nullptr || !connection.busy || connection.stolen
+                            || connection.mirror == thief.mirror)
+                            continue;
+
+                        if (throughputs[connection.mirror] < victimThroughput) {
+                            victim = &connection;
+                            victimThroughput = throughputs[connection.mirror];
+                        }
+                    }
+
+                    return victim;
+                };
+
+                // hand the next range(s) to a connection, and send the request for them right away so that it's in
+                // flight while we read the other connections' responses
+                auto startNextRange = [this, &connections, &rangesLeft, &takeRange, &findRangesToSteal,
+                                       &requestedRanges](Connection& connection) {
+                    connection.assigned.clear();
+                    connection.stolen = false;
+                    connection.twin = -1;
+                    connection.zoffset = 0;
+
+                    if (rangesLeft() == 0) {
+                        auto* victim = findRangesToSteal(connection);
+                        if (victim == nullptr) {
+                            connection.busy = false;
+                            return;
+                        }
+
+                        connection.assigned = victim->assigned;
+                        victim->stolen = true;
+                        victim->twin = &connection - connections.data();
+                        connection.stolen = true;
+                        connection.twin = victim - connections.data();
+                    } else {
+                        // by default, only one range at a time because Akamai can't handle more than one range per
+                        // request
+                        // when enabled, we first find out whether the server can handle more by asking for just two
+                        // ranges at once; if it does, the remaining ranges are shared out between the connections in
+                        // batches, so that none of them sits idle
+                        std::ptrdiff_t count = 1;
+                        if (multipleRangesPerRequest) {
+                            switch (range_fetch_multirange(connection.rf)) {
+                                case -1:
+                                    count = 2;
+                                    break;
+                                case 1: {
+                                    auto share = (rangesLeft() + connections.size() - 1) / connections.size();
+                                    count = std::min<std::ptrdiff_t>(share, MAX_RANGES_PER_BATCH);
+                                    break;
+                                }
+                                default:
+                                    break;
+                            }
+                        }
+
+                        for (; count > 0 && rangesLeft() > 0; count--)
+                            connection.assigned.push_back(takeRange());
+                        requestedRanges += connection.assigned.size();
+                    }
+
+                    std::vector<off_t> batch;
+                    for (const auto& range : connection.assigned) {
+                        batch.push_back(range.first);
+                        batch.push_back(range.second);
+                    }
 
-                    off_t single_range[2] = {beginbyte, endbyte};
                     /* And give that to the range fetcher */
-                    /* Only one range at a time because Akamai can't handle more than one range per request */
-                    range_fetch_addranges(rf, single_range, 1);
+                    range_fetch_addranges(connection.rf, batch.data(), static_cast<int>(batch.size() / 2));
+                    range_fetch_begin(connection.rf);
+                    connection.busy = true;
+                };
 
-                    {
-                        int len;
-                        off_t zoffset;
+                // give up on a mirror, and have the ranges it was downloading requested from the others
+                // ret is set once there are no mirrors left
+                auto failMirror = [this, &mirrors, &urls, &connections, &endConnection, &retryRanges, &ret](
+                    size_t mirror, int status
+                ) {
+                    mirrors[mirror].failed = true;
+                    urls.erase(std::find(urls.begin(), urls.end(), mirrors[mirror].url));
+
+                    for (auto& connection : connections) {
+                        if (connection.mirror != mirror || connection.rf == nullptr)
+                            continue;
+
+                        // unless another connection is downloading the same ranges anyway, they have to be requested
+                        // again
+                        if (connection.twin >= 0) {
+                            connections[connection.twin].twin = -1;
+                        } else if (connection.busy) {
+                            retryRanges.insert(retryRanges.end(), connection.assigned.begin(),
+                                               connection.assigned.end());
+                        }
+                        endConnection(connection);
+                    }
+
+                    if (urls.empty()) {
+                        issueStatusMessage("failed to retrieve from " + mirrors[mirror].redirectedUrl + ", status "
+                                           + std::to_string(status));
+                        ret = status;
+                    } else {
+                        issueStatusMessage("failed to retrieve from " + mirrors[mirror].redirectedUrl + ", status "
+                                           + std::to_string(status) + ", continuing with the other mirrors");
+                    }
+                };
+
+                #ifdef ZSYNC_STANDALONE
+                // what the range fetches still open have downloaded, plus what the ended ones had
+                auto bytesDown = [&connections, &mirrors]() {
+                    off_t total = 0;
+                    for (const auto& connection : connections) {
+                        if (connection.rf != nullptr)
+                            total += range_fetch_bytes_down(connection.rf);
+                    }
+                    for (const auto& mirror : mirrors)
+                        total += mirror.bytesDown;
+                    return total;
+                };
+
+                struct progress p = { 0, 0, 0, 0 };
+
+                /* Set up progress display to run during the fetch */
+                fputc('\n', stderr);
+                do_progress(&p, (float) calculateProgress() * 100.0f, bytesDown());
+                #endif
+
+                // serve whichever connections have data for us, and wait for more when none has
+                bool anyBusy = true;
+                while (!ret && anyBusy) {
+                    anyBusy = false;
+
+                    for (size_t mirror = 0; mirror < mirrors.size() && !ret; mirror++) {
+                        if (mirrors[mirror].failed)
+                            continue;
+
+                        // once a server turns out to speak HTTP/2, all range fetches' requests to it are streams on
+                        // the same connection, so more of them in flight at once cost next to nothing; add some to
+                        // hide the latency of each request, still asking for one range (or batch) per request
+                        auto mirrorConnections = std::count_if(connections.begin(), connections.end(),
+                                                               [mirror](const Connection& connection) {
+                            return connection.mirror == mirror;
+                        });
+                        auto first = std::find_if(connections.begin(), connections.end(),
+                                                  [mirror](const Connection& connection) {
+                            return connection.mirror == mirror;
+                        });
+
+                        while (range_fetch_multiplexed(first->rf) && rangesLeft() > 0
+                               && static_cast<unsigned int>(mirrorConnections) < streamsPerMirror) {
+                            if (!addConnection(mirror)) {
+                                ret = -1;
+                                break;
+                            }
+                            startNextRange(connections.back());
+                            mirrorConnections++;
+                        }
+                    }
 
-                        #ifdef ZSYNC_STANDALONE
-                        struct progress p = { 0, 0, 0, 0 };
+                    bool progressed = false;
 
-                        /* Set up progress display to run during the fetch */
-                        fputc('\n', stderr);
-                        do_progress(&p, (float) calculateProgress() * 100.0f, range_fetch_bytes_down(rf));
-                        #endif
+                    // indices rather than iterators, since failing a mirror may hand ranges to other connections
+                    for (size_t i = 0; i < connections.size() && !ret; i++) {
+                        auto& connection = connections[i];
 
-                        /* Loop while we're receiving data, until we're done or there is an error */
-                        while (!ret
-                               && (len = get_range_block(rf, &zoffset, buffer.data(), BUFFERSIZE)) > 0) {
-                            /* Pass received data to the zsync receiver, which writes it to the
-                             * appropriate location in the target file */
-                            if (zsync_receive_data(zr, buffer.data(), zoffset, len) != 0)
-                                ret = 1;
+                        if (connection.rf == nullptr)
+                            continue;
+
+                        // idle connections pick up ranges left over by failed mirrors, or help out slower ones
+                        if (!connection.busy) {
+                            startNextRange(connection);
+                            if (!connection.busy)
+                                continue;
+                        }
+                        anyBusy = true;
+
+                        if (!range_fetch_ready(connection.rf))
+                            continue;
+                        progressed = true;
+
+                        int len = 1;
+                        off_t zoffset;
+                        const unsigned char* data;
+
+                        /* Loop while there is data we can read without waiting; most of the data goes to the
+                         * receiver as it arrives, this picks up the rest */
+                        while (!connection.failed && range_fetch_ready(connection.rf)
+                               && (len = get_range_data(connection.rf, &zoffset, &data, MAX_READ)) > 0) {
+                            /* Pass received data to the zsync receiver, straight from the range fetch's buffer,
+                             * which writes it to the appropriate location in the target file */
+                            if (zsync_receive_data(connection.zr, data, zoffset, len) != 0)
+                                connection.failed = true;
 
                             #ifdef ZSYNC_STANDALONE
                             /* Maintain progress display */
-                            do_progress(&p, (float) calculateProgress() * 100.0f,
-                                        range_fetch_bytes_down(rf));
+                            do_progress(&p, (float) calculateProgress() * 100.0f, bytesDown());
                             #endif
 
                             // Needed in case next call returns len=0 and we need to signal where the EOF was.
-                            zoffset += len;
+                            connection.zoffset = zoffset + len;
                         }
 
-                        /* If error, we need to flag that to our caller */
+                        /* Nothing to read for now, the rest of the data goes to the receiver as it arrives */
+                        if (len == RANGE_FETCH_AGAIN)
+                            continue;
+
+                        /* If the mirror sent data which doesn't match the checksums, or there was an error, try the
+                         * others */
+                        if (connection.failed) {
+                            failMirror(connection.mirror, 1);
+                            continue;
+                        }
                         if (len < 0) {
-                            ret = -1;
-                            break;
+                            failMirror(connection.mirror, -1);
+                            continue;
                         }
-                        else{    /* Else, let the zsync receiver know that we're at EOF; there
-                         *could be data in its buffer that it can use or needs to process */
-                            zsync_receive_data(zr, nullptr, zoffset, 0);
+
+                        /* More to come later */
+                        if (len > 0)
+                            continue;
+
+                        /* Else, let the zsync receiver know that we're at EOF; there could be data in its buffer
+                         * that it can use or needs to process */
+                        zsync_receive_data(connection.zr, nullptr, connection.zoffset, 0);
+
+                        // if another connection is still downloading the same ranges, it needn't bother any more
+                        if (connection.twin >= 0) {
+                            auto& twin = connections[connection.twin];
+                            twin.twin = -1;
+                            connection.twin = -1;
+                            if (twin.busy && !restartConnection(twin)) {
+                                ret = -1;
+                                break;
+                            }
+                        }
+
+                        // update the estimates the next merges are based on
+                        {
+                            double latency, transferTime;
+                            off_t timedBytes;
+                            const auto completed = range_fetch_timing(connection.rf, &latency, &timedBytes,
+                                                                      &transferTime);
+                            planner.addMeasurement(completed, latency, timedBytes, transferTime);
                         }
 
-                        #ifdef ZSYNC_STANDALONE
-                        end_progress(&p, zsync_status(zsHandle) >= 2 ? 2 : len == 0 ? 1 : 0);
-                        #endif
+                        startNextRange(connection);
                     }
 
+                    // keep the record of the blocks got reasonably up to date, so an interruption loses little
+                    if (std::chrono::steady_clock::now() - lastStateSave > std::chrono::seconds(1))
+                        saveState();
+
+                    if (!ret && anyBusy && !progressed)
+                        range_fetch_wait(anyRangeFetch());
+                }
+
+                #ifdef ZSYNC_STANDALONE
+                end_progress(&p, zsync_status(zsHandle) >= 2 ? 2 : ret == 0 ? 1 : 0);
+                #endif
+
+                if (adaptive) {
+                    std::stringstream oss;
+                    oss << "merged nearby ranges while downloading, " << ranges.size() << " ranges needed, "
+                        << requestedRanges << " ranges requested";
+                    issueStatusMessage(oss.str());
                 }
             }
 
             /* Clean up */
-            httpDown += range_fetch_bytes_down(rf);
-            zsync_end_receive(zr);
-            range_fetch_end(rf);
+            endConnections();
             return ret;
         }
 
@@ -774,29 +1464,26 @@ namespace zsync2 {
             int n = 0, utype = 0;
             const auto* url = zsync_get_urls(zsHandle, &n, &utype);
 
-            // copy value for later use
-            int okUrls = n;
-
             if (!url) {
                 issueStatusMessage("no URLs available from zsync?");
                 return false;
             }
 
-            int* status;
-            status = static_cast<int*>(calloc(n, sizeof *status));
-
-            while (zsync_status(zsHandle) < 2 && okUrls) {
-                int attempt = rand() % n;
-
-                if (!status[attempt]) {
-                    const std::string tryurl = url[attempt];
+            // download from all the mirrors listed in the .zsync file at once, unless the user asked for a specific one
+            std::vector<std::string> urls;
+            if (!userSpecifiedUrl.empty()) {
+                urls.push_back(userSpecifiedUrl);
+            } else {
+                urls.assign(url, url + n);
+            }
 
-                    auto result = fetchRemainingBlocksHttp(tryurl, utype);
+            while (zsync_status(zsHandle) < 2 && !urls.empty()) {
+                auto result = fetchRemainingBlocksHttp(urls, utype);
 
-                    if (result != 0) {
-                        issueStatusMessage("failed to retrieve from " + tryurl + ", status " + std::to_string(result));
-                        return false;
-                    }
+                if (result != 0) {
+                    issueStatusMessage("failed to retrieve remaining blocks, status " + std::to_string(result));
+                    saveState();
+                    return false;
                 }
             }
 
@@ -842,6 +1529,7 @@ namespace zsync2 {
 
             // calculate path to temporary file
             auto tempFilePath = pathToLocalFile + ".part";
+            pathToStateFile = tempFilePath + ".zsstate";
 
             {
                 /**** step 2: read in available data from seed files and fill in existing data into target file ****/
@@ -851,11 +1539,16 @@ namespace zsync2 {
                 }
 
                 // if the temporary file exists, it's likely left over from a previous attempt that got interrupted
-                // due to how zsync works, one can't just "resume" from this file like a normal HTTP client would do (also,
-                // the server file might have changed in the meantime), but one can certainly make use of it as a seed file
+                // if that attempt recorded which blocks it got, and the record is for the same file and checks out, the
+                // download carries on in it; otherwise (also, the server file might have changed in the meantime), one
+                // can still make use of it as a seed file
                 if (isfile(tempFilePath)) {
-                    issueStatusMessage(tempFilePath + " found, using as seed file");
-                    seedFiles.insert(tempFilePath);
+                    if (isfile(pathToStateFile) && resumeFromState(tempFilePath)) {
+                        issueStatusMessage(tempFilePath + " found, resuming download");
+                    } else {
+                        issueStatusMessage(tempFilePath + " found, using as seed file");
+                        seedFiles.insert(tempFilePath);
+                    }
                 }
 
                 issueStatusMessage("Target file: " + pathToLocalFile);
@@ -893,6 +1586,9 @@ namespace zsync2 {
                 return false;
             }
 
+            // from now on, the download can be resumed from the .part file
+            saveState();
+
             // step 3: fetch remaining blocks via the URLs from the .zsync
             issueStatusMessage("Fetching remaining blocks");
             if(!fetchRemainingBlocks()) {
@@ -1145,4 +1841,20 @@ namespace zsync2 {
     void ZSyncClient::setRangesOptimizationThreshold(const unsigned long newRangesOptimizationThreshold) {
         d->rangesOptimizationThreshold = newRangesOptimizationThreshold;
     }
+
+    void ZSyncClient::setAdaptiveRangesOptimization(const bool enabled) {
+        d->adaptiveRangesOptimization = enabled;
+    }
+
+    void ZSyncClient::setMaxParallelConnections(const unsigned int newMaxParallelConnections) {
+        d->maxParallelConnections = std::max(newMaxParallelConnections, 1u);
+    }
+
+    void ZSyncClient::setMultipleRangesPerRequest(const bool enabled) {
+        d->multipleRangesPerRequest = enabled;
+    }
+
+    void ZSyncClient::setMaxHttp2Streams(const unsigned int newMaxHttp2Streams) {
+        d->maxHttp2Streams = newMaxHttp2Streams;
+    }
 }
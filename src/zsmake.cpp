@@ -1,18 +1,23 @@
 // system headers
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cmath>
 #include <cstring>
 #include <fstream>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
 #include <sstream>
+#include <thread>
 #include <unordered_map>
 
 // library headers
+#include "zlib/zlib.h"
 extern "C" {
     #include <rcksum.h>
     #include <sha1.h>
+    #include <zmap.h>
 }
 
 // local headers
@@ -21,6 +26,198 @@ extern "C" {
 #include "zsutil.h"
 
 namespace zsync2 {
+    // inflates a gzip file, recording the points in its compressed data at which decompression can be resumed along
+    // with the corresponding offsets in the uncompressed data, so a client can download just the parts of the
+    // compressed file it needs (the Z-Map)
+    class GZipMapper {
+    private:
+        // a point in the compressed data (in bits from the start of the file) and the offset in the uncompressed data
+        // it corresponds to
+        struct Point {
+            long long inBits;
+            long long outBytes;
+            bool blockStart;
+        };
+
+        std::istream& in;
+        const uint32_t blockSize;
+        const std::function<void(std::string)>& logMessage;
+
+        z_stream zs;
+        bool initialized;
+        bool streamEnd;
+        std::vector<char> inBuffer;
+
+        std::vector<Point> zMap;
+
+        // set once a point within a zlib block should be recorded at the next opportunity
+        bool wantMidBlockEntry;
+
+    public:
+        // entries in the Z-Map are stored relative to the one before in 16 bits, minus a flag for the output, so
+        // points are recorded often enough to stay well within these
+        static constexpr long long maxInBitsBetweenEntries = 0xFFFF;
+        static constexpr long long maxOutBytesBetweenEntries = 0xFFFF & ~GZB_NOTBLOCKSTART;
+
+        // a point within a zlib block is recorded at least this often, as well as after every block boundary in the
+        // uncompressed data
+        static constexpr long long inBitsBetweenMidBlockEntries = 16384;
+        static constexpr long long outBytesBetweenMidBlockEntries = 16384;
+
+        // output produced by a single call to inflate() is limited to this, as data copied from a stored block
+        // counts towards the distance between two entries in full
+        static constexpr size_t maxOutPerInflate = 4096;
+
+    public:
+        GZipMapper(std::istream& in, uint32_t blockSize, const std::function<void(std::string)>& logMessage)
+            : in(in), blockSize(blockSize), logMessage(logMessage), zs(), initialized(false), streamEnd(false),
+              inBuffer(64 * 1024), wantMidBlockEntry(false) {}
+
+        ~GZipMapper() {
+            if (initialized)
+                inflateEnd(&zs);
+        }
+
+    private:
+        // position of the decompressor in the compressed data, in bits
+        long long inPosition() const {
+            return static_cast<long long>(zs.total_in) * 8 - (zs.data_type & 63);
+        }
+
+        bool addEntry(long long inBits, long long outBytes, bool blockStart) {
+            // the client looks up a point by the byte it starts in, so a point within a block which shares its byte
+            // with the start of the next block must make way for it
+            if (blockStart && !zMap.empty() && !zMap.back().blockStart && zMap.back().inBits / 8 == inBits / 8)
+                zMap.pop_back();
+
+            const auto previous = zMap.empty() ? Point{0, 0, true} : zMap.back();
+
+            if (!blockStart && previous.inBits / 8 == inBits / 8)
+                return true;
+
+            if (inBits - previous.inBits > maxInBitsBetweenEntries
+                || outBytes - previous.outBytes > maxOutBytesBetweenEntries) {
+                logMessage("Too far between points in the compressed data for the Z-Map, try a smaller block size");
+                return false;
+            }
+
+            zMap.push_back({inBits, outBytes, blockStart});
+            wantMidBlockEntry = false;
+            return true;
+        }
+
+    public:
+        bool init() {
+            // 16 added to the window bits makes zlib read the gzip header and check the trailer
+            if (inflateInit2(&zs, MAX_WBITS + 16) != Z_OK) {
+                logMessage("Failed to initialize zlib");
+                return false;
+            }
+
+            initialized = true;
+            return true;
+        }
+
+        // decompress up to size bytes into data, which is filled completely unless the end of the data is reached
+        bool read(char* data, const size_t size, size_t& bytesRead) {
+            bytesRead = 0;
+
+            while (bytesRead < size && !streamEnd) {
+                if (zs.avail_in == 0) {
+                    in.read(inBuffer.data(), inBuffer.size());
+
+                    if (in.bad()) {
+                        logMessage(std::string("Failed to read compressed file: ") + strerror(errno));
+                        return false;
+                    }
+
+                    if (in.gcount() == 0) {
+                        logMessage("Premature end of compressed data");
+                        return false;
+                    }
+
+                    zs.next_in = reinterpret_cast<Bytef*>(inBuffer.data());
+                    zs.avail_in = static_cast<uInt>(in.gcount());
+                }
+
+                // stop at the next block boundary in the uncompressed data
+                const auto untilBlockEnd = static_cast<size_t>(blockSize - zs.total_out % blockSize);
+
+                zs.next_out = reinterpret_cast<Bytef*>(data + bytesRead);
+                zs.avail_out = static_cast<uInt>(std::min({size - bytesRead, maxOutPerInflate, untilBlockEnd}));
+
+                const auto outBefore = zs.avail_out;
+
+                // Z_BLOCK makes zlib stop at the end of each zlib block; the bundled zlib also returns before each
+                // symbol, which is where decompression can be resumed within a block
+                const auto rc = inflate(&zs, Z_BLOCK);
+
+                switch (rc) {
+                    case Z_STREAM_END:
+                        streamEnd = true;
+                        break;
+                    case Z_OK:
+                    case Z_BUF_ERROR:
+                        break;
+                    default:
+                        logMessage(std::string("Failed to decompress: ") + (zs.msg != nullptr ? zs.msg : "zlib error"));
+                        return false;
+                }
+
+                const auto produced = outBefore - zs.avail_out;
+                bytesRead += produced;
+
+                // reached a block boundary in the uncompressed data
+                if (produced > 0 && produced == untilBlockEnd)
+                    wantMidBlockEntry = true;
+
+                if ((zs.data_type & 128) || streamEnd) {
+                    // at the start of a zlib block (or the end of the data)
+                    if (!addEntry(inPosition(), zs.total_out, true))
+                        return false;
+                } else {
+                    if (!zMap.empty() && (inPosition() - zMap.back().inBits >= inBitsBetweenMidBlockEntries
+                                          || zs.total_out - zMap.back().outBytes >= outBytesBetweenMidBlockEntries))
+                        wantMidBlockEntry = true;
+
+                    if (wantMidBlockEntry && inflateSafePoint(&zs) == 1) {
+                        if (!addEntry(inPosition(), zs.total_out, false))
+                            return false;
+                    }
+                }
+            }
+
+            if (streamEnd && (zs.avail_in > 0 || in.peek() != std::char_traits<char>::eof())) {
+                logMessage("Data after the end of the compressed stream, only gzip files with a single member are "
+                           "supported");
+                return false;
+            }
+
+            return true;
+        }
+
+        // the Z-Map as stored in the .zsync file: the entries relative to each other, in network byte order
+        std::vector<gzblock> encodeZMap() const {
+            std::vector<gzblock> encoded;
+            encoded.reserve(zMap.size());
+
+            long long inBits = 0, outBytes = 0;
+
+            for (const auto& entry : zMap) {
+                auto outOffset = static_cast<uint16_t>(entry.outBytes - outBytes);
+                if (!entry.blockStart)
+                    outOffset |= GZB_NOTBLOCKSTART;
+
+                encoded.push_back({htons(static_cast<uint16_t>(entry.inBits - inBits)), htons(outOffset)});
+
+                inBits = entry.inBits;
+                outBytes = entry.outBytes;
+            }
+
+            return encoded;
+        }
+    };
+
     class ZSyncFileMaker::Private {
     private:
         typedef std::vector<char> buffer_t;
@@ -45,6 +242,11 @@ namespace zsync2 {
 
         buffer_t blockSums;
 
+        // whether the input is a gzip file whose contents the .zsync file describes, and the Z-Map to download them
+        // from the compressed file
+        bool lookInsideGZip;
+        std::vector<gzblock> zMap;
+
         headerFields_t customHeaderFields;
 
         std::function<void(std::string)> logMessage;
@@ -55,7 +257,8 @@ namespace zsync2 {
                                                     checksumLength(0),
                                                     blockSize(0),
                                                     rSumLength(0),
-                                                    seqMatches(0)
+                                                    seqMatches(0),
+                                                    lookInsideGZip(false)
         {
             // make sure to use the filename only
             size_t slashPos;
@@ -98,60 +301,204 @@ namespace zsync2 {
             return false;
         }
 
+        // name of the file the gzip input decompresses to, going by the usual naming conventions
+        std::string uncompressedFileName() const {
+            if (endsWith(fileName, ".tgz"))
+                return fileName.substr(0, fileName.size() - 4) + ".tar";
+
+            if (endsWith(fileName, ".gz") && fileName.size() > 3)
+                return fileName.substr(0, fileName.size() - 3);
+
+            return fileName;
+        }
+
     public:
-        bool writeBlockSums(const buffer_t& buffer, size_t bytesRead) {
-            buffer_t checksum(CHECKSUM_SIZE);
-
-            // add padding to last block
-            if (bytesRead < blockSize)
-                std::fill(checksum.begin() + bytesRead, checksum.end(), 0);
-
-            // sometimes, the inconsistent use of char and unsigned char within the old zsync code base can get
-            // annoying...
-            auto r = rcksum_calc_rsum_block(reinterpret_cast<const unsigned char*>(buffer.data()), blockSize);
-            rcksum_calc_checksum(
-                reinterpret_cast<unsigned char*>(checksum.data()),
-                reinterpret_cast<const unsigned char*>(buffer.data()),
-                blockSize
-            );
+        // size of a block's entry in blockSums: its rsum, then its MD4 checksum
+        static constexpr size_t blockSumSize = sizeof(rsum) + CHECKSUM_SIZE;
+
+        // the input is read and processed this many bytes at a time
+        static constexpr size_t chunkSize = 8 * 1024 * 1024;
+
+        // calculate the rsum and checksum of a block, and store them in out, in network byte order
+        static void calculateBlockSum(const unsigned char* block, size_t size, char* out) {
+            auto r = rcksum_calc_rsum_block(block, size);
             r.a = htons(r.a);
             r.b = htons(r.b);
 
-            // insert raw bytes into
-            auto oldSize = blockSums.size();
-            blockSums.resize(oldSize + sizeof(r));
-            memcpy(&blockSums[oldSize], &r, sizeof(r));
+            memcpy(out, &r, sizeof(r));
+            rcksum_calc_checksum(reinterpret_cast<unsigned char*>(out + sizeof(r)), block, size);
+        }
+
+        // calculate the block sums of all the whole blocks in chunk, and store them in out, sharing the work between
+        // threads
+        void calculateChunkBlockSums(const buffer_t& chunk, size_t blocks, char* out) {
+            const auto threads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), blocks));
+
+            auto work = [&chunk, blocks, threads, out, this](size_t thread) {
+                // threads take every n-th run of blocks, so they finish at about the same time
+                static constexpr size_t blocksPerRun = 64;
+
+                for (size_t first = thread * blocksPerRun; first < blocks; first += threads * blocksPerRun) {
+                    const auto last = std::min(first + blocksPerRun, blocks);
+
+                    for (auto block = first; block < last; block++) {
+                        calculateBlockSum(reinterpret_cast<const unsigned char*>(chunk.data()) + block * blockSize,
+                                          blockSize, out + block * blockSumSize);
+                    }
+                }
+            };
+
+            std::vector<std::thread> workers;
+            for (size_t thread = 1; thread < threads; thread++)
+                workers.emplace_back(work, thread);
+
+            work(0);
+
+            for (auto& worker : workers)
+                worker.join();
+        }
 
-            std::copy(checksum.begin(), checksum.end(), std::back_inserter(blockSums));
+        // fills data with up to size bytes of the input, which is filled completely unless the end of the input is
+        // reached, and reports the number of bytes read; returns false on errors, which it has logged
+        typedef std::function<bool(char* data, size_t size, size_t& bytesRead)> reader_t;
+
+        // read the input a chunk at a time, calculating the SHA-1 of the file and the block sums of each chunk while
+        // the next one is read
+        // as before, a partial block at the end of the file is left out of both, and of the length, unless
+        // includePartialBlock is set
+        // sizeHint is the expected size of the input, used to size the buffers only
+        bool readStreamWriteBlockSums(const reader_t& read, long long sizeHint, bool includePartialBlock,
+                                      SHA1_CTX& sha1Ctx) {
+            size_t blocksPerChunk = std::max<size_t>(1, chunkSize / blockSize);
+
+            // block sums go straight into their place in blockSums, so make room for them up front
+            if (sizeHint >= 0) {
+                const auto fileBlocks = (static_cast<size_t>(sizeHint) + (includePartialBlock ? blockSize - 1 : 0))
+                                        / blockSize;
+                blockSums.reserve(fileBlocks * blockSumSize);
+                blocksPerChunk = std::max<size_t>(1, std::min(blocksPerChunk, fileBlocks));
+            }
+
+            // two chunks, so one can be read while the other is processed
+            std::vector<buffer_t> chunks(2, buffer_t(blocksPerChunk * blockSize));
+
+            std::future<void> sha1Done, blockSumsDone;
+
+            auto waitForChunk = [&sha1Done, &blockSumsDone]() {
+                if (sha1Done.valid())
+                    sha1Done.get();
+                if (blockSumsDone.valid())
+                    blockSumsDone.get();
+            };
+
+            bool endOfInput = false;
+
+            for (size_t chunkIndex = 0; !endOfInput; chunkIndex++) {
+                auto& chunk = chunks[chunkIndex % 2];
+                size_t bytesRead;
+
+                if (!read(chunk.data(), chunk.size(), bytesRead)) {
+                    waitForChunk();
+                    return false;
+                }
+
+                endOfInput = bytesRead < chunk.size();
+
+                auto blocks = bytesRead / blockSize;
+                auto bytes = blocks * blockSize;
+
+                // a partial block at the end is padded with zeroes for its block sums, like the client does
+                if (includePartialBlock && bytesRead > bytes) {
+                    std::fill(chunk.begin() + bytesRead, chunk.begin() + (++blocks * blockSize), 0);
+                    bytes = bytesRead;
+                }
+
+                // the previous chunk must be done with before this one is handed out, the SHA-1 in particular needs
+                // the data in order
+                waitForChunk();
+
+                if (blocks == 0)
+                    break;
+
+                const auto offset = blockSums.size();
+                blockSums.resize(offset + blocks * blockSumSize);
+
+                sha1Done = std::async(std::launch::async, [&sha1Ctx, &chunk, bytes]() {
+                    SHA1Update(&sha1Ctx, reinterpret_cast<const uint8_t*>(chunk.data()), bytes);
+                });
+
+                blockSumsDone = std::async(std::launch::async, [this, &chunk, blocks, offset]() {
+                    calculateChunkBlockSums(chunk, blocks, &blockSums[offset]);
+                });
+
+                length += bytes;
+            }
+
+            waitForChunk();
 
             return true;
         }
 
         bool readStreamWriteBlockSums(std::ifstream& inFile, SHA1_CTX& sha1Ctx) {
-            buffer_t buffer(blockSize);
+            long long size = -1;
+            {
+                const auto start = inFile.tellg();
+                inFile.seekg(0, std::ios::end);
+                const auto end = inFile.tellg();
+                inFile.seekg(start);
 
-            while (inFile.read(buffer.data(), buffer.size())) {
-                auto bytesRead = (size_t) inFile.gcount();
+                if (start >= 0 && end >= start)
+                    size = end - start;
+            }
 
-                if (bytesRead > 0) {
-                    SHA1Update(&sha1Ctx, reinterpret_cast<const uint8_t*>(buffer.data()), bytesRead);
+            auto read = [&inFile, this](char* data, size_t size, size_t& bytesRead) {
+                inFile.read(data, size);
+                bytesRead = static_cast<size_t>(inFile.gcount());
 
-                    writeBlockSums(buffer, bytesRead);
-                    length += bytesRead;
-                } else {
-                    auto error = errno;
+                if (inFile.bad()) {
+                    logMessage(std::string("Failed to calculate block sums: ") + strerror(errno));
+                    return false;
+                }
 
-                    std::string messagePrefix = "Failed to calculate block sums: ";
+                return true;
+            };
 
-                    if (inFile.fail())
-                        logMessage(messagePrefix + strerror(error));
-                    else
-                        logMessage(messagePrefix + "unknown error: " + strerror(error));
+            return readStreamWriteBlockSums(read, size, false, sha1Ctx);
+        }
 
-                    return false;
+        // calculate the block sums of the uncompressed contents of a gzip file, and its Z-Map
+        bool readZStreamWriteBlockSums(std::ifstream& inFile, SHA1_CTX& sha1Ctx) {
+            // the gzip trailer ends with the size of the uncompressed data (modulo 2^32), which is good enough a guess
+            // unless that has wrapped around, when the size of the compressed file is a better one
+            long long size = -1;
+            {
+                unsigned char trailer[4];
+                inFile.seekg(-4, std::ios::end);
+                const long long compressedSize = inFile.tellg() + std::streamoff(4);
+
+                if (inFile.read(reinterpret_cast<char*>(trailer), sizeof(trailer))) {
+                    size = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | static_cast<long long>(trailer[3]) << 24;
+                    size = std::max(size, compressedSize);
                 }
+
+                inFile.clear();
+                inFile.seekg(0);
             }
 
+            GZipMapper mapper(inFile, blockSize, logMessage);
+
+            if (!mapper.init())
+                return false;
+
+            auto read = [&mapper](char* data, size_t size, size_t& bytesRead) {
+                return mapper.read(data, size, bytesRead);
+            };
+
+            // the client decompresses the data to its end, and checks the last block of it, too
+            if (!readStreamWriteBlockSums(read, size, true, sha1Ctx))
+                return false;
+
+            zMap = mapper.encodeZMap();
             return true;
         }
 
@@ -171,8 +518,19 @@ namespace zsync2 {
             if (blockSize == 0)
                 blockSize = (ifs.tellg() < 100000000) ? 2048 : 4096;
 
-            if (!readStreamWriteBlockSums(ifs, sha1Ctx))
+            if (lookInsideGZip) {
+                if (ifs.get() != 0x1f || ifs.get() != 0x8b) {
+                    logMessage("Not a gzip file: " + path);
+                    return false;
+                }
+
+                ifs.seekg(0);
+
+                if (!readZStreamWriteBlockSums(ifs, sha1Ctx))
+                    return false;
+            } else if (!readStreamWriteBlockSums(ifs, sha1Ctx)) {
                 return false;
+            }
 
 
             // decide how long a rsum hash and checksum hash per block we need for this file
@@ -208,13 +566,21 @@ namespace zsync2 {
             return true;
         }
 
-        bool dump(std::string& data) {
+        // write the .zsync file to out in one pass: the header, then each block's truncated rsum and checksum
+        bool write(std::ostream& out) {
             // prepare file header
             // create copy of customHeaderFields and insert default headers
             auto headerFields = customHeaderFields;
 
             headerFields["zsync"] = VERSION;
-            headerFields["Filename"] = fileName;
+
+            if (lookInsideGZip) {
+                // the client is to end up with the uncompressed file, which it gets from the compressed one
+                headerFields["Filename"] = uncompressedFileName();
+                headerFields["Z-Filename"] = fileName;
+            } else {
+                headerFields["Filename"] = fileName;
+            }
 
             if (!insertMTimeHeader(headerFields))
                 return false;
@@ -240,57 +606,66 @@ namespace zsync2 {
                 );
             }
 
-            headerFields["URL"] = url;
+            headerFields[lookInsideGZip ? "Z-URL" : "URL"] = url;
             headerFields["SHA-1"] = fileSHA1Hash;
 
             std::ostringstream hashLengths;
             hashLengths << seqMatches << "," << rSumLength << "," << checksumLength;
             headerFields["Hash-Lengths"] = hashLengths.str();
 
-            // now, create .zsync file
-            std::ostringstream oss;
-
             constexpr char endl[] = "\n";
 
             // write header
             for (const auto& pair : headerFields) {
-                oss << pair.first << ": " << pair.second << endl;
+                out << pair.first << ": " << pair.second << endl;
+            }
+
+            // the Z-Map is binary, and follows its header line directly; it must come after Blocksize and Length
+            if (lookInsideGZip) {
+                out << "Z-Map2: " << zMap.size() << endl;
+                out.write(reinterpret_cast<const char*>(zMap.data()), zMap.size() * sizeof(gzblock));
             }
 
             // insert separator to mark end of header
-            oss << endl;
+            out << endl;
 
-            // copy block hashes
+            // copy the part of each block's sums that is used, a batch of blocks at a time
             {
-                // create buffer
-                buffer_t buffer(20);
-                std::fill(buffer.begin(), buffer.end(), 0);
+                static constexpr size_t blocksPerBatch = 65536;
 
-                auto readChunk = [&buffer, this]() {
-                    size_t length = 0;
+                const auto blocks = blockSums.size() / blockSumSize;
+                const auto recordSize = static_cast<size_t>(rSumLength + checksumLength);
+                buffer_t buffer(std::min(blocks, blocksPerBatch) * recordSize);
 
-                    if (blockSums.empty())
-                        return length;
+                for (size_t first = 0; first < blocks; first += blocksPerBatch) {
+                    const auto last = std::min(first + blocksPerBatch, blocks);
+                    auto* record = buffer.data();
 
-                    length = buffer.size();
+                    for (auto block = first; block < last; block++, record += recordSize) {
+                        const auto* sums = &blockSums[block * blockSumSize];
 
-                    if (blockSums.size() < buffer.size()) {
-                        length = blockSums.size();
-                        std::fill(buffer.begin() + length, buffer.end(), 0);
+                        memcpy(record, sums + sizeof(rsum) - rSumLength, rSumLength);
+                        memcpy(record + rSumLength, sums + sizeof(rsum), checksumLength);
                     }
 
-                    std::copy(blockSums.begin(), blockSums.begin() + length, buffer.begin());
-                    blockSums.erase(blockSums.begin(), blockSums.begin() + length);
-
-                    return length;
-                };
-
-                while (readChunk() > 0) {
-                    std::copy(buffer.begin() + 4 - rSumLength, buffer.begin() + 4, std::ostream_iterator<char>(oss));
-                    std::copy(buffer.begin() + 4, buffer.begin() + 4 + checksumLength, std::ostream_iterator<char>(oss));
+                    out.write(buffer.data(), (last - first) * recordSize);
                 }
             }
 
+            if (!out) {
+                logMessage("Failed to write .zsync file");
+                return false;
+            }
+
+            return true;
+        }
+
+        bool dump(std::string& data) {
+            std::ostringstream oss;
+
+            if (!write(oss))
+                return false;
+
             data = oss.str();
             return true;
         }
@@ -332,19 +707,17 @@ namespace zsync2 {
             return false;
         }
 
-        std::string data;
-        if (!dump(data))
-            return false;
-
-        ofs << data;
-
-        return true;
+        return d->write(ofs);
     }
 
     void ZSyncFileMaker::setUrl(const std::string& url) {
         d->url = url;
     }
 
+    void ZSyncFileMaker::setLookInsideGZip(bool lookInsideGZip) {
+        d->lookInsideGZip = lookInsideGZip;
+    }
+
     void ZSyncFileMaker::setLogMessageCallback(std::function<void(std::string)> callback) {
         d->logMessage = std::move(callback);
     }
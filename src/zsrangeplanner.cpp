@@ -0,0 +1,71 @@
+/*
+ * zsync2
+ * ======
+ *
+ * zsrangeplanner.cpp: decides which ranges to merge into one request, based on measured latency and throughput.
+ */
+
+// system headers
+#include <algorithm>
+#include <cmath>
+
+// local headers
+#include "zsrangeplanner.h"
+
+namespace zsync2 {
+    // weight of what has been measured so far when adding a new measurement
+    static const double DECAY = 0.8;
+
+    // factor applied to the best rate seen so far with every new measurement
+    static const double RATE_DECAY = 0.95;
+
+    // bodies of small responses tend to arrive in one go, so the time they take to come in says little about the
+    // throughput; assume each took at least this long (in seconds), which errs towards merging less
+    static const double MIN_TRANSFER_TIME = 0.001;
+
+    ZSyncRangePlanner::ZSyncRangePlanner() : requests(0), overheadSum(0), rate(0) {}
+
+    void ZSyncRangePlanner::addMeasurement(const int completedRequests, const double latency, const long long bytes,
+                                           const double transferTime) {
+        if (completedRequests <= 0)
+            return;
+
+        const auto size = static_cast<double>(std::max(bytes, 0ll));
+        const auto time = std::max(transferTime, completedRequests * MIN_TRANSFER_TIME);
+
+        rate = std::max(rate * RATE_DECAY, size / time);
+
+        // whatever the transfer of the data at that rate doesn't explain is the cost of making the requests
+        const auto overhead = std::max(latency, 0.0) + std::max(transferTime, 0.0) - (rate > 0 ? size / rate : 0);
+
+        requests = requests * DECAY + completedRequests;
+        overheadSum = overheadSum * DECAY + std::max(overhead, 0.0);
+    }
+
+    bool ZSyncRangePlanner::hasEstimate() const {
+        return requests > 0;
+    }
+
+    double ZSyncRangePlanner::latency() const {
+        if (!hasEstimate())
+            return 0;
+
+        return overheadSum / requests;
+    }
+
+    double ZSyncRangePlanner::throughput() const {
+        if (!hasEstimate())
+            return 0;
+
+        return rate;
+    }
+
+    long long ZSyncRangePlanner::mergeThreshold(const unsigned int requestsInFlight) const {
+        if (!hasEstimate())
+            return 0;
+
+        // skipping a gap saves downloading it, at gap / throughput seconds, but costs another request; with several
+        // requests in flight, their round trips overlap, so each costs a fraction of one
+        return std::llround(latency() * throughput() / std::max(requestsInFlight, 1u));
+    }
+}
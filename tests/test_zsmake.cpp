@@ -0,0 +1,285 @@
+// gtest includes
+#include <gtest/gtest.h>
+
+// system includes
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+// library includes
+#include "zlib/zlib.h"
+
+// local includes
+#include "zshash.h"
+#include "zsmake.h"
+
+using namespace std;
+using namespace zsync2;
+
+namespace {
+    class ZSyncFileMakerTest : public ::testing::Test {
+    protected:
+        std::string path;
+
+        void SetUp() override {
+            char name[] = "test_zsmake-XXXXXX";
+            auto fd = mkstemp(name);
+            ASSERT_NE(fd, -1);
+            close(fd);
+            path = name;
+        }
+
+        void TearDown() override {
+            unlink(path.c_str());
+            unlink((path + ".zsync").c_str());
+        }
+
+        // writes size bytes of random data to the file, and returns them
+        std::string writeFile(size_t size) {
+            std::mt19937 random(size);
+            std::string data(size, '\0');
+            for (auto& c : data)
+                c = static_cast<char>(random());
+
+            std::ofstream ofs(path, std::ios::binary);
+            ofs.write(data.data(), data.size());
+            return data;
+        }
+
+        // splits the .zsync into its header fields and the block sums after them
+        // the binary Z-Map following its header line, if any, is stored in zMap
+        static std::map<std::string, std::string> parse(const std::string& zsync, std::string& blockSums,
+                                                        std::string* zMap = nullptr) {
+            std::map<std::string, std::string> fields;
+            size_t pos = 0;
+
+            while (true) {
+                auto end = zsync.find('\n', pos);
+                if (end == std::string::npos || end == pos)
+                    break;
+
+                auto line = zsync.substr(pos, end - pos);
+                auto colon = line.find(": ");
+                fields[line.substr(0, colon)] = line.substr(colon + 2);
+                pos = end + 1;
+
+                if (line.substr(0, colon) == "Z-Map2") {
+                    const auto size = std::stoul(fields["Z-Map2"]) * 4;
+                    if (zMap != nullptr)
+                        *zMap = zsync.substr(pos, size);
+                    pos += size;
+                }
+            }
+
+            blockSums = zsync.substr(pos + 1);
+            return fields;
+        }
+
+        // the rsum and MD4 checksum of a block, as stored in a .zsync file before truncating
+        static std::string blockSum(const std::string& block) {
+            unsigned short a = 0, b = 0;
+            auto len = block.size();
+            for (auto c : block) {
+                a += static_cast<unsigned char>(c);
+                b += len-- * static_cast<unsigned char>(c);
+            }
+
+            std::string sum{static_cast<char>(a >> 8), static_cast<char>(a), static_cast<char>(b >> 8),
+                            static_cast<char>(b)};
+
+            auto md4 = ZSyncHash<GCRY_MD_MD4>(block).getHash();
+            for (size_t i = 0; i < md4.size(); i += 2)
+                sum += static_cast<char>(std::stoi(md4.substr(i, 2), nullptr, 16));
+
+            return sum;
+        }
+
+        // writes data to the file, gzip compressed, and returns the compressed data
+        std::string writeGZipFile(const std::string& data) {
+            z_stream zs{};
+            // 16 added to the window bits makes zlib write a gzip header and trailer
+            EXPECT_EQ(deflateInit2(&zs, 9, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY), Z_OK);
+
+            std::string compressed(deflateBound(&zs, data.size()) + 32, '\0');
+            zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+            zs.avail_in = data.size();
+            zs.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+            zs.avail_out = compressed.size();
+
+            EXPECT_EQ(deflate(&zs, Z_FINISH), Z_STREAM_END);
+            compressed.resize(zs.total_out);
+            deflateEnd(&zs);
+
+            std::ofstream ofs(path, std::ios::binary);
+            ofs.write(compressed.data(), compressed.size());
+            return compressed;
+        }
+
+        // checks the .zsync made for data, which has whole blocks of blockSize bytes
+        void checkZSync(const std::string& data, size_t blockSize) {
+            ZSyncFileMaker maker(path);
+            maker.setUrl("http://example.com/file");
+            maker.setLogMessageCallback([](const std::string&) {});
+
+            ASSERT_TRUE(maker.calculateBlockSums());
+
+            std::string zsync;
+            ASSERT_TRUE(maker.dump(zsync));
+
+            std::string blockSums;
+            auto fields = parse(zsync, blockSums);
+
+            // a partial block at the end is left out
+            const auto blocks = data.size() / blockSize;
+            const auto wholeBlocks = data.substr(0, blocks * blockSize);
+
+            EXPECT_EQ(fields["Blocksize"], std::to_string(blockSize));
+            EXPECT_EQ(fields["Length"], std::to_string(wholeBlocks.size()));
+            EXPECT_EQ(fields["SHA-1"], ZSyncHash<GCRY_MD_SHA1>(wholeBlocks).getHash());
+
+            int seqMatches, rSumLength, checksumLength;
+            ASSERT_EQ(sscanf(fields["Hash-Lengths"].c_str(), "%d,%d,%d", &seqMatches, &rSumLength, &checksumLength), 3);
+
+            const auto recordSize = static_cast<size_t>(rSumLength + checksumLength);
+            ASSERT_EQ(blockSums.size(), blocks * recordSize);
+
+            for (size_t block = 0; block < blocks; block++) {
+                auto sum = blockSum(wholeBlocks.substr(block * blockSize, blockSize));
+                auto expected = sum.substr(4 - rSumLength, rSumLength) + sum.substr(4, checksumLength);
+
+                ASSERT_EQ(blockSums.substr(block * recordSize, recordSize), expected) << "block " << block;
+            }
+        }
+    };
+
+    TEST_F(ZSyncFileMakerTest, TestSmallFile) {
+        auto data = writeFile(3 * 2048);
+        checkZSync(data, 2048);
+    }
+
+    TEST_F(ZSyncFileMakerTest, TestPartialLastBlock) {
+        auto data = writeFile(5 * 2048 + 1000);
+        checkZSync(data, 2048);
+    }
+
+    TEST_F(ZSyncFileMakerTest, TestSeveralChunks) {
+        // more than is read at once, so the block sums are put together from several chunks
+        auto data = writeFile(20 * 1024 * 1024 + 4096 + 17);
+        checkZSync(data, 2048);
+    }
+
+    TEST_F(ZSyncFileMakerTest, TestGZipFile) {
+        // text with some repetition, so there are matches and several zlib blocks, and some random data in stored
+        // blocks, ending with a partial block
+        std::string data;
+        std::mt19937 random(42);
+        for (int line = 0; data.size() < 600 * 1024; line++)
+            data += "line " + std::to_string(line) + ": " + std::to_string(random() % 1000) + " bottles of beer\n";
+        for (int i = 0; i < 100 * 1024 + 123; i++)
+            data += static_cast<char>(random());
+
+        const auto compressed = writeGZipFile(data);
+        const size_t blockSize = 2048;
+
+        ZSyncFileMaker maker(path);
+        maker.setUrl("http://example.com/file.gz");
+        maker.setLookInsideGZip(true);
+        maker.setLogMessageCallback([](const std::string&) {});
+        ASSERT_TRUE(maker.calculateBlockSums());
+
+        std::string zsync;
+        ASSERT_TRUE(maker.dump(zsync));
+
+        std::string blockSums, zMap;
+        auto fields = parse(zsync, blockSums, &zMap);
+
+        // the .zsync describes the uncompressed data, in full, and points to the compressed file
+        EXPECT_EQ(fields["Length"], std::to_string(data.size()));
+        EXPECT_EQ(fields["SHA-1"], ZSyncHash<GCRY_MD_SHA1>(data).getHash());
+        EXPECT_EQ(fields["Z-URL"], "http://example.com/file.gz");
+        EXPECT_EQ(fields["Z-Filename"], path);
+        EXPECT_EQ(fields.count("URL"), 0);
+
+        int seqMatches, rSumLength, checksumLength;
+        ASSERT_EQ(sscanf(fields["Hash-Lengths"].c_str(), "%d,%d,%d", &seqMatches, &rSumLength, &checksumLength), 3);
+        const auto recordSize = static_cast<size_t>(rSumLength + checksumLength);
+
+        // the last block is padded with zeroes
+        const auto blocks = (data.size() + blockSize - 1) / blockSize;
+        ASSERT_EQ(blockSums.size(), blocks * recordSize);
+        auto lastBlock = data.substr((blocks - 1) * blockSize);
+        lastBlock.resize(blockSize, '\0');
+        auto sum = blockSum(lastBlock);
+        EXPECT_EQ(blockSums.substr((blocks - 1) * recordSize),
+                  sum.substr(4 - rSumLength, rSumLength) + sum.substr(4, checksumLength));
+
+        // the Z-Map starts with the first zlib block after the gzip header, has points after each block of the
+        // uncompressed data, and ends with the end of the compressed file
+        ASSERT_GT(zMap.size(), 0);
+        long long in = 0, out = 0;
+        size_t entries = zMap.size() / 4;
+        std::vector<long long> outOffsets;
+
+        for (size_t i = 0; i < entries; i++) {
+            uint16_t inOffset, outOffset;
+            memcpy(&inOffset, &zMap[i * 4], 2);
+            memcpy(&outOffset, &zMap[i * 4 + 2], 2);
+            inOffset = ntohs(inOffset);
+            outOffset = ntohs(outOffset);
+
+            if (i == 0) {
+                EXPECT_EQ(inOffset, 10 * 8);
+                EXPECT_EQ(outOffset, 0);
+            }
+
+            in += inOffset;
+            out += outOffset & 0x7fff;
+            outOffsets.push_back(out);
+        }
+
+        EXPECT_EQ(in, compressed.size() * 8);
+        EXPECT_EQ(out, data.size());
+
+        for (size_t block = 1; block < blocks; block++) {
+            auto next = std::lower_bound(outOffsets.begin(), outOffsets.end(), block * blockSize);
+            ASSERT_NE(next, outOffsets.end());
+            EXPECT_LT(*next - block * blockSize, blockSize) << "block " << block;
+        }
+    }
+
+    TEST_F(ZSyncFileMakerTest, TestNotAGZipFile) {
+        writeFile(3 * 2048);
+
+        ZSyncFileMaker maker(path);
+        maker.setLookInsideGZip(true);
+        maker.setLogMessageCallback([](const std::string&) {});
+        EXPECT_FALSE(maker.calculateBlockSums());
+    }
+
+    TEST_F(ZSyncFileMakerTest, TestSaveMatchesDump) {
+        writeFile(7 * 2048);
+
+        ZSyncFileMaker maker(path);
+        maker.setUrl("http://example.com/file");
+        maker.setLogMessageCallback([](const std::string&) {});
+        ASSERT_TRUE(maker.calculateBlockSums());
+
+        std::string first, second;
+        ASSERT_TRUE(maker.dump(first));
+        ASSERT_TRUE(maker.dump(second));
+        EXPECT_EQ(first, second);
+
+        ASSERT_TRUE(maker.saveZSyncFile(path + ".zsync"));
+        std::ifstream ifs(path + ".zsync", std::ios::binary);
+        std::string saved((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        EXPECT_EQ(saved, first);
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
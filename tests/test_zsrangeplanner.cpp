@@ -0,0 +1,66 @@
+// gtest includes
+#include <gtest/gtest.h>
+
+// local includes
+#include "zsrangeplanner.h"
+
+using namespace std;
+using namespace zsync2;
+
+namespace {
+    TEST(ZSyncRangePlanner, TestNoMeasurements) {
+        ZSyncRangePlanner planner;
+
+        EXPECT_FALSE(planner.hasEstimate());
+        EXPECT_EQ(planner.mergeThreshold(1), 0);
+
+        // reports without any completed requests don't count
+        planner.addMeasurement(0, 0, 0, 0);
+        EXPECT_FALSE(planner.hasEstimate());
+    }
+
+    TEST(ZSyncRangePlanner, TestThreshold) {
+        ZSyncRangePlanner planner;
+
+        // two requests, 100 ms round trip each, 1 MB in 0.5 s
+        planner.addMeasurement(2, 0.2, 1000000, 0.5);
+
+        EXPECT_TRUE(planner.hasEstimate());
+        EXPECT_DOUBLE_EQ(planner.latency(), 0.1);
+        EXPECT_DOUBLE_EQ(planner.throughput(), 2000000);
+
+        // in one round trip, 200 kB could have been downloaded instead
+        EXPECT_EQ(planner.mergeThreshold(1), 200000);
+        // with requests overlapping, each costs less
+        EXPECT_EQ(planner.mergeThreshold(4), 50000);
+        EXPECT_EQ(planner.mergeThreshold(0), planner.mergeThreshold(1));
+    }
+
+    TEST(ZSyncRangePlanner, TestSmallTransfers) {
+        ZSyncRangePlanner planner;
+
+        // a body which arrives all at once must not make the throughput look unbounded
+        planner.addMeasurement(1, 0.05, 4096, 0);
+
+        EXPECT_DOUBLE_EQ(planner.throughput(), 4096 / 0.001);
+    }
+
+    TEST(ZSyncRangePlanner, TestFollowsChanges) {
+        ZSyncRangePlanner planner;
+
+        planner.addMeasurement(1, 0.01, 1000000, 1);
+        const auto before = planner.mergeThreshold(1);
+
+        // latency goes up, so merging should pay off for larger gaps
+        for (int i = 0; i < 20; i++)
+            planner.addMeasurement(1, 0.2, 1000000, 1);
+
+        EXPECT_GT(planner.mergeThreshold(1), before);
+        EXPECT_NEAR(planner.latency(), 0.2, 0.01);
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}